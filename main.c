@@ -1,20 +1,125 @@
+#include "src/allocation.h"
 #include "src/cli.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+static const char usage[] =
+    "usage: %s [--gc options] [--stack size] [--jit threshold] [--registers] "
+    "[path]\n"
+    "       %s --compile output path\n"
+    "\n"
+    "  --gc options  comma separated garbage collector settings, e.g.\n"
+    "                nursery=256k,growth=50,min=1m,max=0 (no maximum).\n"
+    "                Also read from the MONKE_GC environment variable.\n"
+    "  --stack size  maximum number of values on the stack, and of nested\n"
+    "                function calls (default 1048576).\n"
+    "  --jit threshold  number of calls or loop iterations of a function\n"
+    "                before it is compiled to machine code, 0 to only\n"
+    "                interpret it (default 1000).\n"
+    "  --registers   translate hot functions to register-based instructions\n"
+    "                instead of machine code, see src/registers.h.\n"
+    "  --compile output  compile the program at path to C source code in\n"
+    "                output, see src/aot.h.\n";
+
+static bool
+gc_options(Options *opts, const char *name, const char *options) {
+    error err = parse_gc_config(&opts->gc, options);
+    if (err) {
+        fprintf(stderr, "error: %s: %s\n", name, err->message);
+        free_error(err);
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc == 1) {
+    Options opts = {
+        .gc = DefaultGCConfig,
+        .max_stack_size = DefaultMaxStackSize,
+        .jit_threshold = DefaultJitThreshold,
+    };
+
+    char *env = getenv("MONKE_GC");
+    if (env && !gc_options(&opts, "MONKE_GC", env)) {
+        return EXIT_FAILURE;
+    }
+
+    char *path = NULL, *output = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, usage, argv[0], argv[0]);
+                return EXIT_FAILURE;
+            }
+            if (!gc_options(&opts, "--gc", argv[++i])) {
+                return EXIT_FAILURE;
+            }
+
+        } else if (strcmp(argv[i], "--stack") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, usage, argv[0], argv[0]);
+                return EXIT_FAILURE;
+            }
+            char *end;
+            long size = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || size <= 0 || size > INT_MAX) {
+                fprintf(stderr, "error: --stack: invalid size '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            opts.max_stack_size = size;
+
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, usage, argv[0], argv[0]);
+                return EXIT_FAILURE;
+            }
+            char *end;
+            long threshold = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threshold < 0 || threshold > INT_MAX) {
+                fprintf(stderr, "error: --jit: invalid threshold '%s'\n",
+                        argv[i]);
+                return EXIT_FAILURE;
+            }
+            opts.jit_threshold = threshold;
+
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            opts.registers = true;
+
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, usage, argv[0], argv[0]);
+                return EXIT_FAILURE;
+            }
+            output = argv[++i];
+
+        } else if (path == NULL) {
+            path = argv[i];
+
+        } else {
+            fprintf(stderr, "error: expect only optional path to program\n");
+            fprintf(stderr, usage, argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (output) {
+        if (path == NULL) {
+            fprintf(stderr, usage, argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+        return compile_c(path, output);
+    }
+
+    if (path == NULL) {
         printf("Hello %s! This is the Monke Programming Language!\n",
                 getlogin());
-        repl(stdin, stdout);
+        repl(stdin, stdout, &opts);
         return EXIT_SUCCESS;
-
-    } else if (argc > 2) {
-        fprintf(stderr, "error: expect only optional path to program\n");
-        return EXIT_FAILURE;
     }
 
-    return run(argv[1]);
+    return run(path, &opts);
 }
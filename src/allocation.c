@@ -7,6 +7,10 @@
 #include "table.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -29,27 +33,34 @@ CharBuffer *create_string(VM *vm, const char *text, int length) {
     return buf;
 }
 
-ObjectBuffer *create_array(VM *vm, Object *data, int length) {
-    Object *objs = NULL;
+Array *create_array(VM *vm, Object *data, int length) {
+    ObjectType *types = NULL;
+    ObjectData *datas = NULL;
 
     if (length > 0) {
-        size_t size = length * sizeof(Object);
-        objs = vm_allocate(vm, size);
-        if (data) { memcpy(objs, data, size); }
+        types = vm_allocate(vm, length * sizeof(ObjectType));
+        datas = vm_allocate(vm, length * sizeof(ObjectData));
     }
 
-    ObjectBuffer *buf = new_allocation(vm, o_Array, sizeof(ObjectBuffer));
-    *buf = (ObjectBuffer) {
-        .data = objs,
+    Array *arr = new_allocation(vm, o_Array, sizeof(Array));
+    *arr = (Array) {
+        .types = types,
+        .data = datas,
         .length = length,
         .capacity = length,
     };
-    return buf;
+
+    if (data) {
+        for (int i = 0; i < length; i++) {
+            array_set(arr, i, data[i]);
+        }
+    }
+    return arr;
 }
 
 Table *create_table(VM *vm) {
     Table *tbl = new_allocation(vm, o_Table, sizeof(Table));
-    void *err = table_init(tbl);
+    void *err = table_init_shaped(tbl, vm->root_shape);
     if (err == NULL) { die("create_table:"); }
     return tbl;
 }
@@ -88,18 +99,17 @@ Object object_copy(VM* vm, Object obj) {
 
         case o_String:
             {
-                CharBuffer* new_str =
-                    create_string(vm, NULL, obj.data.string->length);
+                CharBuffer *str = obj.data.string,
+                           *new_str = create_string(vm, str->data, str->length);
                 return OBJ(o_String, .string = new_str);
             }
 
         case o_Array:
             {
-                ObjectBuffer old = *obj.data.array,
-                            *new_arr = create_array(vm, NULL, old.length);
-                Object *new_buf = new_arr->data;
+                Array old = *obj.data.array,
+                      *new_arr = create_array(vm, NULL, old.length);
                 for (int i = 0; i < old.length; i++) {
-                    new_buf[i] = object_copy(vm, old.data[i]);
+                    array_set(new_arr, i, object_copy(vm, array_get(&old, i)));
                 }
                 return OBJ(o_Array, .array = new_arr);
             }
@@ -126,19 +136,25 @@ Object object_copy(VM* vm, Object obj) {
 
 
 static void mark_objs(Object *objs, int len);
+static void trace_children(Object obj);
 
-void mark(Object obj) {
+// Mark [obj], return false if it was already marked.
+static bool
+mark(Object obj) {
     assert(obj.type >= o_String);
 
+    // access Allocation prepended to ptr with [vm_allocate]
+    Allocation *alloc = ((Allocation *)obj.data.ptr) - 1;
+    if (alloc->is_marked) { return false; }
+
 #ifdef DEBUG
     printf("mark: ");
     object_fprint(obj, stdout);
     putc('\n', stdout);
 #endif
 
-    // access Allocation prepended to ptr with [vm_allocate]
-    Allocation *alloc = ((Allocation *)obj.data.ptr) - 1;
     alloc->is_marked = true;
+    return true;
 }
 
 static void mark_module(Module *m) {
@@ -165,37 +181,50 @@ trace_mark_object(Object obj) {
             break;
 
         case o_String:
-            mark(obj);
+        case o_Closure:
+        case o_Array:
+        case o_Table:
+            if (mark(obj)) {
+                trace_children(obj);
+            }
+            break;
+
+        case o_Module:
+            mark_module(obj.data.module);
             break;
 
+        default:
+            die("trace_mark_object: type %s (%d) not handled",
+                    show_object_type(obj.type), obj.type);
+    }
+}
+
+// Mark the Objects referenced by [obj].
+static void
+trace_children(Object obj) {
+    switch (obj.type) {
         case o_Closure:
-            mark(obj);
             for (int i = 0; i < obj.data.closure->num_free; i++)
                 trace_mark_object(obj.data.closure->free[i]);
             break;
 
         case o_Array:
-            mark(obj);
             for (int i = 0; i < obj.data.array->length; i++)
-                trace_mark_object(obj.data.array->data[i]);
+                trace_mark_object(array_get(obj.data.array, i));
             break;
 
         case o_Table:
-            mark(obj);
-            tbl_it it = tbl_iterator(obj.data.table);
-            while (tbl_next(&it)) {
-                trace_mark_object(it.cur_key);
-                trace_mark_object(it.cur_val);
+            {
+                tbl_it it = tbl_iterator(obj.data.table);
+                while (tbl_next(&it)) {
+                    trace_mark_object(it.cur_key);
+                    trace_mark_object(it.cur_val);
+                }
             }
             break;
 
-        case o_Module:
-            mark_module(obj.data.module);
-            break;
-
         default:
-            die("trace_mark_object: type %s (%d) not handled",
-                    show_object_type(obj.type), obj.type);
+            break;
     }
 }
 
@@ -231,7 +260,8 @@ void free_allocation(Allocation *alloc) {
             break;
 
         case o_Array:
-            free(((ObjectBuffer *)obj_data)->data);
+            free(((Array *)obj_data)->types);
+            free(((Array *)obj_data)->data);
             break;
 
         case o_Table:
@@ -248,7 +278,133 @@ void free_allocation(Allocation *alloc) {
     free(alloc);
 }
 
-void mark_and_sweep(VM *vm) {
+// Approximate number of bytes used by [alloc].
+static size_t
+allocation_size(Allocation *alloc) {
+    void *obj_data = alloc->object_data;
+    size_t size = sizeof(Allocation);
+
+    switch (alloc->type) {
+        case o_String:
+            return size + sizeof(CharBuffer)
+                + ((CharBuffer *)obj_data)->capacity + 1;
+
+        case o_Array:
+            return size + sizeof(Array)
+                + ((Array *)obj_data)->capacity
+                    * (sizeof(ObjectType) + sizeof(ObjectData));
+
+        case o_Table:
+            return size + sizeof(Table) + table_memory(obj_data);
+
+        case o_Closure:
+            return size + sizeof(Closure)
+                + ((Closure *)obj_data)->num_free * sizeof(Object);
+
+        default:
+            die("allocation_size: %d typ not handled\n", alloc->type);
+            return 0;
+    }
+}
+
+// from wren: size of old objects which triggers the next full collection,
+// after [live] bytes survived the last one.
+static size_t
+full_gc_threshold(GCConfig *config, size_t live) {
+    size_t threshold = live + live * config->heap_growth_percent / 100;
+    if (threshold < config->min_heap_size) {
+        threshold = config->min_heap_size;
+    }
+    if (config->max_heap_size && threshold > config->max_heap_size) {
+        threshold = config->max_heap_size;
+    }
+    return threshold;
+}
+
+void gc_configure(VM *vm, GCConfig config) {
+    vm->gc = config;
+    vm->bytesTillGC = config.nursery_size;
+    vm->next_full_gc = full_gc_threshold(&vm->gc, vm->old_bytes);
+}
+
+error parse_gc_config(GCConfig *config, const char *options) {
+    const char *cur = options;
+    while (*cur) {
+        int len = strcspn(cur, ","),
+            key_len = strcspn(cur, "=");
+        if (key_len >= len) {
+            return errorf("gc option '%.*s' expects a value", len, cur);
+        }
+
+        const char *value = cur + key_len + 1;
+        char *end;
+        errno = 0;
+        // strtoull() accepts a sign, and wraps negative numbers.
+        unsigned long long num = strtoull(value, &end, 10);
+        if (!isdigit((unsigned char) *value) || errno) {
+            return errorf("invalid value for gc option '%.*s'", len, cur);
+        }
+
+        int shift = 0;
+        switch (*end) {
+            case 'k': case 'K': shift = 10; end++; break;
+            case 'm': case 'M': shift = 20; end++; break;
+            case 'g': case 'G': shift = 30; end++; break;
+        }
+        if (end != cur + len || num > SIZE_MAX >> shift) {
+            return errorf("invalid value for gc option '%.*s'", len, cur);
+        }
+        num <<= shift;
+
+#define KEY(name) \
+        (key_len == sizeof(name) - 1 && strncmp(cur, name, key_len) == 0)
+
+        if (KEY("nursery")) {
+            if (num == 0) {
+                return errorf("gc option '%.*s' must be positive", len, cur);
+            }
+            config->nursery_size = num;
+        } else if (KEY("growth")) {
+            if (num > INT_MAX) {
+                return errorf("gc option '%.*s' is too large", len, cur);
+            }
+            config->heap_growth_percent = num;
+        } else if (KEY("min")) {
+            config->min_heap_size = num;
+        } else if (KEY("max")) {
+            config->max_heap_size = num;
+        } else {
+            return errorf("unknown gc option '%.*s'", key_len, cur);
+        }
+
+#undef KEY
+
+        cur += len;
+        if (*cur == ',') { cur++; }
+    }
+
+    // a max of 0 is no limit, see full_gc_threshold().
+    if (config->max_heap_size
+            && config->min_heap_size > config->max_heap_size) {
+        return errorf("gc option 'min' is greater than 'max'");
+    }
+    return 0;
+}
+
+// The keys of Shapes are only referenced by Shapes, which live as long as the
+// VM.
+static void
+mark_shape(Shape *shape) {
+    for (int i = 0; i < shape->num_transitions; i++) {
+        Shape *child = shape->transitions[i];
+        trace_mark_object(OBJ(o_String,
+                              .string = child->keys[child->num_keys - 1]));
+        mark_shape(child);
+    }
+}
+
+static void
+mark_roots(VM *vm) {
 #ifdef DEBUG
     puts("stack:");
 #endif
@@ -274,6 +430,16 @@ void mark_and_sweep(VM *vm) {
 #endif
     mark_objs(vm->globals, vm->num_globals);
 
+#ifdef DEBUG
+    puts("\nconstants:");
+#endif
+    mark_objs(vm->constants, vm->num_constants);
+
+#ifdef DEBUG
+    puts("\nshapes:");
+#endif
+    mark_shape(vm->root_shape);
+
 #ifdef DEBUG
     putc('\n', stdout);
 #endif
@@ -281,21 +447,91 @@ void mark_and_sweep(VM *vm) {
     while (ht_next(&it)) {
         mark_module(it.current->value);
     }
+}
+
+// Free unmarked young objects and move the rest to the [VM.old] list.
+static void
+sweep_young(VM *vm) {
+    Allocation *cur = vm->young;
+    while (cur) {
+        Allocation *next = cur->next;
+
+        if (cur->is_marked) {
+            // stays marked, see [Allocation.is_marked].
+            cur->is_old = true;
+            cur->next = vm->old;
+            vm->old = cur;
+            vm->old_bytes += allocation_size(cur);
+            cur = next;
+            continue;
+        }
+
+        free_allocation(cur);
+        cur = next;
+    }
+    vm->young = NULL;
+}
+
+void remember_allocation(VM *vm, Allocation *alloc) {
+    alloc->is_remembered = true;
+    BufferPush(&vm->remembered, alloc);
+}
+
+static void
+forget_remembered(VM *vm) {
+    for (int i = 0; i < vm->remembered.length; i++) {
+        Allocation *alloc = vm->remembered.data[i];
+        alloc->is_remembered = false;
+    }
+    vm->remembered.length = 0;
+}
+
+void minor_collection(VM *vm) {
+    mark_roots(vm);
+
+#ifdef DEBUG
+    puts("\nremembered:");
+#endif
+    for (int i = 0; i < vm->remembered.length; i++) {
+        Allocation *alloc = vm->remembered.data[i];
+        trace_children(OBJ(alloc->type, .ptr = alloc->object_data));
+    }
+    // after the sweep, there are no young objects left to be referenced.
+    forget_remembered(vm);
 
 #ifdef DEBUG
     puts("\nsweep:");
 #endif
+    sweep_young(vm);
 
-    // sweep and rebuild Linked list of [Allocations] (in reverse).
-    Allocation *cur = vm->last,
+#ifdef DEBUG
+    putc('\n', stdout);
+#endif
+}
+
+void mark_and_sweep(VM *vm) {
+    for (Allocation *cur = vm->old; cur; cur = cur->next) {
+        cur->is_marked = false;
+    }
+    forget_remembered(vm);
+
+    mark_roots(vm);
+
+#ifdef DEBUG
+    puts("\nsweep:");
+#endif
+
+    // sweep and rebuild Linked list of old [Allocations] (in reverse).
+    Allocation *cur = vm->old,
                *prev_marked = NULL;
+    vm->old_bytes = 0;
     while (cur) {
         Allocation *next = cur->next;
 
         if (cur->is_marked) {
-            cur->is_marked = false;
             cur->next = prev_marked;
             prev_marked = cur;
+            vm->old_bytes += allocation_size(cur);
             cur = next;
             continue;
         }
@@ -303,7 +539,11 @@ void mark_and_sweep(VM *vm) {
         free_allocation(cur);
         cur = next;
     }
-    vm->last = prev_marked;
+    vm->old = prev_marked;
+
+    sweep_young(vm);
+
+    vm->next_full_gc = full_gc_threshold(&vm->gc, vm->old_bytes);
 
 #ifdef DEBUG
     putc('\n', stdout);
@@ -313,15 +553,20 @@ void mark_and_sweep(VM *vm) {
 void *vm_allocate(VM *vm, size_t size) {
     vm->bytesTillGC -= size;
     if (vm->bytesTillGC <= 0) {
+        bool full = vm->old_bytes >= vm->next_full_gc;
 #ifdef DEBUG
-        if (vm->last) {
+        if (vm->young || vm->old) {
             putc('\n', stdout);
-            printf("starting mark_and_sweep\n");
+            printf("starting %s\n", full ? "mark_and_sweep" : "minor_collection");
         }
 #endif
 
-        mark_and_sweep(vm);
-        vm->bytesTillGC = NextGC;
+        if (full) {
+            mark_and_sweep(vm);
+        } else {
+            minor_collection(vm);
+        }
+        vm->bytesTillGC = vm->gc.nursery_size;
     }
 
     void *ptr = malloc(size);
@@ -335,10 +580,12 @@ new_allocation(VM *vm, ObjectType type, size_t size) {
     Allocation *ptr = vm_allocate(vm, size + sizeof(Allocation));
     *ptr = (Allocation){
         .is_marked = false,
+        .is_old = false,
+        .is_remembered = false,
         .type = type,
-        .next = vm->last,
+        .next = vm->young,
     };
-    vm->last = ptr;
+    vm->young = ptr;
 
     return ptr->object_data;
 }
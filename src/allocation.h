@@ -3,6 +3,16 @@
 // This module manages the allocation and garbage collection of Compound Data
 // Types.  Garbage collection based on the Boot.dev memory management in C
 // course https://youtu.be/rJrd2QMVbGM and wren https://github.com/wren-lang/wren.
+//
+// The garbage collector is generational: new objects are young, and most of
+// them (temporary strings and arrays) are unreachable by the next collection.
+// A minor collection only traces the roots and the remembered set, stopping at
+// old objects, frees the unreachable young objects and promotes the rest.
+// Objects are never moved, as pointers to them are held in C locals across
+// allocations.
+//
+// Old objects which have a young object stored in them must be passed to
+// write_barrier(), to be traced by the next minor collection.
 
 #include "object.h"
 #include "vm.h"
@@ -18,9 +28,15 @@ Object object_copy(VM* vm, Object obj);
 // in the garbage collector.
 typedef struct Allocation {
     ObjectType type;
+
+    // Outside of a full collection, true for all old objects, so that the
+    // marking of a minor collection stops at them.
     bool is_marked;
 
-    // All Allocations are stored in a linked list.
+    bool is_old;
+    bool is_remembered; // in [VM.remembered]
+
+    // Allocations are stored in the [VM.young] or [VM.old] linked list.
     struct Allocation *next;
 
     void *object_data[]; // used to access data after struct.
@@ -30,10 +46,34 @@ typedef struct Allocation {
 void *vm_allocate(VM *vm, size_t size);
 
 void free_allocation(Allocation *alloc);
+
+// Free unreachable young objects and promote the rest.
+void minor_collection(VM *vm);
+
+// Free all unreachable objects.
 void mark_and_sweep(VM *vm);
 
+// Set [vm]s garbage collector settings.
+void gc_configure(VM *vm, GCConfig config);
+
+// Update [config] with comma separated `key=value` [options], where key is
+// one of `nursery`, `growth`, `min` or `max`.  Sizes are in bytes, with an
+// optional `k`, `m` or `g` suffix, `growth` is a percentage.
+error parse_gc_config(GCConfig *config, const char *options);
+
+void remember_allocation(VM *vm, Allocation *alloc);
+
+// Called after storing an Object in [container], an Array, Table or Closure.
+static inline void
+write_barrier(VM *vm, Object container) {
+    Allocation *alloc = ((Allocation *)container.data.ptr) - 1;
+    if (alloc->is_old && !alloc->is_remembered) {
+        remember_allocation(vm, alloc);
+    }
+}
+
 CharBuffer *create_string(VM *vm, const char *text, int length);
-ObjectBuffer *create_array(VM *vm, Object *data, int length);
+Array *create_array(VM *vm, Object *data, int length);
 Table *create_table(VM *vm);
 Closure *create_closure(VM *vm, CompiledFunction *func, Object *free,
                         int num_free);
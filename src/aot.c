@@ -0,0 +1,469 @@
+#include "aot.h"
+#include "code.h"
+#include "compiler.h"
+#include "constants.h"
+#include "errors.h"
+#include "object.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The CompiledFunctions of the Program compiled by [c], in the order of
+// [AotProgram.functions].
+static Buffer
+compiled_functions(Compiler *c) {
+    Buffer functions;
+    BufferInit(&functions);
+    BufferPush(&functions, bytecode(c).main_function);
+    for (int i = 0; i < c->constants.length; i++) {
+        if (c->constants.data[i].type == c_Function) {
+            BufferPush(&functions, c->constants.data[i].data.function);
+        }
+    }
+    return functions;
+}
+
+static uint64_t
+instructions_hash(CompiledFunction *fn) {
+    return hash_string_fnv1a((char *) fn->instructions.data,
+                             fn->instructions.length);
+}
+
+void aot_attach(Compiler *c, const AotProgram *program) {
+    Buffer functions = compiled_functions(c);
+    if (functions.length != program->num_functions) {
+        die("aot_attach: compiled %d functions instead of %d",
+            functions.length, program->num_functions);
+    }
+
+    for (int i = 0; i < functions.length; i++) {
+        CompiledFunction *fn = functions.data[i];
+        if (instructions_hash(fn) != program->hashes[i]) {
+            die("aot_attach: function %d was compiled differently", i);
+        }
+
+        JitCode *code = calloc(1, sizeof(JitCode));
+        if (code == NULL) { die("aot_attach: calloc"); }
+        code->function = program->functions[i];
+
+        fn->jit = code;
+        fn->hotness = INT_MAX; // not compiled again, see RESUME_HOT().
+    }
+    free(functions.data);
+}
+
+typedef struct {
+    FILE *out;
+    Compiler *c;
+    CompiledFunction *fn;
+
+    // Stack depth before each instruction, and at the end of [fn], see
+    // stack_depths().
+    IntBuffer depths;
+
+    // see jump_targets().
+    IntBuffer targets;
+    IntBuffer entries;
+
+    // Whether the C function exits before the instruction at each position.
+    IntBuffer exits;
+
+    // Index of the word of each position, see word_positions().
+    int *positions;
+
+    // Number of variables for the Objects on the stack, see write_function().
+    int num_slots;
+} Translation;
+
+// Write an Object with the value of constant [k].
+static void
+write_constant(Translation *t, int k) {
+    Constant constant = t->c->constants.data[k];
+    switch (constant.type) {
+        case c_Integer:
+            if (constant.data.integer == LONG_MIN) {
+                fprintf(t->out, "OBJ(o_Integer, .integer = LONG_MIN)");
+            } else {
+                fprintf(t->out, "OBJ(o_Integer, .integer = %ldL)",
+                        constant.data.integer);
+            }
+            return;
+
+        case c_Float:
+            if (isfinite(constant.data.floating)) {
+                fprintf(t->out, "OBJ(o_Float, .floating = %a)",
+                        constant.data.floating);
+                return;
+            }
+            break;
+
+        default:
+            break;
+    }
+    // Strings are created by the VM, see materialize_constants().
+    fprintf(t->out, "vm->constants[%d]", k);
+}
+
+// Exit before the instruction at [pos] if [condition] is false, always if
+// NULL.
+static void
+exit_unless(Translation *t, int pos, const char *condition, ...) {
+    t->exits.data[pos] = true;
+    if (condition == NULL) {
+        fprintf(t->out, "    goto exit_%d;\n", pos);
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, condition);
+    fprintf(t->out, "    if (!");
+    vfprintf(t->out, condition, ap);
+    fprintf(t->out, ") { goto exit_%d; }\n", pos);
+    va_end(ap);
+}
+
+// The Opcode from OpAdd to OpGreaterThan of quickened or typed [op], and the
+// C function which runs it.
+static Opcode
+binary_operation(Opcode op, const char **function) {
+    if (op >= OpAdd && op <= OpGreaterThan) {
+        *function = "aot_binary_operation";
+        return op;
+    } else if (op >= OpAddInt && op <= OpGreaterThanInt) {
+        *function = "aot_binary_operation";
+        return OpAdd + (op - OpAddInt);
+    } else if (op >= OpAddFloat && op <= OpGreaterThanFloat) {
+        *function = "aot_binary_operation";
+        return OpAdd + (op - OpAddFloat);
+    } else if (op >= OpIAdd && op <= OpIGreaterThan) {
+        *function = "aot_integer_operation";
+        return OpAdd + (op - OpIAdd);
+    } else if (op >= OpFAdd && op <= OpFGreaterThan) {
+        *function = "aot_float_operation";
+        return OpAdd + (op - OpFAdd);
+    }
+    return 0;
+}
+
+// The variable of the Object at [depth] on the stack.
+static int
+slot(Translation *t, int depth) {
+    if (depth >= t->num_slots) { t->num_slots = depth + 1; }
+    return depth;
+}
+
+// Write the C code of the instruction at [pos].
+static void
+write_instruction(Translation *t, int pos) {
+    FILE *out = t->out;
+    Instructions *ins = &t->fn->instructions;
+    Opcode op = ins->data[pos];
+    uint8_t *operands = ins->data + pos + 1;
+    int d = t->depths.data[pos];
+#define OPERAND(i) read_big_endian_uint24(operands + 3 * (i))
+    const char *function;
+    Opcode generic;
+
+    switch (op) {
+        case OpConstant:
+            fprintf(out, "    s%d = ", slot(t, d));
+            write_constant(t, OPERAND(0));
+            fprintf(out, ";\n");
+            break;
+
+        case OpPop:
+            // see vm_last_popped().
+            if (pos + 1 == ins->length) {
+                fprintf(out, "    stack[%d] = s%d;\n", d - 1, d - 1);
+            }
+            break;
+
+        case OpTrue:
+        case OpFalse:
+            fprintf(out, "    s%d = OBJ_BOOL(%s);\n", slot(t, d),
+                    op == OpTrue ? "true" : "false");
+            break;
+        case OpNothing:
+            fprintf(out, "    s%d = OBJ_NOTHING;\n", slot(t, d));
+            break;
+
+        case OpGetLocal:
+            fprintf(out, "    s%d = locals[%d];\n", slot(t, d), OPERAND(0));
+            break;
+        case OpGetLocal2:
+            fprintf(out, "    s%d = locals[%d];\n", slot(t, d), OPERAND(0));
+            fprintf(out, "    s%d = locals[%d];\n", slot(t, d + 1), OPERAND(1));
+            break;
+        case OpSetLocal:
+            fprintf(out, "    locals[%d] = s%d;\n", OPERAND(0), d - 1);
+            break;
+
+        case OpGetGlobal:
+            fprintf(out, "    s%d = globals[%d];\n", slot(t, d),
+                    OPERAND(0));
+            break;
+        case OpSetGlobal:
+            fprintf(out, "    globals[%d] = s%d;\n",
+                    OPERAND(0), d - 1);
+            break;
+
+        case OpGetFree:
+            fprintf(out, "    s%d = frame->function.data.closure->free[%d];\n",
+                    slot(t, d), OPERAND(0));
+            break;
+        case OpCurrentClosure:
+            fprintf(out, "    s%d = frame->function;\n", slot(t, d));
+            break;
+
+        case OpJump:
+            fprintf(out, "    goto i%d;\n", OPERAND(0));
+            break;
+        case OpJumpNotTruthy:
+            fprintf(out, "    if (!aot_truthy(s%d)) { goto i%d; }\n",
+                    d - 1, OPERAND(0));
+            break;
+
+        case OpJumpNotEqual:
+        case OpJumpEqual:
+        case OpJumpNotLessThan:
+        case OpJumpNotGreaterThan:
+            generic = OpEqual + (op - OpJumpNotEqual);
+            exit_unless(t, pos, "aot_binary_operation(%s, &s%d, &s%d)",
+                        lookup(generic)->name, d - 2, d - 1);
+            fprintf(out, "    if (!s%d.data.boolean) { goto i%d; }\n",
+                    d - 2, OPERAND(0));
+            break;
+
+        case OpIncrementLocal:
+            fprintf(out, "    s%d = locals[%d];\n", slot(t, d), OPERAND(0));
+            fprintf(out, "    s%d = ", slot(t, d + 1));
+            write_constant(t, OPERAND(1));
+            fprintf(out, ";\n");
+            exit_unless(t, pos, "aot_binary_operation(OpAdd, &s%d, &s%d)",
+                        d, d + 1);
+            fprintf(out, "    locals[%d] = s%d;\n", OPERAND(0), d);
+            break;
+
+        case OpMinus:
+            exit_unless(t, pos, "aot_minus(&s%d)", d - 1);
+            break;
+        case OpBang:
+            fprintf(out, "    s%d = aot_bang(s%d);\n", d - 1, d - 1);
+            break;
+
+        case OpArrayIndex:
+            fprintf(out, "    s%d = aot_array_index(s%d, s%d);\n",
+                    d - 2, d - 2, d - 1);
+            break;
+
+        default:
+            generic = binary_operation(op, &function);
+            if (generic) {
+                exit_unless(t, pos, "%s(%s, &s%d, &s%d)",
+                            function, lookup(generic)->name, d - 2, d - 1);
+                break;
+            }
+            exit_unless(t, pos, NULL);
+    }
+#undef OPERAND
+}
+
+static void
+write_comment(Translation *t, int pos) {
+    Instructions *ins = &t->fn->instructions;
+    if (pos == ins->length) {
+        fprintf(t->out, "    // end\n");
+        return;
+    }
+
+    const Definition *def = lookup(ins->data[pos]);
+    int read;
+    Operands operands = read_operands(&read, def, ins->data + pos);
+    fprintf(t->out, "    // %04d %s", pos, def->name);
+    for (int i = 0; i < operands.length; i++) {
+        fprintf(t->out, " %d", operands.widths[i]);
+    }
+    fputc('\n', t->out);
+    free(operands.widths);
+}
+
+// Write the C function of [t.fn], the [n]th function, to [out].
+static void
+write_function(Translation *t, FILE *out, int n) {
+    CompiledFunction *fn = t->fn;
+    Instructions *ins = &fn->instructions;
+
+    IntBufferInit(&t->depths);
+    stack_depths(ins, &t->depths);
+    IntBufferInit(&t->targets);
+    IntBufferInit(&t->entries);
+    jump_targets(ins, &t->depths, &t->targets, &t->entries);
+    IntBufferInit(&t->exits);
+    IntBufferFill(&t->exits, false, ins->length + 1);
+    t->positions = word_positions(ins);
+    t->num_slots = 0;
+
+    // the body first, to declare the variables it uses.
+    char *body;
+    size_t body_length;
+    t->out = open_memstream(&body, &body_length);
+    if (t->out == NULL) { die("aot_write: open_memstream"); }
+
+    int pos = 0;
+    for (; pos <= ins->length;
+            pos += pos < ins->length ? instruction_width(ins->data[pos]) : 1) {
+        if (t->depths.data[pos] == -1) { continue; }
+
+        fputc('\n', t->out);
+        if (t->targets.data[pos] || t->entries.data[pos]) {
+            fprintf(t->out, "i%d:\n", pos);
+        }
+        write_comment(t, pos);
+        if (pos == ins->length) {
+            exit_unless(t, pos, NULL);
+        } else {
+            write_instruction(t, pos);
+        }
+    }
+    fclose(t->out);
+    t->out = NULL;
+
+    for (pos = 0; pos <= ins->length; pos++) {
+        if (t->entries.data[pos] || t->exits.data[pos]) {
+            slot(t, t->depths.data[pos] - 1);
+        }
+    }
+
+    if (n == 0) {
+        fprintf(out, "// main function\n");
+    } else if (fn->literal && fn->literal->name) {
+        Token *tok = &fn->literal->name->tok;
+        fprintf(out, "// %.*s, line %d\n", tok->length, tok->start, tok->line);
+    } else {
+        fprintf(out, "// fn, line %d\n", fn->literal ? fn->literal->tok.line : 0);
+    }
+
+    fprintf(out,
+            "static void\n"
+            "function_%d(VM *vm, Frame *frame, Object *globals) {\n"
+            "    Object *locals = vm->stack + frame->base_pointer,\n"
+            "           *stack = locals + %d;\n"
+            "    (void) globals, (void) stack;\n",
+            n, fn->num_locals);
+
+    // The Objects on the stack above the locals are kept in variables, which
+    // the C compiler can keep in registers, and are only stored on the stack
+    // when the function exits.
+    for (int i = 0; i < t->num_slots; i++) {
+        fprintf(out, "%s s%d = {0}", i == 0 ? "    Object" : ",", i);
+    }
+    if (t->num_slots > 0) { fprintf(out, ";\n"); }
+
+    // entered and exited at the index of a word, see encode_instructions().
+    fprintf(out, "\n    switch (frame->ip + 1) {\n");
+    for (pos = 0; pos <= ins->length; pos++) {
+        if (t->entries.data[pos]) {
+            fprintf(out, "        case %d:", t->positions[pos]);
+            for (int i = 0; i < t->depths.data[pos]; i++) {
+                fprintf(out, " s%d = stack[%d];", i, i);
+            }
+            fprintf(out, " goto i%d;\n", pos);
+        }
+    }
+    fprintf(out,
+            "        default: return;\n"
+            "    }\n");
+
+    fwrite(body, 1, body_length, out);
+    free(body);
+
+    for (pos = 0; pos <= ins->length; pos++) {
+        if (t->exits.data[pos]) {
+            fprintf(out, "\nexit_%d:\n", pos);
+            for (int i = 0; i < t->depths.data[pos]; i++) {
+                fprintf(out, "    stack[%d] = s%d;\n", i, i);
+            }
+            fprintf(out,
+                    "    aot_exit(vm, frame, %d, stack + %d);\n"
+                    "    return;\n",
+                    t->positions[pos], t->depths.data[pos]);
+        }
+    }
+    fprintf(out, "}\n\n");
+
+    free(t->depths.data);
+    free(t->targets.data);
+    free(t->entries.data);
+    free(t->exits.data);
+    free(t->positions);
+}
+
+error aot_write(FILE *out, Compiler *c, const char *source,
+                const char *filename) {
+    fprintf(out,
+            "// %s compiled to C by `monke --compile`, see src/aot.h.\n"
+            "\n"
+            "#include \"aot.h\"\n"
+            "#include \"cli.h\"\n"
+            "\n",
+            filename);
+
+    Buffer functions = compiled_functions(c);
+    Translation t = { .c = c };
+    for (int i = 0; i < functions.length; i++) {
+        t.fn = functions.data[i];
+        write_function(&t, out, i);
+    }
+
+    fprintf(out, "static const CFunction functions[] = {\n");
+    for (int i = 0; i < functions.length; i++) {
+        fprintf(out, "    function_%d,\n", i);
+    }
+    fprintf(out, "};\n\nstatic const uint64_t hashes[] = {\n");
+    for (int i = 0; i < functions.length; i++) {
+        fprintf(out, "    0x%016llxULL,\n",
+                (unsigned long long) instructions_hash(functions.data[i]));
+    }
+    fprintf(out, "};\n\n");
+
+    // bytes rather than a string literal, which may be at most 4095
+    // characters in ISO C.
+    fprintf(out, "static const unsigned char source[] = {");
+    size_t length = strlen(source);
+    for (size_t i = 0; i < length; i++) {
+        fprintf(out, i % 12 == 0 ? "\n    %d," : " %d,",
+                (unsigned char) source[i]);
+    }
+    fprintf(out, "\n    0\n};\n\n");
+
+    fprintf(out,
+            "static const AotProgram program = {\n"
+            "    .source = (const char *) source,\n"
+            "    .functions = functions,\n"
+            "    .hashes = hashes,\n"
+            "    .num_functions = %d,\n"
+            "};\n"
+            "\n"
+            "int main(void) {\n"
+            "    Options opts = {\n"
+            "        .gc = DefaultGCConfig,\n"
+            "        .max_stack_size = DefaultMaxStackSize,\n"
+            "        .jit_threshold = DefaultJitThreshold,\n"
+            "    };\n"
+            "    return run_compiled(&program, &opts);\n"
+            "}\n",
+            functions.length);
+    free(functions.data);
+
+    if (ferror(out)) {
+        return errorf("could not write C source code - %s", strerror(errno));
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+// This module contains an ahead-of-time compiler, which translates a Program
+// to a C translation unit.  Compiled with a C compiler and linked with the
+// runtime, `build/libmonke.a`, it is a standalone executable of the Program:
+//
+//     $ monke --compile program.c program.monke
+//     $ cc -O2 -I src program.c build/libmonke.a -o program
+//
+// Each CompiledFunction becomes a C function which runs its instructions like
+// the machine code of the JIT, see jit.h: on the stack and Frame of the VM,
+// exiting to vm_run() before the instructions it has no translation for
+// (calls, returns and anything that allocates) and on slow paths.  The
+// operand stack has a known depth at every instruction, so the C compiler
+// sees constant offsets from the local variables, and keeps Objects in
+// registers and removes type checks of constants between exits.
+//
+// The executable contains the source code, and compiles it again when it
+// starts, so that errors point to the source code like when it is
+// interpreted.  The C functions are then attached to the CompiledFunctions,
+// which must be the same as when it was compiled to C.
+
+#include "compiler.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A Program compiled to C, see aot_write().
+typedef struct {
+    const char *source;
+
+    // C function of the main function followed by those of the Function
+    // constants, in the order of the Compilers constants.
+    const CFunction *functions;
+
+    // hash_string_fnv1a() of the instructions of each function.
+    const uint64_t *hashes;
+
+    int num_functions;
+} AotProgram;
+
+// Write a C translation unit, which runs the Program compiled by [c] from
+// [source], to [out].  [filename] is only used in comments.
+error aot_write(FILE *out, Compiler *c, const char *source,
+                const char *filename);
+
+// Attach the C functions of [program] to the functions compiled by [c] from
+// [program.source].
+void aot_attach(Compiler *c, const AotProgram *program);
+
+// The rest is used by the generated C functions.
+
+// Exit before the instruction at [pos], with the top of the stack at [sp],
+// see jit_run().
+static inline void
+aot_exit(VM *vm, Frame *frame, int pos, Object *sp) {
+    frame->ip = pos - 1;
+    vm->sp = sp - vm->stack;
+}
+
+static inline bool
+aot_truthy(Object obj) {
+    return obj.type == o_Boolean ? obj.data.boolean : is_truthy(obj);
+}
+
+// OpAdd to OpGreaterThan of the Integers [left] and [right], replacing [left]
+// with the result.  False on overflow or division by zero, which vm_run()
+// reports.
+static inline bool
+aot_integer_operation(Opcode op, Object *left, Object *right) {
+    long a = left->data.integer,
+         b = right->data.integer,
+         result;
+
+    switch (op) {
+        case OpAdd:
+            if (__builtin_add_overflow(a, b, &result)) { return false; }
+            break;
+        case OpSub:
+            if (__builtin_sub_overflow(a, b, &result)) { return false; }
+            break;
+        case OpMul:
+            if (__builtin_mul_overflow(a, b, &result)) { return false; }
+            break;
+        case OpDiv:
+            if (b == 0 || (a == LONG_MIN && b == -1)) { return false; }
+            result = a / b;
+            break;
+
+        case OpEqual:
+            *left = OBJ_BOOL(a == b);
+            return true;
+        case OpNotEqual:
+            *left = OBJ_BOOL(a != b);
+            return true;
+        case OpLessThan:
+            *left = OBJ_BOOL(a < b);
+            return true;
+        case OpGreaterThan:
+            *left = OBJ_BOOL(a > b);
+            return true;
+
+        default:
+            return false;
+    }
+    *left = OBJ(o_Integer, .integer = result);
+    return true;
+}
+
+// aot_integer_operation() of Floats.
+static inline bool
+aot_float_operation(Opcode op, Object *left, Object *right) {
+    double a = left->data.floating,
+           b = right->data.floating;
+
+    switch (op) {
+        case OpAdd:
+            *left = OBJ(o_Float, .floating = a + b);
+            return true;
+        case OpSub:
+            *left = OBJ(o_Float, .floating = a - b);
+            return true;
+        case OpMul:
+            *left = OBJ(o_Float, .floating = a * b);
+            return true;
+        case OpDiv:
+            // see execute_binary_float_operation().
+            if (right->data.integer == 0) { return false; }
+            *left = OBJ(o_Float, .floating = a / b);
+            return true;
+
+        case OpEqual:
+            *left = OBJ_BOOL(a == b);
+            return true;
+        case OpNotEqual:
+            *left = OBJ_BOOL(a != b);
+            return true;
+        case OpLessThan:
+            *left = OBJ_BOOL(a < b);
+            return true;
+        case OpGreaterThan:
+            *left = OBJ_BOOL(a > b);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// aot_integer_operation() of two Integers or two Floats, false for other
+// types.
+static inline bool
+aot_binary_operation(Opcode op, Object *left, Object *right) {
+    if (left->type == o_Integer && right->type == o_Integer) {
+        return aot_integer_operation(op, left, right);
+
+    } else if (left->type == o_Float && right->type == o_Float) {
+        return aot_float_operation(op, left, right);
+    }
+    return false;
+}
+
+// OpMinus of [obj], false if it is not a number.
+static inline bool
+aot_minus(Object *obj) {
+    if (obj->type == o_Integer && obj->data.integer != LONG_MIN) {
+        *obj = OBJ(o_Integer, .integer = -obj->data.integer);
+        return true;
+
+    } else if (obj->type == o_Float) {
+        *obj = OBJ(o_Float, .floating = -obj->data.floating);
+        return true;
+    }
+    return false;
+}
+
+// OpBang of [obj].
+static inline Object
+aot_bang(Object obj) {
+    if (obj.type == o_Boolean) {
+        return OBJ_BOOL(!obj.data.boolean);
+    }
+    return OBJ_BOOL(obj.type == o_Nothing);
+}
+
+// OpArrayIndex of Array [array] with Integer [index], see
+// execute_array_index().
+static inline Object
+aot_array_index(Object array, Object index) {
+    Array *arr = array.data.array;
+    int i = index.data.integer;
+    if (i < 0 || i >= arr->length) {
+        return OBJ_NOTHING;
+    }
+    return array_get(arr, i);
+}
@@ -49,7 +49,7 @@ builtin_len(__attribute__ ((unused)) VM *vm, Object *args, int num_args) {
 
         case o_Array:
             {
-                ObjectBuffer* arr = args[0].data.array;
+                Array* arr = args[0].data.array;
                 return OBJ(o_Integer, arr->length);
             }
 
@@ -74,9 +74,9 @@ builtin_first(__attribute__ ((unused)) VM *vm, Object *args, int num_args) {
     switch (args[0].type) {
         case o_Array:
             {
-                ObjectBuffer* arr = args[0].data.array;
+                Array* arr = args[0].data.array;
                 if (arr->length > 0) {
-                    return arr->data[0];
+                    return array_get(arr, 0);
                 }
                 return OBJ_NOTHING;
             }
@@ -98,9 +98,9 @@ builtin_last(__attribute__ ((unused)) VM *vm, Object *args, int num_args) {
     switch (args[0].type) {
         case o_Array:
             {
-                ObjectBuffer* arr = args[0].data.array;
+                Array* arr = args[0].data.array;
                 if (arr->length > 0) {
-                    return arr->data[arr->length - 1];
+                    return array_get(arr, arr->length - 1);
                 }
                 return OBJ_NOTHING;
             }
@@ -121,10 +121,14 @@ builtin_rest(VM *vm, Object *args, int num_args) {
         case o_Array:
             {
                 // create shallow copy of array.
-                ObjectBuffer old_arr = *args[0].data.array;
+                Array old_arr = *args[0].data.array;
                 if (old_arr.length > 1) {
-                    ObjectBuffer *new_arr =
-                        create_array(vm, old_arr.data + 1, old_arr.length - 1);
+                    int length = old_arr.length - 1;
+                    Array *new_arr = create_array(vm, NULL, length);
+                    memcpy(new_arr->types, old_arr.types + 1,
+                           length * sizeof(ObjectType));
+                    memcpy(new_arr->data, old_arr.data + 1,
+                           length * sizeof(ObjectData));
                     return OBJ(o_Array, .array = new_arr);
                 }
 
@@ -138,7 +142,7 @@ builtin_rest(VM *vm, Object *args, int num_args) {
 }
 
 Object
-builtin_push(__attribute__ ((unused)) VM *vm, Object *args, int num_args) {
+builtin_push(VM *vm, Object *args, int num_args) {
     if (num_args != 2) {
         return ERR_NUM_ARGS("builtin push()", 2, num_args);
     }
@@ -148,7 +152,8 @@ builtin_push(__attribute__ ((unused)) VM *vm, Object *args, int num_args) {
                 show_object_type(o_Array), show_object_type(args[0].type));
     }
 
-    ObjectBufferPush(args[0].data.array, args[1]);
+    array_push(args[0].data.array, args[1]);
+    write_barrier(vm, args[0]);
     return args[0];
 }
 
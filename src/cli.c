@@ -1,4 +1,6 @@
 #include "cli.h"
+#include "allocation.h"
+#include "aot.h"
 #include "code.h"
 #include "compiler.h"
 #include "errors.h"
@@ -29,16 +31,21 @@ DEFINE_BUFFER(Input, Input)
 // line is encountered and there is no data left in [in_stream].
 static int multigetline(char **input, size_t *input_cap, FILE *in, FILE *out);
 
-void repl(FILE* in, FILE* out) {
+void repl(FILE* in, FILE* out, Options *opts) {
     Lexer l;
     lexer_init(&l, NULL, 0);
 
     Compiler c;
     compiler_init(&c);
+    c.incremental = true;
     enter_scope(&c);
 
     VM vm;
     vm_init(&vm, &c);
+    gc_configure(&vm, opts->gc);
+    vm_set_max_stack(&vm, opts->max_stack_size);
+    vm_set_jit(&vm, opts->jit_threshold);
+    vm_set_registers(&vm, opts->registers);
 
     InputBuffer inputs = {0};
     Program program = {0};
@@ -78,6 +85,13 @@ void repl(FILE* in, FILE* out) {
             goto cleanup;
         }
 
+        // compile() appended to the main function, so its machine code is
+        // out of date.
+        CompiledFunction *main_function = bytecode(&c).main_function;
+        jit_free(main_function->jit);
+        main_function->jit = NULL;
+        main_function->hotness = 0;
+
         InputBufferPush(&inputs, (Input){ input });
         input = NULL;
 
@@ -118,7 +132,80 @@ cleanup:
     free(inputs.data);
 }
 
-int run(char* filename) {
+// run() [source], with the C functions of [aot] if not NULL.
+static int
+run_source(const char *source, Options *opts, const AotProgram *aot) {
+    bool success = false;
+    error err;
+
+    Lexer l;
+    lexer_init(&l, source, strlen(source));
+
+    Compiler c;
+    compiler_init(&c);
+
+    VM vm;
+    vm_init(&vm, &c);
+    gc_configure(&vm, opts->gc);
+    vm_set_max_stack(&vm, opts->max_stack_size);
+    vm_set_jit(&vm, opts->jit_threshold);
+    vm_set_registers(&vm, opts->registers);
+
+    Program program = {0};
+    ParseErrorBuffer errors = parse(parser(), &l, &program);
+    if (errors.length > 0) {
+        fputs(parser_error_msg, stdout);
+        print_parse_errors(&errors, stdout);
+        goto cleanup;
+    }
+
+    err = compile(&c, &program, 0);
+    if (err) {
+        fputs(compiler_error_msg, stdout);
+        print_error(err, stdout);
+        free_error(err);
+        goto cleanup;
+    }
+
+    if (aot) { aot_attach(&c, aot); }
+
+    err = vm_run(&vm, bytecode(&c));
+    if (err) {
+        fputs(vm_error_msg, stdout);
+        print_vm_stack_trace(&vm, stdout);
+        print_error(err, stdout);
+        free_error(err);
+    }
+
+    success = true;
+
+cleanup:
+    vm_free(&vm);
+    compiler_free(&c);
+    program_free(&program);
+    free_parse_errors(&errors);
+    return success ? 0 : 1;
+}
+
+int run(char* filename, Options *opts) {
+    char *source;
+    error err = load_file(filename, &source);
+    if (err) {
+        print_error(err, stdout);
+        free_error(err);
+        return -1;
+    }
+
+    int status = run_source(source, opts, NULL);
+    free(source);
+    return status;
+}
+
+int run_compiled(const AotProgram *program, Options *opts) {
+    return run_source(program->source, opts, program);
+}
+
+int compile_c(char *filename, char *output) {
     bool success = false;
 
     char *source;
@@ -135,9 +222,6 @@ int run(char* filename) {
     Compiler c;
     compiler_init(&c);
 
-    VM vm;
-    vm_init(&vm, &c);
-
     Program program = {0};
     ParseErrorBuffer errors = parse(parser(), &l, &program);
     if (errors.length > 0) {
@@ -154,18 +238,27 @@ int run(char* filename) {
         goto cleanup;
     }
 
-    err = vm_run(&vm, bytecode(&c));
+    FILE *out = fopen(output, "w");
+    if (out == NULL) {
+        printf("error: could not open file '%s' - %s\n", output,
+               strerror(errno));
+        goto cleanup;
+    }
+
+    err = aot_write(out, &c, source, filename);
+    if (fclose(out) != 0 && err == NULL) {
+        err = errorf("could not write file '%s' - %s", output,
+                     strerror(errno));
+    }
     if (err) {
-        fputs(vm_error_msg, stdout);
-        print_vm_stack_trace(&vm, stdout);
         print_error(err, stdout);
         free_error(err);
+        goto cleanup;
     }
 
     success = true;
 
 cleanup:
-    vm_free(&vm);
     compiler_free(&c);
     program_free(&program);
     free_parse_errors(&errors);
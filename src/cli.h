@@ -1,6 +1,23 @@
+#include "aot.h"
 #include "parser.h"
+#include "vm.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
-int  run(char* filename);
-void repl(FILE* in_stream, FILE* out_stream);
+// Options given on the command line or in environment variables.
+typedef struct {
+    GCConfig gc;
+    int max_stack_size; // see vm_set_max_stack().
+    int jit_threshold; // see vm_set_jit().
+    bool registers; // see vm_set_registers().
+} Options;
+
+int  run(char* filename, Options *opts);
+void repl(FILE* in_stream, FILE* out_stream, Options *opts);
+
+// Compile the program in [filename] to C source code in [output], see aot.h.
+int  compile_c(char *filename, char *output);
+
+// run() a program compiled to C, called by its main().
+int  run_compiled(const AotProgram *program, Options *opts);
@@ -7,23 +7,22 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 DEFINE_BUFFER(SourceMapping, SourceMapping)
+DEFINE_BUFFER(InlineFrame, InlineFrame)
 
 #define DEF(code, operands) { #code, _##operands }
 #define DEF_EMPTY(code) { #code, { NULL, 0 } }
 
-const int _two_widths[] = { 2 };
-const Operands _two_bytes = { .widths = (int *)_two_widths, .length = 1 };
+const int _one_width[] = { 3 };
+const Operands _operand = { .widths = (int *)_one_width, .length = 1 };
 
-const int _one_widths[] = { 1 };
-const Operands _one_byte = { .widths = (int *)_one_widths, .length = 1 };
-
-const int _closure_widths[] = { 2, 1 };
-const Operands _closure = { .widths = (int *)_closure_widths, .length = 2 };
+const int _two_widths[] = { 3, 3 };
+const Operands _two_operands = { .widths = (int *)_two_widths, .length = 2 };
 
 const Definition definitions[] = {
-    DEF(OpConstant, two_bytes), // constant index
+    DEF(OpConstant, operand), // constant index
     DEF_EMPTY(OpPop),
 
     DEF_EMPTY(OpAdd),
@@ -42,36 +41,97 @@ const Definition definitions[] = {
     DEF_EMPTY(OpFalse),
     DEF_EMPTY(OpNothing),
 
-    DEF(OpJumpNotTruthy, two_bytes), // instruction index
-    DEF(OpJump, two_bytes),          // instruction index
+    DEF(OpJumpNotTruthy, operand), // instruction index
+    DEF(OpJump, operand), // instruction index
 
-    DEF(OpGetGlobal, two_bytes), // globals index
-    DEF(OpSetGlobal, two_bytes), // globals index
+    DEF(OpGetGlobal, operand), // globals index
+    DEF(OpSetGlobal, operand), // globals index
 
-    DEF(OpGetLocal, one_byte),  // locals index
-    DEF(OpSetLocal, one_byte),  // locals index
+    DEF(OpGetLocal, operand), // locals index
+    DEF(OpSetLocal, operand), // locals index
 
-    DEF(OpGetFree, one_byte),   // free variable index
-    DEF(OpSetFree, one_byte),   // free variable index
+    DEF(OpGetFree, operand), // free variable index
+    DEF(OpSetFree, operand), // free variable index
 
-    DEF(OpArray, two_bytes), // num elements
-    DEF(OpTable, two_bytes),  // num pairs
+    DEF(OpArray, operand), // num elements
+    DEF(OpTable, operand), // num pairs
 
     DEF_EMPTY(OpIndex),
     DEF_EMPTY(OpSetIndex),
 
-    DEF(OpCall, one_byte),      // num arguments
-    DEF(OpRequire, two_bytes),  // constant index
+    // constant index of key and FieldCache index
+    DEF(OpGetField, two_operands),
+    DEF(OpSetField, two_operands),
+
+    // num arguments and CallCache index
+    DEF(OpCall, two_operands),
+    DEF(OpTailCall, two_operands),
+
+    DEF(OpRequire, operand), // constant index
     DEF_EMPTY(OpReturnValue),
     DEF_EMPTY(OpReturn),
 
-    DEF(OpGetBuiltin, one_byte), // builtin fn index
+    DEF(OpGetBuiltin, operand), // builtin fn index
 
     // constant index of Function and number of free variables
-    DEF(OpClosure, closure),
+    DEF(OpClosure, two_operands),
     DEF_EMPTY(OpCurrentClosure),
+    DEF_EMPTY(OpHalt),
+
+    DEF(OpGetLocal2, two_operands), // locals indexes
+    DEF(OpIncrementLocal, two_operands), // locals index and constant index
+
+    // instruction index
+    DEF(OpJumpNotEqual, operand),
+    DEF(OpJumpEqual, operand),
+    DEF(OpJumpNotLessThan, operand),
+    DEF(OpJumpNotGreaterThan, operand),
+
+    DEF(OpCallSelf, operand), // num arguments
+    DEF(OpTailCallSelf, operand), // num arguments
+
+    DEF_EMPTY(OpAddInt),
+    DEF_EMPTY(OpSubInt),
+    DEF_EMPTY(OpMulInt),
+    DEF_EMPTY(OpDivInt),
+    DEF_EMPTY(OpEqualInt),
+    DEF_EMPTY(OpNotEqualInt),
+    DEF_EMPTY(OpLessThanInt),
+    DEF_EMPTY(OpGreaterThanInt),
+
+    DEF_EMPTY(OpAddFloat),
+    DEF_EMPTY(OpSubFloat),
+    DEF_EMPTY(OpMulFloat),
+    DEF_EMPTY(OpDivFloat),
+    DEF_EMPTY(OpEqualFloat),
+    DEF_EMPTY(OpNotEqualFloat),
+    DEF_EMPTY(OpLessThanFloat),
+    DEF_EMPTY(OpGreaterThanFloat),
+
+    DEF_EMPTY(OpIAdd),
+    DEF_EMPTY(OpISub),
+    DEF_EMPTY(OpIMul),
+    DEF_EMPTY(OpIDiv),
+    DEF_EMPTY(OpIEqual),
+    DEF_EMPTY(OpINotEqual),
+    DEF_EMPTY(OpILessThan),
+    DEF_EMPTY(OpIGreaterThan),
+
+    DEF_EMPTY(OpFAdd),
+    DEF_EMPTY(OpFSub),
+    DEF_EMPTY(OpFMul),
+    DEF_EMPTY(OpFDiv),
+    DEF_EMPTY(OpFEqual),
+    DEF_EMPTY(OpFNotEqual),
+    DEF_EMPTY(OpFLessThan),
+    DEF_EMPTY(OpFGreaterThan),
+
+    DEF_EMPTY(OpArrayIndex),
 };
 
+_Static_assert(sizeof(definitions) / sizeof(definitions[0]) == OpCount - 1,
+               "a Definition of each Opcode");
+
 const Definition *
 lookup(Opcode op) {
     static int len = sizeof(definitions) / sizeof(definitions[0]);
@@ -81,26 +141,25 @@ lookup(Opcode op) {
     return definitions + op - 1;
 }
 
-int read_big_endian_uint16(uint8_t *arr) {
-    return (arr[0] << 8) | arr[1];
-}
-
-int read_big_endian_uint8(uint8_t *arr) {
-    return arr[0];
+int read_big_endian_uint24(uint8_t *arr) {
+    return (arr[0] << 16) | (arr[1] << 8) | arr[2];
 }
 
-// store n in `arr[0:2]` big endian.
+// store n in `arr[0:3]` big endian.
 static void
-put_big_endian_uint16(uint8_t *arr, uint16_t n) {
-// https://stackoverflow.com/a/9154012
-#if defined(__BYTE_ORDER__)&&(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-#else
-    // https://stackoverflow.com/a/2182184
-    n = (n >> 8) | (n << 8); // swap to big endian
-#endif
-
-    arr[0] = n;
+put_big_endian_uint24(uint8_t *arr, int n) {
+    arr[0] = n >> 16;
     arr[1] = n >> 8;
+    arr[2] = n;
+}
+
+int instruction_width(Opcode op) {
+    const Definition *def = lookup(op);
+    int width = 1;
+    for (int i = 0; i < def->operands.length; i++) {
+        width += def->operands.widths[i];
+    }
+    return width;
 }
 
 Operands read_operands(int *n, const Definition *def, uint8_t* ins) {
@@ -115,12 +174,8 @@ Operands read_operands(int *n, const Definition *def, uint8_t* ins) {
     for (int i = 0; i < def->operands.length; i++) {
         width = def->operands.widths[i];
         switch (width) {
-            case 2:
-                operands.widths[i] = read_big_endian_uint16(ins + offset);
-                break;
-
-            case 1:
-                operands.widths[i] = read_big_endian_uint8(ins + offset);
+            case 3:
+                operands.widths[i] = read_big_endian_uint24(ins + offset);
                 break;
 
             default:
@@ -133,6 +188,78 @@ Operands read_operands(int *n, const Definition *def, uint8_t* ins) {
     return operands;
 }
 
+// Number of words of the instruction with Opcode [op] encoded by
+// encode_instructions().
+static int
+word_width(Opcode op) {
+    return lookup(op)->operands.length > 1 ? 2 : 1;
+}
+
+int *word_positions(Instructions *ins) {
+    int *positions = malloc((ins->length + 1) * sizeof(int));
+    if (positions == NULL) { die("word_positions: malloc"); }
+
+    int pos = 0, index = 0;
+    while (pos < ins->length) {
+        Opcode op = ins->data[pos];
+        int width = instruction_width(op);
+        for (int i = 0; i < width; i++) {
+            positions[pos + i] = index;
+        }
+        pos += width;
+        index += word_width(op);
+    }
+    positions[pos] = index;
+    return positions;
+}
+
+int instruction_position(Instructions *ins, int index) {
+    if (index < 0) { return index; }
+
+    int pos = 0;
+    while (pos < ins->length && index >= word_width(ins->data[pos])) {
+        index -= word_width(ins->data[pos]);
+        pos += instruction_width(ins->data[pos]);
+    }
+    return pos;
+}
+
+uint32_t *encode_instructions(Instructions *ins) {
+    int *positions = word_positions(ins),
+        length = positions[ins->length];
+    uint32_t *words = malloc((length + 1) * sizeof(uint32_t));
+    if (words == NULL) { die("encode_instructions: malloc"); }
+
+    for (int pos = 0, n; pos < ins->length; pos += 1 + n) {
+        Opcode op = ins->data[pos];
+        Operands operands = read_operands(&n, lookup(op), ins->data + pos);
+
+        int first = operands.length > 0 ? operands.widths[0] : 0,
+            index = positions[pos];
+        switch (op) {
+            case OpJump:
+            case OpJumpNotTruthy:
+            case OpJumpNotEqual:
+            case OpJumpEqual:
+            case OpJumpNotLessThan:
+            case OpJumpNotGreaterThan:
+                first = positions[first];
+                break;
+
+            default:
+                break;
+        }
+        words[index] = (uint32_t) first << 8 | op;
+        if (operands.length > 1) {
+            words[index + 1] = operands.widths[1];
+        }
+        free(operands.widths);
+    }
+    words[length] = OpHalt;
+    free(positions);
+    return words;
+}
+
 int
 make_valist_into(Instructions *ins, Opcode op, va_list operands) {
     const Definition *def = lookup(op);
@@ -147,12 +274,8 @@ make_valist_into(Instructions *ins, Opcode op, va_list operands) {
         width = def->operands.widths[i];
         instructions_allocate(ins, width);
         switch (width) {
-            case 2:
-                put_big_endian_uint16(ins->data + offset, operand);
-                break;
-
-            case 1:
-                ins->data[offset] = operand;
+            case 3:
+                put_big_endian_uint24(ins->data + offset, operand);
                 break;
 
             default:
@@ -84,14 +84,37 @@ typedef enum {
     //   NOTE: if `R` is `nothing` the key `I` is removed from table `L`.
     OpSetIndex,
 
-    // OpCall: call a Compiled or Builtin function with specified number of
-    // arguments.
+    // OpGetField <constant index> <cache index>:
     //
-    // The calling convention for a function is as follows: the Object
-    // containing the function is pushed onto the stack, followed by its
-    // arguments and an OpCall with `N` arguments.
+    // OpIndex with a String constant as the index, `L["key"]`.  Pop Object
+    // `L` and push the value of table `L` at the constant.  The Shape of `L`
+    // and the index of the key in it are cached in the FieldCache of the
+    // current function, see table.h.
+    OpGetField,
+
+    // OpSetField <constant index> <cache index>:
+    //
+    // OpSetIndex with a String constant as the index.  Pop two Objects `L`
+    // and `R` (in that order) and set the value of `L` at the constant to
+    // `R`, with a FieldCache like OpGetField.
+    OpSetField,
+
+    // OpCall <num arguments> <cache index>: call a Compiled or Builtin
+    // function with specified number of arguments.
+    //
+    // The calling convention for a function is as follows: the arguments are
+    // pushed onto the stack, followed by the Object containing the function
+    // and an OpCall with `N` arguments.  The function of the Closure called
+    // is cached in the CallCache of the current function, see object.h, and
+    // the number of arguments is not checked again while it is the same.
     OpCall,
 
+    // OpTailCall <num arguments> <cache index>: OpCall whose result is
+    // returned by the current function.  A Closure is called in the current
+    // Frame, in place of the function returning, so tail recursion does not
+    // use up Frames.
+    OpTailCall,
+
     // OpRequire: "require" a sub-module.
     OpRequire,
 
@@ -115,6 +138,87 @@ typedef enum {
     // OpCurrentClosure: Push an Object containing the Closure of the current
     // Frame.
     OpCurrentClosure,
+
+    // OpHalt: stop execution.  Not emitted by the Compiler, vm_run() places
+    // one right after the last instruction of the main function.
+    OpHalt,
+
+    // Superinstructions: not emitted by the Compiler directly, its peephole
+    // optimizer replaces common sequences of instructions with them, see
+    // optimize() in compiler.c.
+
+    // OpGetLocal2 <locals index> <locals index>: two OpGetLocal.
+    OpGetLocal2,
+
+    // OpIncrementLocal <locals index> <constant index>: `OpGetLocal a;
+    // OpConstant k; OpAdd; OpSetLocal a`, as in `i += 1`.
+    OpIncrementLocal,
+
+    // Pop two Objects, compare them and jump to the specified position if the
+    // comparison is false: a comparison followed by an OpJumpNotTruthy.  In
+    // the same order as OpEqual to OpGreaterThan, so OpJumpNotEqual jumps if
+    // the Objects are not equal and OpJumpEqual if they are.
+    OpJumpNotEqual,
+    OpJumpEqual,
+    OpJumpNotLessThan,
+    OpJumpNotGreaterThan,
+
+    // OpCallSelf <num arguments>: `OpCurrentClosure; OpCall`, a recursive
+    // call with the number of parameters of the current function, so the
+    // number of arguments is not checked.
+    OpCallSelf,
+
+    // OpTailCallSelf <num arguments>: `OpCurrentClosure; OpTailCall`.
+    OpTailCallSelf,
+
+    // Quickened instructions: not emitted by the Compiler, vm_run() rewrites
+    // OpAdd to OpGreaterThan to the variant for the types of their operands,
+    // and back if they have other types.  In the same order as OpAdd to
+    // OpGreaterThan.
+    OpAddInt,
+    OpSubInt,
+    OpMulInt,
+    OpDivInt,
+    OpEqualInt,
+    OpNotEqualInt,
+    OpLessThanInt,
+    OpGreaterThanInt,
+
+    OpAddFloat,
+    OpSubFloat,
+    OpMulFloat,
+    OpDivFloat,
+    OpEqualFloat,
+    OpNotEqualFloat,
+    OpLessThanFloat,
+    OpGreaterThanFloat,
+
+    // Typed instructions: emitted by the Compiler where its type inference
+    // proves the types of the operands, see infer_types() in compiler.c, so
+    // they do not check them.  In the same order as OpAdd to OpGreaterThan.
+    OpIAdd,
+    OpISub,
+    OpIMul,
+    OpIDiv,
+    OpIEqual,
+    OpINotEqual,
+    OpILessThan,
+    OpIGreaterThan,
+
+    OpFAdd,
+    OpFSub,
+    OpFMul,
+    OpFDiv,
+    OpFEqual,
+    OpFNotEqual,
+    OpFLessThan,
+    OpFGreaterThan,
+
+    // OpArrayIndex: OpIndex of an Array with an Integer.
+    OpArrayIndex,
+
+    // Not an Opcode: the length of tables indexed by Opcode.
+    OpCount,
 } Opcode;
 
 // Operands of Opcodes.
@@ -126,6 +230,10 @@ typedef struct {
     int length;
 } Operands;
 
+// The largest operand of an instruction, which fits in the 24 bits of an
+// encoded word, see encode_instructions().  Each operand is 3 bytes wide.
+static const int MaxOperand = (1 << 24) - 1;
+
 // Name and Operands of all Opcodes.
 typedef struct {
     const char *name;
@@ -135,6 +243,9 @@ typedef struct {
 // Return Definition for Opcode
 const Definition *lookup(Opcode op);
 
+// Width in bytes of an instruction with Opcode [op], including its operands.
+int instruction_width(Opcode op);
+
 typedef struct {
     uint8_t* data;
     int length, capacity;
@@ -148,11 +259,8 @@ int fprint_instructions(FILE *out, Instructions *ins);
 // Read integer operands from `ins[1:]` with Operand widths according in [def].
 Operands read_operands(int *n, const Definition *def, uint8_t *ins);
 
-// read `arr[0:2]` big endian.
-int read_big_endian_uint16(uint8_t *arr);
-
-// read `arr[0]`
-int read_big_endian_uint8(uint8_t *arr);
+// read `arr[0:3]` big endian.
+int read_big_endian_uint24(uint8_t *arr);
 
 // Make Instructions from Opcode and `int` operands.
 Instructions make(Opcode op, ...);
@@ -163,19 +271,73 @@ int make_into(Instructions *ins, Opcode op, ...);
 // Append Instruction with Opcode and `int` [operands] to [ins].
 int make_valist_into(Instructions *ins, Opcode op, va_list operands);
 
+// Encode [ins] for vm_run(), see [CompiledFunction.words]: each instruction
+// is an aligned 32-bit word, with its Opcode in the lowest 8 bits and its
+// first operand in the upper 24, followed by a word with its second operand,
+// if any.  The operand of a jump is the index of the word of its target.  The
+// word after the last instruction is an OpHalt.
+uint32_t *encode_instructions(Instructions *ins);
+
+// The index of the word each position of [ins] is encoded at by
+// encode_instructions(), an array of [ins.length] + 1 positions, up to the
+// OpHalt after the last instruction.
+int *word_positions(Instructions *ins);
+
+// The position in [ins] of the instruction encoded in the word at [index], or
+// [index] if it is negative, see [Frame.ip].
+int instruction_position(Instructions *ins, int index);
+
+// The Opcode of encoded instruction [word].
+static inline Opcode
+word_opcode(uint32_t word) {
+    return word & 0xff;
+}
+
+// The first operand of encoded instruction [word].
+static inline int
+word_operand(uint32_t word) {
+    return word >> 8;
+}
+
+// [word] with Opcode [op].
+static inline uint32_t
+word_with_opcode(uint32_t word, Opcode op) {
+    return (word & ~(uint32_t) 0xff) | op;
+}
+
 // Contains information needed for mapping a Node in the AST to a position in a
 // Functions bytecode.  It is used for printing which line of the source code
 // an error occured in the VM.
 typedef struct {
-    // the position in bytes in a Functions Instructions.
+    // the position in bytes in a Functions Instructions, see
+    // instruction_position() for the position of a Frame.
     int position;
 
     // The node in the AST with a Token which points to the source code.
     Node node;
+
+    // Number of the InlineFrame [node] is in, the index in
+    // [CompiledFunction.inline_frames] plus one, or 0 if it is not in an
+    // inlined function.
+    int inlined;
 } SourceMapping;
 
 BUFFER(SourceMapping, SourceMapping)
 
+// A call inlined by the compiler, which is shown in stack traces like the
+// Frame it would have had.
+typedef struct {
+    // The inlined function.
+    struct CompiledFunction *function;
+
+    // The call, in the InlineFrame numbered [caller], see
+    // [SourceMapping.inlined].
+    Node call;
+    int caller;
+} InlineFrame;
+
+BUFFER(InlineFrame, InlineFrame)
+
 // Find [SourceMapping] [ip] occurs at, the source mapping with highest
 // [position] that is less than [ip] with binary search.
 SourceMapping *find_mapping(SourceMappingBuffer *maps, int ip);
@@ -22,206 +22,1758 @@ static error c_error(Node, char* format, ...);
 // [Node.token].
 static void source_map(Compiler *, Node);
 
+static void set_last_instruction(Compiler *, Opcode, int);
+
 static error perform_assignment(Compiler *, Node); // emit opcodes to assign to `Node`.
 
-int add_constant(Compiler *, Constant);
+static error _compile(Compiler *, Node);
+
+int add_constant(Compiler *, Constant);
+static int add_string_constant(Compiler *, StringLiteral *);
+
+static char *add_constant_err = "too many constant variables";
+
+DEFINE_BUFFER(Constant, Constant)
+DEFINE_BUFFER(Scope, CompilationScope)
+
+void compiler_init(Compiler *c) {
+    memset(c, 0, sizeof(Compiler));
+
+    if (table_init(&c->constants_table) == NULL) {
+        die("compiler_init - create constants table:");
+    }
+}
+
+void compiler_free(Compiler *c) {
+    for (int i = 0; i < c->scopes.length; ++i) {
+        free_function(c->scopes.data[i].function);
+    }
+    free(c->scopes.data);
+
+    SymbolTable *next, *cur = c->cur_symbol_table;
+    while (cur) {
+        next = cur->outer;
+        symbol_table_free(cur);
+        cur = next;
+    }
+
+    for (int i = 0; i < c->constants.length; i++) {
+        Constant *constant = &c->constants.data[i];
+        if (constant->type == c_Function) {
+            free_function(constant->data.function);
+        }
+    }
+    free(c->constants.data);
+
+    for (int i = 0; i < c->folded_strings.length; i++) {
+        free(c->folded_strings.data[i]);
+    }
+    free(c->folded_strings.data);
+
+    for (int i = 0; i < c->discarded_functions.length; i++) {
+        free_function(c->discarded_functions.data[i]);
+    }
+    free(c->discarded_functions.data);
+
+    if (c->reassigned) { ht_destroy(c->reassigned); }
+
+    tbl_it it = tbl_iterator(&c->constants_table);
+    while (tbl_next(&it)) {
+        if (it.cur_key.type == o_String) {
+            free(it.cur_key.data.string->data);
+            free(it.cur_key.data.string);
+        }
+    }
+    table_free(&c->constants_table);
+
+    memset(c, 0, sizeof(Compiler));
+}
+
+void compiler_reset(Compiler *c) {
+    if (c->scopes.length > 0) {
+        // free unsuccessfully `CompiledFunctions`
+        for (; c->scopes.length > 1; --c->scopes.length) {
+            free_function(c->scopes.data[c->scopes.length].function);
+        }
+
+        // set c.cur_* variables
+        c->cur_scope = &c->scopes.data[0];
+        CompiledFunction *function = c->cur_scope->function;
+        c->cur_instructions = &function->instructions;
+        c->cur_mappings = &function->mappings;
+    }
+
+    SymbolTable *next, *cur = c->cur_symbol_table;
+    while (cur && cur->outer) {
+        next = cur->outer;
+        symbol_table_free(cur);
+        cur = next;
+    }
+}
+
+static uint64_t
+hash(Identifier *id) {
+    return hash_string_fnv1a(id->tok.start, id->tok.length);
+}
+
+static bool
+last_instruction_is(Compiler *c, Opcode op) {
+    if (c->cur_instructions->length == 0) {
+        return false;
+    }
+    return c->cur_scope->last_instruction.opcode == op;
+}
+
+static void
+append_return_if_not_present(Compiler *c) {
+    Opcode last = c->cur_scope->last_instruction.opcode;
+    if (last == OpReturn || last == OpReturnValue) {
+        return;
+    }
+
+    emit(c, OpReturn);
+}
+
+// if the last statement is an Expression Statement, remove its OpPop.
+//
+// Otherwise emit an OpNothing, because no other Statement should produce a value.
+static void
+remove_last_expression_stmt_pop(Compiler *c, NodeBuffer stmts) {
+    if (last_instruction_is(c, OpPop)
+            && stmts.length > 0
+            && stmts.data[stmts.length - 1].typ == n_ExpressionStatement) {
+        // remove last pop
+        c->cur_instructions->length = c->cur_scope->last_instruction.position;
+        c->cur_scope->last_instruction = c->cur_scope->previous_instruction;
+
+    } else {
+        emit(c, OpNothing);
+    }
+}
+
+static void
+replace_instruction(Compiler *c, int pos, Instructions new) {
+    uint8_t* ins = c->cur_instructions->data;
+    for (int i = 0; i < new.length; i++) {
+        ins[pos + i] = new.data[i];
+    }
+    free(new.data);
+}
+
+static void
+replace_last_opcode_with(Compiler *c, Opcode old, Opcode new) {
+    int last_pos = c->cur_scope->last_instruction.position;
+
+    assert(c->cur_instructions->data[last_pos] == old);
+
+    c->cur_instructions->data[last_pos] = new;
+    c->cur_scope->last_instruction.opcode = new;
+}
+
+static void
+replace_last_pop_with_return(Compiler *c) {
+    replace_last_opcode_with(c, OpPop, OpReturnValue);
+}
+
+// Replace the OpCalls of the current function whose result is returned,
+// directly or after OpJumps (out of if expressions), with OpTailCall.
+static void
+mark_tail_calls(Compiler *c) {
+    Instructions *ins = c->cur_instructions;
+    for (int i = 0; i < ins->length; i += instruction_width(ins->data[i])) {
+        if (ins->data[i] != OpCall) { continue; }
+
+        int next = i + instruction_width(OpCall);
+        for (int jumps = 0; jumps < 8 && next < ins->length
+                && ins->data[next] == OpJump; jumps++) {
+            next = read_big_endian_uint24(ins->data + next + 1);
+        }
+        if (next < ins->length && ins->data[next] == OpReturnValue) {
+            ins->data[i] = OpTailCall;
+        }
+    }
+}
+
+// Whether [op] jumps to the position in its operand.
+static bool
+is_jump(Opcode op) {
+    switch (op) {
+        case OpJump:
+        case OpJumpNotTruthy:
+        case OpJumpNotEqual:
+        case OpJumpEqual:
+        case OpJumpNotLessThan:
+        case OpJumpNotGreaterThan:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void change_operand(Compiler *c, int op_pos, int operand);
+
+// The Opcode from OpAdd to OpGreaterThan of typed instruction [op], or [op].
+static Opcode
+untyped(Opcode op) {
+    if (op >= OpIAdd && op <= OpIGreaterThan) {
+        return OpAdd + (op - OpIAdd);
+
+    } else if (op >= OpFAdd && op <= OpFGreaterThan) {
+        return OpAdd + (op - OpFAdd);
+    }
+    return op;
+}
+
+// Maximum number of instructions replaced by a superinstruction.
+#define MAX_FUSED 4
+
+// Write the superinstruction for the instructions at [at] into [out] and
+// return the number of instructions it replaces, or 0 if there is none.
+// [at] has the positions of [n] instructions, and the end of the last.
+static int
+fuse(Instructions *out, uint8_t *data, int *at, int n, int num_parameters) {
+#define OP(i) data[at[i]]
+#define OPERAND(i) read_big_endian_uint24(data + at[i] + 1)
+
+    // recursive calls, whose number of arguments is known to be right.
+    if (n >= 2 && OP(0) == OpCurrentClosure
+            && (OP(1) == OpCall || OP(1) == OpTailCall)
+            && OPERAND(1) == num_parameters) {
+        make_into(out, OP(1) == OpCall ? OpCallSelf : OpTailCallSelf,
+                  OPERAND(1));
+        return 2;
+    }
+
+    // i += k
+    if (n >= 4 && OP(0) == OpGetLocal && OP(1) == OpConstant
+            && untyped(OP(2)) == OpAdd && OP(3) == OpSetLocal
+            && OPERAND(0) == OPERAND(3)) {
+        make_into(out, OpIncrementLocal, OPERAND(0), OPERAND(1));
+        return 4;
+    }
+
+    // operands of binary operations
+    if (n >= 2 && OP(0) == OpGetLocal && OP(1) == OpGetLocal) {
+        make_into(out, OpGetLocal2, OPERAND(0), OPERAND(1));
+        return 2;
+    }
+
+    return 0;
+#undef OP
+#undef OPERAND
+}
+
+// Peephole optimizer: replace sequences of instructions of the current
+// function with superinstructions, see code.h, and update the targets of
+// jumps and the positions of SourceMappings.  Only the first instruction of a
+// sequence may be the target of a jump.
+static void
+optimize(Compiler *c) {
+    Instructions *ins = c->cur_instructions, out = {0};
+    uint8_t *data = ins->data;
+
+    IntBuffer targets, positions;
+    IntBufferInit(&targets);
+    IntBufferInit(&positions);
+    IntBufferFill(&targets, false, ins->length + 1);
+    // new position of each instruction, and of the end.
+    IntBufferFill(&positions, 0, ins->length + 1);
+
+    for (int i = 0; i < ins->length; i += instruction_width(data[i])) {
+        if (is_jump(data[i])) {
+            targets.data[read_big_endian_uint24(data + i + 1)] = true;
+        }
+    }
+
+    int at[MAX_FUSED + 1];
+    for (int i = 0; i < ins->length; ) {
+        int n = 0;
+        for (at[0] = i; n < MAX_FUSED && at[n] < ins->length
+                && (n == 0 || !targets.data[at[n]]); n++) {
+            at[n + 1] = at[n] + instruction_width(data[at[n]]);
+        }
+
+        int pos = out.length,
+            fused = fuse(&out, data, at, n,
+                         c->cur_scope->function->num_parameters);
+        if (fused == 0) {
+            fused = 1;
+            instructions_allocate(&out, at[1] - i);
+            memcpy(out.data + pos, data + i, at[1] - i);
+        }
+
+        for (int j = 0; j < fused; j++) {
+            positions.data[at[j]] = pos;
+        }
+        i = at[fused];
+    }
+    positions.data[ins->length] = out.length;
+
+    free(ins->data);
+    *ins = out;
+
+    for (int i = 0; i < ins->length; i += instruction_width(ins->data[i])) {
+        if (is_jump(ins->data[i])) {
+            int target = read_big_endian_uint24(ins->data + i + 1);
+            change_operand(c, i, positions.data[target]);
+        }
+    }
+
+    // Of the SourceMappings moved to the same superinstruction, only the
+    // last is kept, it is of the innermost Node, whose instruction can fail.
+    SourceMappingBuffer *mappings = c->cur_mappings;
+    int length = 0, previous = -1;
+    for (int i = 0; i < mappings->length; i++) {
+        SourceMapping mapping = mappings->data[i];
+        int old_position = mapping.position;
+        mapping.position = positions.data[old_position];
+        while (length > 0 && old_position != previous
+                && mappings->data[length - 1].position == mapping.position) {
+            --length;
+        }
+        previous = old_position;
+        mappings->data[length++] = mapping;
+    }
+    mappings->length = length;
+
+    EmittedInstruction *emitted[] = {
+        &c->cur_scope->last_instruction,
+        &c->cur_scope->previous_instruction,
+    };
+    for (int i = 0; i < 2; i++) {
+        if (emitted[i]->position < positions.length - 1) {
+            emitted[i]->position = positions.data[emitted[i]->position];
+        }
+        if (emitted[i]->position < ins->length) {
+            emitted[i]->opcode = ins->data[emitted[i]->position];
+        }
+    }
+
+    free(targets.data);
+    free(positions.data);
+}
+
+// Number of Objects pushed minus the number popped by the instruction at
+// [ins].  [peak] is set to the most Objects above the stack before the
+// instruction while it runs.
+static int
+stack_effect(uint8_t *ins, int *peak) {
+    int effect;
+    switch (*ins) {
+        case OpConstant:
+        case OpTrue:
+        case OpFalse:
+        case OpNothing:
+        case OpGetGlobal:
+        case OpGetLocal:
+        case OpGetFree:
+        case OpGetBuiltin:
+        case OpCurrentClosure:
+        case OpRequire:
+            effect = 1;
+            break;
+
+        case OpGetLocal2:
+            effect = 2;
+            break;
+
+        case OpPop:
+        case OpAdd:
+        case OpSub:
+        case OpMul:
+        case OpDiv:
+        case OpEqual:
+        case OpNotEqual:
+        case OpLessThan:
+        case OpGreaterThan:
+        case OpJumpNotTruthy:
+        case OpSetGlobal:
+        case OpSetLocal:
+        case OpSetFree:
+        case OpIndex:
+        case OpReturnValue:
+        case OpAddInt:
+        case OpSubInt:
+        case OpMulInt:
+        case OpDivInt:
+        case OpEqualInt:
+        case OpNotEqualInt:
+        case OpLessThanInt:
+        case OpGreaterThanInt:
+        case OpAddFloat:
+        case OpSubFloat:
+        case OpMulFloat:
+        case OpDivFloat:
+        case OpEqualFloat:
+        case OpNotEqualFloat:
+        case OpLessThanFloat:
+        case OpGreaterThanFloat:
+        case OpIAdd:
+        case OpISub:
+        case OpIMul:
+        case OpIDiv:
+        case OpIEqual:
+        case OpINotEqual:
+        case OpILessThan:
+        case OpIGreaterThan:
+        case OpFAdd:
+        case OpFSub:
+        case OpFMul:
+        case OpFDiv:
+        case OpFEqual:
+        case OpFNotEqual:
+        case OpFLessThan:
+        case OpFGreaterThan:
+        case OpArrayIndex:
+            effect = -1;
+            break;
+
+        case OpJumpNotEqual:
+        case OpJumpEqual:
+        case OpJumpNotLessThan:
+        case OpJumpNotGreaterThan:
+            effect = -2;
+            break;
+
+        case OpMinus:
+        case OpBang:
+        case OpJump:
+        case OpReturn:
+        case OpHalt:
+            effect = 0;
+            break;
+
+        case OpSetIndex:
+            effect = -3;
+            break;
+
+        // a miss pushes the key, see vm.c.
+        case OpGetField:
+            *peak = 1;
+            return 0;
+        case OpSetField:
+            *peak = 1;
+            return -2;
+
+        // a local that is not an Integer is added on the stack, see vm.c.
+        case OpIncrementLocal:
+            *peak = 2;
+            return 0;
+
+        case OpArray:
+        case OpTable:
+            effect = 1 - read_big_endian_uint24(ins + 1);
+            break;
+
+        case OpCall:
+        case OpTailCall:
+            // arguments and function, replaced with the result.
+            effect = -read_big_endian_uint24(ins + 1);
+            break;
+
+        case OpCallSelf:
+        case OpTailCallSelf:
+            effect = 1 - read_big_endian_uint24(ins + 1);
+            break;
+
+        case OpClosure:
+            effect = 1 - read_big_endian_uint24(ins + 4);
+            break;
+
+        default:
+            die("stack_effect: Opcode %s (%d) not handled",
+                lookup(*ins)->name, *ins);
+    }
+    *peak = effect > 0 ? effect : 0;
+    return effect;
+}
+
+int stack_depths(Instructions *ins, IntBuffer *depths) {
+    IntBuffer pending;
+    IntBufferInit(&pending);
+
+    // -1 until reached.
+    IntBufferFill(depths, -1, ins->length + 1);
+
+    int max = 0;
+    if (ins->length > 0) {
+        depths->data[0] = 0;
+        IntBufferPush(&pending, 0);
+    }
+    while (pending.length > 0) {
+        int pos = pending.data[--pending.length],
+            depth = depths->data[pos], peak;
+        uint8_t *cur = ins->data + pos;
+
+        int after = depth + stack_effect(cur, &peak);
+        if (depth + peak > max) { max = depth + peak; }
+
+        int next[2], num_next = 0;
+        switch (*cur) {
+            case OpJump:
+                next[num_next++] = read_big_endian_uint24(cur + 1);
+                break;
+            case OpJumpNotTruthy:
+            case OpJumpNotEqual:
+            case OpJumpEqual:
+            case OpJumpNotLessThan:
+            case OpJumpNotGreaterThan:
+                next[num_next++] = read_big_endian_uint24(cur + 1);
+                next[num_next++] = pos + instruction_width(*cur);
+                break;
+            case OpReturnValue:
+            case OpReturn:
+            case OpHalt:
+                break;
+            default:
+                next[num_next++] = pos + instruction_width(*cur);
+        }
+
+        for (int i = 0; i < num_next; i++) {
+            if (next[i] > ins->length) { continue; }
+
+            if (depths->data[next[i]] == -1) {
+                depths->data[next[i]] = after;
+                if (next[i] < ins->length) {
+                    IntBufferPush(&pending, next[i]);
+                }
+            }
+            assert(depths->data[next[i]] == after);
+        }
+    }
+
+    free(pending.data);
+    return max;
+}
+
+void jump_targets(Instructions *ins, IntBuffer *depths, IntBuffer *targets,
+                  IntBuffer *entries) {
+    IntBufferFill(targets, false, ins->length + 1);
+    IntBufferFill(entries, false, ins->length + 1);
+    entries->data[0] = true;
+
+    for (int pos = 0; pos < ins->length;
+            pos += instruction_width(ins->data[pos])) {
+        if (depths->data[pos] == -1) { continue; }
+
+        int next = pos + instruction_width(ins->data[pos]);
+        switch (ins->data[pos]) {
+            case OpJump:
+            case OpJumpNotTruthy:
+            case OpJumpNotEqual:
+            case OpJumpEqual:
+            case OpJumpNotLessThan:
+            case OpJumpNotGreaterThan:
+                {
+                    int target = read_big_endian_uint24(ins->data + pos + 1);
+                    targets->data[target] = true;
+                    if (target < pos) {
+                        entries->data[target] = true;
+                    }
+                    break;
+                }
+
+            case OpCall:
+            case OpTailCall:
+            case OpCallSelf:
+            case OpTailCallSelf:
+            case OpRequire:
+                entries->data[next] = depths->data[next] != -1;
+                break;
+        }
+    }
+}
+
+// Maximum number of Objects on the stack, above the local variables, while
+// running [ins].
+static int
+max_stack_depth(Instructions *ins) {
+    IntBuffer depths;
+    IntBufferInit(&depths);
+    int max = stack_depths(ins, &depths);
+    free(depths.data);
+    return max;
+}
+
+// The limit of operands, see MaxOperand, exceeded by the positions or the
+// variables of the current function, or NULL.
+static char *
+exceeded_limit(Compiler *c) {
+    if (c->cur_instructions->length > MaxOperand) {
+        return "function is too large";
+    } else if (c->cur_symbol_table->num_definitions > MaxOperand + 1) {
+        return "too many variables in one function";
+    }
+    return NULL;
+}
+
+// change the operand of a jump instruction
+static void
+change_operand(Compiler *c, int op_pos, int operand) {
+    Opcode op = c->cur_instructions->data[op_pos];
+
+    assert(is_jump(op));
+
+    replace_instruction(c, op_pos, make(op, operand));
+}
+
+static void
+load_symbol(Compiler *c, Symbol *s) {
+    switch (s->scope) {
+        case GlobalScope:
+            emit(c, OpGetGlobal, s->index);
+            break;
+
+        case LocalScope:
+            emit(c, OpGetLocal, s->index);
+            break;
+
+        case FunctionScope:
+            emit(c, OpCurrentClosure);
+            break;
+
+        case FreeScope:
+            emit(c, OpGetFree, s->index);
+            break;
+    }
+}
+
+static Opcode
+operator_opcode(Token op) {
+    if ('+' == op.start[0]) {
+        return OpAdd;
+
+    } else if ('-' == op.start[0]) {
+        return OpSub;
+
+    } else if ('*' == op.start[0]) {
+        return OpMul;
+
+    } else if ('/' == op.start[0]) {
+        return OpDiv;
+
+    } else if ('<' == op.start[0]) {
+        return OpLessThan;
+
+    } else if ('>' == op.start[0]) {
+        return OpGreaterThan;
+
+    } else if (!strncmp("==", op.start, 2)) {
+        return OpEqual;
+
+    } else if (!strncmp("!=", op.start, 2)) {
+        return OpNotEqual;
+
+    } else {
+        die("compiler: unknown infix operator %.*s", LITERAL(op));
+    }
+}
+
+// Constant folding: constant expressions, of literals and operators, are
+// evaluated by the Compiler and emitted as one constant.  Operations which
+// fail in the VM, like an integer overflow or a division by zero, are not
+// folded, so that they fail at runtime.
+//
+// The Strings of folded values are allocated, see free_folded().
+
+static Object
+folded_string(const char *left, int left_length,
+              const char *right, int right_length) {
+    CharBuffer *str = malloc(sizeof(CharBuffer));
+    if (str == NULL) { die("fold - create string:"); }
+
+    int length = left_length + right_length;
+    *str = (CharBuffer){
+        .data = malloc(length + 1),
+        .length = length,
+        .capacity = length,
+    };
+    if (str->data == NULL) { die("fold - create string:"); }
+
+    memcpy(str->data, left, left_length);
+    memcpy(str->data + left_length, right, right_length);
+    str->data[length] = '\0';
+    return OBJ(o_String, .string = str);
+}
+
+static void
+free_folded(Object value) {
+    if (value.type == o_String) {
+        free(value.data.string->data);
+        free(value.data.string);
+    }
+}
+
+// Set [*result] to [left] [op] [right] as computed by the VM.  Returns false
+// if the operation fails.
+static bool
+fold_infix(Opcode op, Object left, Object right, Object *result) {
+    if (left.type == o_Integer && right.type == o_Integer) {
+        long l = left.data.integer, r = right.data.integer, res;
+        switch (op) {
+            case OpAdd:
+                if (__builtin_add_overflow(l, r, &res)) { return false; }
+                break;
+            case OpSub:
+                if (__builtin_sub_overflow(l, r, &res)) { return false; }
+                break;
+            case OpMul:
+                if (__builtin_mul_overflow(l, r, &res)) { return false; }
+                break;
+            case OpDiv:
+                if (r == 0 || (l == LONG_MIN && r == -1)) { return false; }
+                res = l / r;
+                break;
+            case OpLessThan:
+                *result = OBJ_BOOL(l < r);
+                return true;
+            case OpGreaterThan:
+                *result = OBJ_BOOL(l > r);
+                return true;
+            default:
+                *result = object_eq(left, right);
+                result->data.boolean ^= op == OpNotEqual;
+                return true;
+        }
+        *result = OBJ(o_Integer, .integer = res);
+        return true;
+
+    } else if (left.type == o_Float && right.type == o_Float) {
+        double l = left.data.floating, r = right.data.floating, res;
+        switch (op) {
+            case OpAdd:
+                res = l + r;
+                break;
+            case OpSub:
+                res = l - r;
+                break;
+            case OpMul:
+                res = l * r;
+                break;
+            case OpDiv:
+                // like execute_binary_float_operation().
+                if (right.data.integer == 0) { return false; }
+                res = l / r;
+                break;
+            case OpLessThan:
+                *result = OBJ_BOOL(l < r);
+                return true;
+            case OpGreaterThan:
+                *result = OBJ_BOOL(l > r);
+                return true;
+            default:
+                *result = object_eq(left, right);
+                result->data.boolean ^= op == OpNotEqual;
+                return true;
+        }
+        *result = OBJ(o_Float, .floating = res);
+        return true;
+
+    } else if (left.type == o_String && right.type == o_String
+            && op == OpAdd) {
+        CharBuffer *l = left.data.string, *r = right.data.string;
+        *result = folded_string(l->data, l->length, r->data, r->length);
+        return true;
+    }
+
+    if (op == OpEqual || op == OpNotEqual) {
+        *result = object_eq(left, right);
+        result->data.boolean ^= op == OpNotEqual;
+        return true;
+    }
+    return false;
+}
+
+// Set [*value] to the value of [n] if it is a constant expression.
+static bool
+fold(Node n, Object *value) {
+    switch (n.typ) {
+        case n_IntegerLiteral:
+            *value = OBJ(o_Integer, .integer = ((IntegerLiteral *)n.obj)->value);
+            return true;
+
+        case n_FloatLiteral:
+            *value = OBJ(o_Float, .floating = ((FloatLiteral *)n.obj)->value);
+            return true;
+
+        case n_BooleanLiteral:
+            *value = OBJ_BOOL(((BooleanLiteral *)n.obj)->value);
+            return true;
+
+        case n_NothingLiteral:
+            *value = OBJ_NOTHING;
+            return true;
+
+        case n_StringLiteral:
+            {
+                Token tok = ((StringLiteral *)n.obj)->tok;
+                *value = folded_string(tok.start, tok.length, "", 0);
+                return true;
+            }
+
+        case n_PrefixExpression:
+            {
+                PrefixExpression *pe = n.obj;
+                Object right;
+                if (!fold(pe->right, &right)) { return false; }
+
+                // like execute_bang_operator() and execute_minus_operator().
+                if ('!' == pe->op.start[0]) {
+                    bool falsy = right.type == o_Nothing
+                        || (right.type == o_Boolean && !right.data.boolean);
+                    free_folded(right);
+                    *value = OBJ_BOOL(falsy);
+                    return true;
+
+                } else if (right.type == o_Integer
+                        && right.data.integer != LONG_MIN) {
+                    *value = OBJ(o_Integer, .integer = -right.data.integer);
+                    return true;
+
+                } else if (right.type == o_Float) {
+                    *value = OBJ(o_Float, .floating = -right.data.floating);
+                    return true;
+                }
+                free_folded(right);
+                return false;
+            }
+
+        case n_InfixExpression:
+            {
+                InfixExpression *ie = n.obj;
+                Object left, right;
+                if (!fold(ie->left, &left)) { return false; }
+                if (!fold(ie->right, &right)) {
+                    free_folded(left);
+                    return false;
+                }
+
+                bool ok = fold_infix(operator_opcode(ie->op), left, right,
+                                     value);
+                free_folded(left);
+                free_folded(right);
+                return ok;
+            }
+
+        default:
+            return false;
+    }
+}
+
+// Emit the folded [value] of [n] and free it.
+static error
+emit_folded(Compiler *c, Node n, Object value) {
+    Constant constant;
+    switch (value.type) {
+        case o_Boolean:
+            emit(c, value.data.boolean ? OpTrue : OpFalse);
+            return 0;
+
+        case o_Nothing:
+            emit(c, OpNothing);
+            return 0;
+
+        case o_Integer:
+            constant = (Constant){ c_Integer, { .integer = value.data.integer } };
+            break;
+
+        case o_Float:
+            constant = (Constant){ c_Float, { .floating = value.data.floating } };
+            break;
+
+        case o_String:
+            {
+                // the Token and its characters, in one allocation.
+                CharBuffer *str = value.data.string;
+                Token *tok = malloc(sizeof(Token) + str->length);
+                if (tok == NULL) { die("fold - create string constant:"); }
+
+                *tok = *node_token(n);
+                tok->type = t_String;
+                tok->start = memcpy(tok + 1, str->data, str->length);
+                tok->length = str->length;
+                free_folded(value);
+
+                int num_constants = c->constants.length;
+                constant = (Constant){ c_String, { .string = tok } };
+                int idx = add_constant(c, constant);
+                if (c->constants.length > num_constants) {
+                    BufferPush(&c->folded_strings, tok);
+                } else {
+                    free(tok);
+                }
+                if (idx == -1) { return c_error(n, add_constant_err); }
+
+                emit(c, OpConstant, idx);
+                return 0;
+            }
+
+        default:
+            die("emit_folded: unexpected type %s",
+                show_object_type(value.type));
+    }
+
+    int idx = add_constant(c, constant);
+    if (idx == -1) { return c_error(n, add_constant_err); }
+
+    emit(c, OpConstant, idx);
+    return 0;
+}
+
+// Remove the constants from index [from], which are only used by discarded
+// instructions.  Their Functions are freed with the Compiler, because Symbols
+// of unreachable code may still refer to them, see inlined_function().
+static void
+remove_constants(Compiler *c, int from) {
+    int num_removed = c->constants.length - from;
+    if (num_removed == 0) { return; }
+
+    Object *keys = malloc(num_removed * sizeof(Object));
+    if (keys == NULL) { die("remove_constants: malloc"); }
+
+    int num_keys = 0;
+    tbl_it it = tbl_iterator(&c->constants_table);
+    while (tbl_next(&it)) {
+        if (it.cur_val.data.integer >= from) {
+            keys[num_keys++] = it.cur_key;
+        }
+    }
+    for (int i = 0; i < num_keys; i++) {
+        table_remove(&c->constants_table, keys[i]);
+        if (keys[i].type == o_String) {
+            free(keys[i].data.string->data);
+            free(keys[i].data.string);
+        }
+    }
+    free(keys);
+
+    for (int i = from; i < c->constants.length; i++) {
+        Constant constant = c->constants.data[i];
+        if (constant.type == c_Function) {
+            BufferPush(&c->discarded_functions, constant.data.function);
+        }
+    }
+    c->constants.length = from;
+}
+
+// Compile [n] for its errors and definitions, and discard its instructions
+// and constants, because it is never run: dead branches and statements after
+// a return, break or continue statement.
+static error
+compile_unreachable(Compiler *c, Node n) {
+    CompiledFunction *fn = c->cur_scope->function;
+    int num_constants = c->constants.length,
+        num_instructions = fn->instructions.length,
+        num_mappings = fn->mappings.length,
+        num_inline_frames = fn->inline_frames.length,
+        num_field_caches = fn->field_caches.length,
+        num_call_caches = fn->call_caches.length;
+    EmittedInstruction last = c->cur_scope->last_instruction,
+                       previous = c->cur_scope->previous_instruction;
+
+    Loop *loop = c->cur_scope->loop;
+    int num_breaks = 0, num_continues = 0;
+    if (loop) {
+        num_breaks = loop->breaks.length;
+        num_continues = loop->continues.length;
+    }
+
+    error err = _compile(c, n);
+
+    remove_constants(c, num_constants);
+
+    // [c.cur_scope] is moved if a function is compiled.
+    fn->instructions.length = num_instructions;
+    fn->mappings.length = num_mappings;
+    fn->inline_frames.length = num_inline_frames;
+    fn->field_caches.length = num_field_caches;
+    fn->call_caches.length = num_call_caches;
+    c->cur_scope->last_instruction = last;
+    c->cur_scope->previous_instruction = previous;
+    if (loop) {
+        loop->breaks.length = num_breaks;
+        loop->continues.length = num_continues;
+    }
+    return err;
+}
+
+static int get_builtin(Token *tok) {
+    int len;
+    const Builtin *builtin = get_builtins(&len);
+    for (int i = 0; i < len; i++) {
+        if (tok->length == builtin[i].name_len
+                && strncmp(builtin[i].name, tok->start, tok->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Type inference: the types of the variables of a function, or the global
+// variables of a Program, are inferred from all the values assigned to them,
+// so that operators with operands of proven types are compiled to typed
+// instructions, see code.h.
+//
+// A variable only has a proven type if its first definition is not in a
+// Block Statement, so it is always defined when used, and it is not assigned
+// in nested functions.
+
+typedef enum {
+    ty_None = 1, // no value inferred yet
+    ty_Integer,
+    ty_Float,
+    ty_Boolean,
+    ty_String,
+    ty_Array,
+    ty_Unknown,
+} Type;
+
+#define TYPE(t) ((void *) (intptr_t) (t))
+
+// A value assigned to a variable.
+typedef struct {
+    Identifier *name;
+    Node value; // [value.obj] is NULL in `let name;`
+
+    // Operator of an OperatorAssignment, or NULL.
+    Token *op;
+} Binding;
+
+BUFFER(Binding, Binding)
+DEFINE_BUFFER(Binding, Binding)
+
+typedef struct {
+    // Types of the variables defined so far.
+    ht *types;
+
+    // Variables used before being defined, or assigned in nested functions.
+    ht *unknown;
+
+    BindingBuffer bindings;
+
+    int block_depth;
+    bool nested; // in a nested function.
+} Inference;
+
+static Type
+join(Type a, Type b) {
+    if (a == ty_None) { return b; }
+    if (b == ty_None || a == b) { return a; }
+    return ty_Unknown;
+}
+
+// Type of the result of [op], from OpAdd to OpGreaterThan.
+static Type
+operation_type(Opcode op, Type left, Type right) {
+    if (op >= OpEqual) {
+        return ty_Boolean;
+
+    } else if (left == ty_None || right == ty_None) {
+        return ty_None;
+
+    } else if (left == right && (left == ty_Integer || left == ty_Float)) {
+        return left;
+
+    } else if (op == OpAdd && left == ty_String && right == ty_String) {
+        return ty_String;
+
+    } else if (op == OpMul && left == ty_Array && right == ty_Integer) {
+        return ty_Array;
+    }
+    return ty_Unknown;
+}
+
+// Type of the variable [id] resolves to in [st].
+static Type
+variable_type(SymbolTable *st, Identifier *id) {
+    uint64_t h = hash(id);
+    for (; st; st = st->outer) {
+        Symbol *symbol = ht_get_hash(st->store, h);
+        if (symbol == NULL || symbol->scope == FreeScope) { continue; }
+
+        void *type = NULL;
+        if (symbol->scope <= LocalScope && st->types) {
+            type = ht_get_hash(st->types, h);
+        }
+        return type ? (Type) (intptr_t) type : ty_Unknown;
+    }
+    return ty_Unknown;
+}
+
+// Type of expression [n], with the types of the variables being inferred in
+// [locals], or of the variables in the Symbol Tables if NULL.
+static Type
+expression_type(Compiler *c, ht *locals, Node n) {
+    switch (n.typ) {
+        case n_IntegerLiteral:
+            return ty_Integer;
+
+        case n_FloatLiteral:
+            return ty_Float;
+
+        case n_BooleanLiteral:
+            return ty_Boolean;
+
+        case n_StringLiteral:
+            return ty_String;
+
+        case n_ArrayLiteral:
+            return ty_Array;
+
+        case n_Identifier:
+            {
+                Identifier *id = n.obj;
+                if (get_builtin(&id->tok) != -1) {
+                    return ty_Unknown;
+                }
+
+                void *type = locals ? ht_get_hash(locals, hash(id)) : NULL;
+                if (type) {
+                    return (Type) (intptr_t) type;
+                }
+                return variable_type(c->cur_symbol_table, id);
+            }
+
+        case n_PrefixExpression:
+            {
+                PrefixExpression *pe = n.obj;
+                if ('!' == pe->op.start[0]) {
+                    return ty_Boolean;
+                }
+
+                Type right = expression_type(c, locals, pe->right);
+                if (right == ty_None || right == ty_Integer
+                        || right == ty_Float) {
+                    return right;
+                }
+                return ty_Unknown;
+            }
+
+        case n_InfixExpression:
+            {
+                InfixExpression *ie = n.obj;
+                return operation_type(operator_opcode(ie->op),
+                                      expression_type(c, locals, ie->left),
+                                      expression_type(c, locals, ie->right));
+            }
+
+        case n_CallExpression:
+            {
+                CallExpression *ce = n.obj;
+                Token *tok = node_token(ce->function);
+                if (ce->function.typ == n_Identifier
+                        && tok->length == 3 && !strncmp("len", tok->start, 3)) {
+                    return ty_Integer;
+                }
+                return ty_Unknown;
+            }
+
+        default:
+            return ty_Unknown;
+    }
+}
+
+static void
+infer_node(Inference *inf, Node n);
+
+static void
+infer_nodes(Inference *inf, NodeBuffer nodes) {
+    for (int i = 0; i < nodes.length; i++) {
+        infer_node(inf, nodes.data[i]);
+    }
+}
+
+static void
+infer_block(Inference *inf, BlockStatement *bs) {
+    if (bs == NULL) { return; }
+
+    ++inf->block_depth;
+    infer_nodes(inf, bs->stmts);
+    --inf->block_depth;
+}
+
+// Add the value assigned to [name] to the Bindings of [inf].
+static void
+infer_binding(Inference *inf, Node name, Node value, Token *op) {
+    if (name.typ != n_Identifier) { return; }
+
+    Identifier *id = name.obj;
+    if (inf->nested || ht_get_hash(inf->types, hash(id)) == NULL) {
+        ht_set_hash(inf->unknown, id, id, hash(id));
+        return;
+    }
+    BindingBufferPush(&inf->bindings, (Binding){ id, value, op });
+}
+
+// Collect the Bindings of the variables in [n], in the order [n] is compiled.
+static void
+infer_node(Inference *inf, Node n) {
+    if (n.obj == NULL) { return; }
+
+    switch (n.typ) {
+        case n_Identifier:
+            {
+                Identifier *id = n.obj;
+                if (ht_get_hash(inf->types, hash(id)) == NULL) {
+                    ht_set_hash(inf->unknown, id, id, hash(id));
+                }
+                return;
+            }
+
+        case n_LetStatement:
+            {
+                LetStatement *ls = n.obj;
+                for (int i = 0; i < ls->names.length; i++) {
+                    Identifier *id = ls->names.data[i];
+                    infer_node(inf, ls->values.data[i]);
+                    if (inf->nested) { continue; }
+
+                    if (ht_get_hash(inf->types, hash(id)) == NULL) {
+                        Type type = ty_Unknown;
+                        if (inf->block_depth == 0) { type = ty_None; }
+                        ht_set_hash(inf->types, id, TYPE(type), hash(id));
+                    }
+                    BindingBufferPush(&inf->bindings,
+                            (Binding){ id, ls->values.data[i], NULL });
+                }
+                return;
+            }
+
+        case n_Assignment:
+            {
+                Assignment *a = n.obj;
+                infer_node(inf, a->right);
+                if (a->left.typ != n_Identifier) {
+                    infer_node(inf, a->left);
+                }
+                infer_binding(inf, a->left, a->right, NULL);
+                return;
+            }
+
+        case n_OperatorAssignment:
+            {
+                OperatorAssignment *oa = n.obj;
+                infer_node(inf, oa->left);
+                infer_node(inf, oa->right);
+                infer_binding(inf, oa->left, oa->right, &oa->op);
+                return;
+            }
+
+        case n_ReturnStatement:
+            infer_node(inf, ((ReturnStatement *) n.obj)->return_value);
+            return;
+
+        case n_ExpressionStatement:
+            infer_node(inf, ((ExpressionStatement *) n.obj)->expression);
+            return;
+
+        case n_BlockStatement:
+            infer_block(inf, n.obj);
+            return;
+
+        case n_LoopStatement:
+            {
+                LoopStatement *ls = n.obj;
+                infer_node(inf, ls->start);
+                infer_node(inf, ls->condition);
+                infer_block(inf, ls->body);
+                infer_node(inf, ls->update);
+                return;
+            }
+
+        case n_IfExpression:
+            {
+                IfExpression *ie = n.obj;
+                infer_node(inf, ie->condition);
+                infer_block(inf, ie->consequence);
+                infer_block(inf, ie->alternative);
+                return;
+            }
+
+        case n_PrefixExpression:
+            infer_node(inf, ((PrefixExpression *) n.obj)->right);
+            return;
+
+        case n_InfixExpression:
+            infer_node(inf, ((InfixExpression *) n.obj)->left);
+            infer_node(inf, ((InfixExpression *) n.obj)->right);
+            return;
+
+        case n_IndexExpression:
+            infer_node(inf, ((IndexExpression *) n.obj)->left);
+            infer_node(inf, ((IndexExpression *) n.obj)->index);
+            return;
+
+        case n_CallExpression:
+            infer_nodes(inf, ((CallExpression *) n.obj)->args);
+            infer_node(inf, ((CallExpression *) n.obj)->function);
+            return;
+
+        case n_RequireExpression:
+            infer_nodes(inf, ((RequireExpression *) n.obj)->args);
+            return;
+
+        case n_ArrayLiteral:
+            infer_nodes(inf, ((ArrayLiteral *) n.obj)->elements);
+            return;
+
+        case n_TableLiteral:
+            {
+                PairBuffer pairs = ((TableLiteral *) n.obj)->pairs;
+                for (int i = 0; i < pairs.length; i++) {
+                    infer_node(inf, pairs.data[i].key);
+                    infer_node(inf, pairs.data[i].val);
+                }
+                return;
+            }
+
+        case n_FunctionLiteral:
+            {
+                bool nested = inf->nested;
+                inf->nested = true;
+                infer_block(inf, ((FunctionLiteral *) n.obj)->body);
+                inf->nested = nested;
+                return;
+            }
+
+        default:
+            return;
+    }
+}
+
+// Infer the types of the variables defined in [stmts] from [from], and
+// [params] if not NULL, whose types are unknown.
+static ht *
+infer_types(Compiler *c, NodeBuffer stmts, int from, Buffer *params) {
+    Inference inf = {
+        .types = ht_create(),
+        .unknown = ht_create(),
+    };
+    if (inf.types == NULL || inf.unknown == NULL) {
+        die("infer_types - create hash tables:");
+    }
+
+    for (int i = 0; params && i < params->length; i++) {
+        Identifier *id = params->data[i];
+        ht_set_hash(inf.types, id, TYPE(ty_Unknown), hash(id));
+    }
+    for (int i = from; i < stmts.length; i++) {
+        infer_node(&inf, stmts.data[i]);
+    }
+
+    BindingBuffer bindings = inf.bindings;
+    for (int i = 0; i < bindings.length; i++) {
+        Identifier *id = bindings.data[i].name;
+        if (ht_get_hash(inf.unknown, hash(id))) {
+            ht_set_hash(inf.types, id, TYPE(ty_Unknown), hash(id));
+        }
+    }
+
+    // until the types of all variables include all the values assigned.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < bindings.length; i++) {
+            Binding b = bindings.data[i];
+            uint64_t h = hash(b.name);
+            Type type = (Type) (intptr_t) ht_get_hash(inf.types, h);
+            if (type == ty_Unknown) { continue; }
+
+            Type value = ty_Unknown;
+            if (b.value.obj) {
+                value = expression_type(c, inf.types, b.value);
+            }
+            if (b.op) {
+                value = operation_type(operator_opcode(*b.op), type, value);
+            }
+
+            Type joined = join(type, value);
+            if (joined != type) {
+                ht_set_hash(inf.types, b.name, TYPE(joined), h);
+                changed = true;
+            }
+        }
+    }
+
+    // variables only assigned values of unknown types.
+    for (int i = 0; i < bindings.length; i++) {
+        Identifier *id = bindings.data[i].name;
+        if (ht_get_hash(inf.types, hash(id)) == TYPE(ty_None)) {
+            ht_set_hash(inf.types, id, TYPE(ty_Unknown), hash(id));
+        }
+    }
+
+    ht_destroy(inf.unknown);
+    free(bindings.data);
+    return inf.types;
+}
+
+// Emit the instruction of infix operator [op], typed if the types of its
+// operands are proven.
+static void
+compile_operator(Compiler *c, Token op, Type left, Type right) {
+    Opcode opcode = operator_opcode(op);
+    if (left == right && left == ty_Integer) {
+        opcode = OpIAdd + (opcode - OpAdd);
+
+    } else if (left == right && left == ty_Float) {
+        opcode = OpFAdd + (opcode - OpAdd);
+    }
+    emit(c, opcode);
+}
+
+// Add the names assigned to in [n], and defined more than once, to
+// [reassigned].  [defined] has the names defined so far.
+static void
+scan_assignments(Node n, ht *defined, ht *reassigned) {
+    if (n.obj == NULL) { return; }
+
+#define SCAN(node) scan_assignments(node, defined, reassigned)
+#define SCAN_ALL(buf) \
+    for (int i = 0; i < (buf).length; i++) { SCAN((buf).data[i]); }
+
+    switch (n.typ) {
+        case n_BlockStatement:
+            {
+                BlockStatement *bs = n.obj;
+                SCAN_ALL(bs->stmts);
+                return;
+            }
+
+        case n_ExpressionStatement:
+            SCAN(((ExpressionStatement *) n.obj)->expression);
+            return;
+
+        case n_LetStatement:
+            {
+                LetStatement *ls = n.obj;
+                for (int i = 0; i < ls->names.length; i++) {
+                    Identifier *id = ls->names.data[i];
+                    if (ht_get_hash(defined, hash(id))) {
+                        ht_set_hash(reassigned, id, id, hash(id));
+                    } else {
+                        ht_set_hash(defined, id, id, hash(id));
+                    }
+                }
+                SCAN_ALL(ls->values);
+                return;
+            }
+
+        case n_Assignment:
+        case n_OperatorAssignment:
+            {
+                Node left, right;
+                if (n.typ == n_Assignment) {
+                    left = ((Assignment *) n.obj)->left;
+                    right = ((Assignment *) n.obj)->right;
+                } else {
+                    left = ((OperatorAssignment *) n.obj)->left;
+                    right = ((OperatorAssignment *) n.obj)->right;
+                }
+
+                if (left.typ == n_Identifier) {
+                    ht_set_hash(reassigned, left.obj, left.obj, hash(left.obj));
+                }
+                SCAN(left);
+                SCAN(right);
+                return;
+            }
+
+        case n_ReturnStatement:
+            SCAN(((ReturnStatement *) n.obj)->return_value);
+            return;
+
+        case n_LoopStatement:
+            {
+                LoopStatement *ls = n.obj;
+                SCAN(ls->start);
+                SCAN(ls->condition);
+                SCAN(ls->update);
+                SCAN(NODE(n_BlockStatement, ls->body));
+                return;
+            }
+
+        case n_PrefixExpression:
+            SCAN(((PrefixExpression *) n.obj)->right);
+            return;
+
+        case n_InfixExpression:
+            SCAN(((InfixExpression *) n.obj)->left);
+            SCAN(((InfixExpression *) n.obj)->right);
+            return;
+
+        case n_IfExpression:
+            {
+                IfExpression *ie = n.obj;
+                SCAN(ie->condition);
+                SCAN(NODE(n_BlockStatement, ie->consequence));
+                SCAN(NODE(n_BlockStatement, ie->alternative));
+                return;
+            }
+
+        case n_IndexExpression:
+            SCAN(((IndexExpression *) n.obj)->left);
+            SCAN(((IndexExpression *) n.obj)->index);
+            return;
+
+        case n_CallExpression:
+            {
+                CallExpression *ce = n.obj;
+                SCAN(ce->function);
+                SCAN_ALL(ce->args);
+                return;
+            }
+
+        case n_RequireExpression:
+            SCAN_ALL(((RequireExpression *) n.obj)->args);
+            return;
 
-static char *add_constant_err = "too many constant variables";
+        case n_ArrayLiteral:
+            SCAN_ALL(((ArrayLiteral *) n.obj)->elements);
+            return;
 
-DEFINE_BUFFER(Constant, Constant)
-DEFINE_BUFFER(Scope, CompilationScope)
+        case n_TableLiteral:
+            {
+                PairBuffer pairs = ((TableLiteral *) n.obj)->pairs;
+                for (int i = 0; i < pairs.length; i++) {
+                    SCAN(pairs.data[i].key);
+                    SCAN(pairs.data[i].val);
+                }
+                return;
+            }
 
-void compiler_init(Compiler *c) {
-    memset(c, 0, sizeof(Compiler));
+        case n_FunctionLiteral:
+            SCAN(NODE(n_BlockStatement, ((FunctionLiteral *) n.obj)->body));
+            return;
 
-    if (table_init(&c->constants_table) == NULL) {
-        die("compiler_init - create constants table:");
+        default:
+            return;
     }
+#undef SCAN
+#undef SCAN_ALL
 }
 
-void compiler_free(Compiler *c) {
-    for (int i = 0; i < c->scopes.length; ++i) {
-        free_function(c->scopes.data[i].function);
-    }
-    free(c->scopes.data);
+// Maximum size in bytes of the instructions of an inlined function.
+#define MAX_INLINED 32
 
-    SymbolTable *next, *cur = c->cur_symbol_table;
-    while (cur) {
-        next = cur->outer;
-        symbol_table_free(cur);
-        cur = next;
+// Whether calls to [fn] can be replaced with its instructions: it is small,
+// returns only at its end and does not refer to itself or a sub-module.
+static bool
+inlinable(CompiledFunction *fn) {
+    Instructions *ins = &fn->instructions;
+    if (ins->length > MAX_INLINED) {
+        return false;
     }
 
-    for (int i = 0; i < c->constants.length; i++) {
-        Constant *constant = &c->constants.data[i];
-        if (constant->type == c_Function) {
-            free_function(constant->data.function);
-        }
-    }
-    free(c->constants.data);
-    table_free(&c->constants_table);
+    int end = ins->length - 1;
+    for (int i = 0; i < ins->length; i += instruction_width(ins->data[i])) {
+        switch (ins->data[i]) {
+            case OpReturnValue:
+            case OpReturn:
+                if (i != end) { return false; }
+                break;
 
-    memset(c, 0, sizeof(Compiler));
-}
+            case OpCurrentClosure:
+            case OpCallSelf:
+            case OpTailCallSelf:
+            case OpGetFree:
+            case OpSetFree:
+            case OpRequire:
+                return false;
 
-void compiler_reset(Compiler *c) {
-    if (c->scopes.length > 0) {
-        // free unsuccessfully `CompiledFunctions`
-        for (; c->scopes.length > 1; --c->scopes.length) {
-            free_function(c->scopes.data[c->scopes.length].function);
+            default:
+                break;
         }
-
-        // set c.cur_* variables
-        c->cur_scope = &c->scopes.data[0];
-        CompiledFunction *function = c->cur_scope->function;
-        c->cur_instructions = &function->instructions;
-        c->cur_mappings = &function->mappings;
-    }
-
-    SymbolTable *next, *cur = c->cur_symbol_table;
-    while (cur && cur->outer) {
-        next = cur->outer;
-        symbol_table_free(cur);
-        cur = next;
     }
+    return true;
 }
 
-static uint64_t
-hash(Identifier *id) {
-    return hash_string_fnv1a(id->tok.start, id->tok.length);
-}
-
-static bool
-last_instruction_is(Compiler *c, Opcode op) {
-    if (c->cur_instructions->length == 0) {
-        return false;
+// The function called by [ce] if the call is inlined: the callee is a
+// variable bound by a `let` to a function literal without free variables,
+// see n_LetStatement, which is never reassigned.
+static CompiledFunction *
+inlined_function(Compiler *c, CallExpression *ce) {
+    if (c->incremental || ce->function.typ != n_Identifier) {
+        return NULL;
     }
-    return c->cur_scope->last_instruction.opcode == op;
-}
 
-static void
-append_return_if_not_present(Compiler *c) {
-    Opcode last = c->cur_scope->last_instruction.opcode;
-    if (last == OpReturn || last == OpReturnValue) {
-        return;
+    Identifier *id = ce->function.obj;
+    uint64_t h = hash(id);
+    if (get_builtin(&id->tok) != -1 || ht_get_hash(c->reassigned, h)) {
+        return NULL;
     }
 
-    emit(c, OpReturn);
-}
-
-// if the last statement is an Expression Statement, remove its OpPop.
-//
-// Otherwise emit an OpNothing, because no other Statement should produce a value.
-static void
-remove_last_expression_stmt_pop(Compiler *c, NodeBuffer stmts) {
-    if (last_instruction_is(c, OpPop)
-            && stmts.length > 0
-            && stmts.data[stmts.length - 1].typ == n_ExpressionStatement) {
-        // remove last pop
-        c->cur_instructions->length = c->cur_scope->last_instruction.position;
-        c->cur_scope->last_instruction = c->cur_scope->previous_instruction;
-
-    } else {
-        emit(c, OpNothing);
+    // resolve [id] without making it a free variable of the current function.
+    Symbol *symbol = NULL;
+    for (SymbolTable *st = c->cur_symbol_table; st; st = st->outer) {
+        symbol = ht_get_hash(st->store, h);
+        if (symbol && symbol->scope != FreeScope) { break; }
+    }
+    if (symbol == NULL || symbol->function == NULL) {
+        return NULL;
     }
-}
 
-static void
-replace_instruction(Compiler *c, int pos, Instructions new) {
-    uint8_t* ins = c->cur_instructions->data;
-    for (int i = 0; i < new.length; i++) {
-        ins[pos + i] = new.data[i];
+    CompiledFunction *fn = symbol->function;
+    int num_variables = c->cur_symbol_table->num_definitions + fn->num_locals,
+        num_field_caches = c->cur_scope->function->field_caches.length
+            + fn->field_caches.length,
+        num_call_caches = c->cur_scope->function->call_caches.length
+            + fn->call_caches.length;
+
+    if (fn->num_parameters != ce->args.length
+            || num_variables > MaxOperand + 1
+            || num_field_caches > MaxOperand + 1
+            || num_call_caches > MaxOperand + 1) {
+        return NULL;
     }
-    free(new.data);
+    return fn;
 }
 
+// Emit the instructions of [fn] in place of the OpCall of [call], with the
+// arguments on the stack.  Its local variables are moved into new variables
+// of the current function, and its SourceMappings and InlineFrames are kept
+// for errors in its instructions, in a new InlineFrame of [call].
 static void
-replace_last_opcode_with(Compiler *c, Opcode old, Opcode new) {
-    int last_pos = c->cur_scope->last_instruction.position;
-
-    assert(c->cur_instructions->data[last_pos] == old);
+inline_call(Compiler *c, CompiledFunction *fn, Node call) {
+    CallExpression *ce = call.obj;
+    int num_args = ce->args.length;
+    SymbolTable *st = c->cur_symbol_table;
+    int base = st->num_definitions;
+    st->num_definitions += fn->num_locals;
+
+    Opcode get = OpGetLocal, set = OpSetLocal;
+    if (st->outer == NULL) {
+        get = OpGetGlobal;
+        set = OpSetGlobal;
+    }
 
-    c->cur_instructions->data[last_pos] = new;
-    c->cur_scope->last_instruction.opcode = new;
-}
+    for (int i = num_args - 1; i >= 0; i--) {
+        emit(c, set, base + i);
+    }
 
-static void
-replace_last_pop_with_return(Compiler *c) {
-    replace_last_opcode_with(c, OpPop, OpReturnValue);
-}
+    Instructions *ins = &fn->instructions;
+    FieldCacheBuffer *caches = &c->cur_scope->function->field_caches;
+    CallCacheBuffer *call_caches = &c->cur_scope->function->call_caches;
+
+    // new position of each instruction, and of the end.
+    IntBuffer positions, jumps;
+    IntBufferInit(&positions);
+    IntBufferInit(&jumps);
+    IntBufferFill(&positions, 0, ins->length + 1);
+
+    // the final OpReturnValue or OpReturn
+    int end = ins->length - 1;
+    for (int i = 0; i < end; i += instruction_width(ins->data[i])) {
+        Opcode op = ins->data[i];
+        uint8_t *operands = ins->data + i + 1;
+        positions.data[i] = c->cur_instructions->length;
+
+        switch (op) {
+            case OpGetLocal:
+                emit(c, get, base + read_big_endian_uint24(operands));
+                break;
 
-// change the operand of an `OpJump` instruction
-static void
-change_operand(Compiler *c, int op_pos, int operand) {
-    Opcode op = c->cur_instructions->data[op_pos];
+            case OpSetLocal:
+                emit(c, set, base + read_big_endian_uint24(operands));
+                break;
 
-    assert(op == OpJump || op == OpJumpNotTruthy);
+            // superinstructions are expanded, and fused again by optimize().
+            case OpGetLocal2:
+                emit(c, get, base + read_big_endian_uint24(operands));
+                emit(c, get, base + read_big_endian_uint24(operands + 3));
+                break;
 
-    replace_instruction(c, op_pos, make(op, operand));
-}
+            case OpIncrementLocal:
+                emit(c, get, base + read_big_endian_uint24(operands));
+                emit(c, OpConstant, read_big_endian_uint24(operands + 3));
+                emit(c, OpAdd);
+                emit(c, set, base + read_big_endian_uint24(operands));
+                break;
 
-static void
-load_symbol(Compiler *c, Symbol *s) {
-    switch (s->scope) {
-        case GlobalScope:
-            emit(c, OpGetGlobal, s->index);
-            break;
+            case OpGetField:
+            case OpSetField:
+                FieldCacheBufferPush(caches, (FieldCache){0});
+                emit(c, op, read_big_endian_uint24(operands),
+                     caches->length - 1);
+                break;
 
-        case LocalScope:
-            emit(c, OpGetLocal, s->index);
-            break;
+            case OpCall:
+            case OpTailCall:
+                CallCacheBufferPush(call_caches, (CallCache){0});
+                emit(c, OpCall, read_big_endian_uint24(operands),
+                     call_caches->length - 1);
+                break;
 
-        case FunctionScope:
-            emit(c, OpCurrentClosure);
-            break;
+            default:
+                if (is_jump(op)) {
+                    IntBufferPush(&jumps, emit(c, op, 9999));
+                    IntBufferPush(&jumps, read_big_endian_uint24(operands));
+                    break;
+                }
 
-        case FreeScope:
-            emit(c, OpGetFree, s->index);
-            break;
+                {
+                    int width = instruction_width(op),
+                        pos = c->cur_instructions->length;
+                    instructions_allocate(c->cur_instructions, width);
+                    memcpy(c->cur_instructions->data + pos, ins->data + i, width);
+                    set_last_instruction(c, op, pos);
+                }
+        }
     }
-}
-
-static void
-compile_operator(Compiler *c, Token op) {
-    if ('+' == op.start[0]) {
-        emit(c, OpAdd);
-
-    } else if ('-' == op.start[0]) {
-        emit(c, OpSub);
-
-    } else if ('*' == op.start[0]) {
-        emit(c, OpMul);
 
-    } else if ('/' == op.start[0]) {
-        emit(c, OpDiv);
-
-    } else if ('<' == op.start[0]) {
-        emit(c, OpLessThan);
+    positions.data[end] = positions.data[ins->length] =
+        c->cur_instructions->length;
+    if (ins->data[end] == OpReturn) {
+        emit(c, OpNothing);
+    }
 
-    } else if ('>' == op.start[0]) {
-        emit(c, OpGreaterThan);
+    // global variables would keep the arguments and local variables alive
+    // for the rest of the Program.
+    if (set == OpSetGlobal) {
+        for (int i = 0; i < fn->num_locals; i++) {
+            emit(c, OpNothing);
+            emit(c, OpSetGlobal, base + i);
+        }
+    }
 
-    } else if (!strncmp("==", op.start, 2)) {
-        emit(c, OpEqual);
+    for (int i = 0; i < jumps.length; i += 2) {
+        change_operand(c, jumps.data[i], positions.data[jumps.data[i + 1]]);
+    }
 
-    } else if (!strncmp("!=", op.start, 2)) {
-        emit(c, OpNotEqual);
+    // the InlineFrames of [fn] are numbered after its own.
+    InlineFrameBuffer *frames = &c->cur_scope->function->inline_frames;
+    InlineFrameBufferPush(frames, (InlineFrame){ fn, call, 0 });
+    int frame = frames->length;
+    for (int i = 0; i < fn->inline_frames.length; i++) {
+        InlineFrame inlined = fn->inline_frames.data[i];
+        inlined.caller += frame;
+        InlineFrameBufferPush(frames, inlined);
+    }
 
-    } else {
-        die("compiler: unknown infix operator %.*s", LITERAL(op));
+    for (int i = 0; i < fn->mappings.length; i++) {
+        SourceMapping mapping = fn->mappings.data[i];
+        mapping.position = positions.data[mapping.position];
+        mapping.inlined += frame;
+        SourceMappingBufferPush(c->cur_mappings, mapping);
     }
+
+    free(positions.data);
+    free(jumps.data);
 }
 
-static int get_builtin(Token *tok) {
-    int len;
-    const Builtin *builtin = get_builtins(&len);
-    for (int i = 0; i < len; i++) {
-        if (tok->length == builtin[i].name_len
-                && strncmp(builtin[i].name, tok->start, tok->length) == 0) {
-            return i;
-        }
+// Emit the jump over the code run when [condition], which was just compiled,
+// is truthy, with a bogus position.  A comparison is replaced by the jump
+// which compares, see OpJumpNotEqual, so that its Boolean is never pushed.
+static int
+emit_jump_unless(Compiler *c, Node condition) {
+    Opcode last = untyped(c->cur_scope->last_instruction.opcode);
+    if (condition.typ == n_InfixExpression
+            && last >= OpEqual && last <= OpGreaterThan) {
+        c->cur_instructions->length = c->cur_scope->last_instruction.position;
+        c->cur_scope->last_instruction = c->cur_scope->previous_instruction;
+        return emit(c, OpJumpNotEqual + (last - OpEqual), 9999);
     }
-    return -1;
+    return emit(c, OpJumpNotTruthy, 9999);
 }
 
 static error
@@ -231,11 +1783,27 @@ _compile(Compiler *c, Node n) {
         case n_BlockStatement:
             {
                 BlockStatement* bs = n.obj;
-                for (int i = 0; i < bs->stmts.length; i++) {
-                    err = _compile(c, bs->stmts.data[i]);
-                    if (err) { return err; }
+                ++c->cur_scope->block_depth;
+
+                int i = 0;
+                err = 0;
+                while (!err && i < bs->stmts.length) {
+                    Node stmt = bs->stmts.data[i++];
+                    err = _compile(c, stmt);
+
+                    if (stmt.typ == n_ReturnStatement
+                            || stmt.typ == n_BreakStatement
+                            || stmt.typ == n_ContinueStatement) {
+                        break;
+                    }
                 }
-                return 0;
+                for (; !err && i < bs->stmts.length; i++) {
+                    err = compile_unreachable(c, bs->stmts.data[i]);
+                }
+
+                // [c.cur_scope] is moved if a function is compiled.
+                --c->cur_scope->block_depth;
+                return err;
             }
 
         case n_ExpressionStatement:
@@ -269,6 +1837,23 @@ _compile(Compiler *c, Node n) {
                     Symbol *symbol =
                         sym_define(c->cur_symbol_table, &id->tok, hash(id));
 
+                    // a function literal without free variables, always
+                    // bound when the rest of the function runs.
+                    symbol->function = NULL;
+                    if (c->cur_scope->block_depth == 0
+                            && value.typ == n_FunctionLiteral
+                            && last_instruction_is(c, OpClosure)) {
+                        uint8_t *closure = c->cur_instructions->data
+                            + c->cur_scope->last_instruction.position;
+                        Constant constant = c->constants.data[
+                            read_big_endian_uint24(closure + 1)];
+
+                        if (read_big_endian_uint24(closure + 4) == 0
+                                && inlinable(constant.data.function)) {
+                            symbol->function = constant.data.function;
+                        }
+                    }
+
                     if (symbol->scope == GlobalScope) {
                         emit(c, OpSetGlobal, symbol->index);
                     } else {
@@ -326,14 +1911,32 @@ _compile(Compiler *c, Node n) {
 
                 int before_condition_pos = c->cur_instructions->length;
 
-                if (ls->condition.obj != NULL) {
+                // A constant condition is not checked, if it is false the
+                // body and update are never run.
+                Object condition = OBJ_BOOL(true);
+                int jump_not_truthy_pos = -1;
+                if (ls->condition.obj != NULL
+                        && !fold(ls->condition, &condition)) {
                     err = _compile(c, ls->condition);
                     if (err) { return err; }
-                } else {
-                    emit(c, OpTrue);
+
+                    jump_not_truthy_pos = emit_jump_unless(c, ls->condition);
                 }
+                free_folded(condition);
+
+                if (jump_not_truthy_pos == -1 && !is_truthy(condition)) {
+                    err = compile_unreachable(c,
+                            NODE(n_BlockStatement, ls->body));
+                    if (err) { return err; }
+
+                    err = compile_unreachable(c, ls->update);
+                    if (err) { return err; }
 
-                int jump_not_truthy_pos = emit(c, OpJumpNotTruthy, 9999);
+                    c->cur_scope->loop = loop.parent;
+                    free(loop.continues.data);
+                    free(loop.breaks.data);
+                    return 0;
+                }
 
                 err = _compile(c, NODE(n_BlockStatement, ls->body));
                 if (err) { return err; }
@@ -346,7 +1949,9 @@ _compile(Compiler *c, Node n) {
                 emit(c, OpJump, before_condition_pos);
 
                 int after_loop_pos = c->cur_instructions->length;
-                change_operand(c, jump_not_truthy_pos, after_loop_pos);
+                if (jump_not_truthy_pos != -1) {
+                    change_operand(c, jump_not_truthy_pos, after_loop_pos);
+                }
 
                 c->cur_scope->loop = loop.parent;
                 for (int i = 0; i < loop.continues.length; ++i) {
@@ -428,7 +2033,9 @@ _compile(Compiler *c, Node n) {
                 if (err) { return err; }
 
                 source_map(c, n);
-                compile_operator(c, stmt->op);
+                compile_operator(c, stmt->op,
+                                 expression_type(c, NULL, stmt->left),
+                                 expression_type(c, NULL, stmt->right));
 
                 source_map(c, n);
                 err = perform_assignment(c, stmt->left);
@@ -439,6 +2046,11 @@ _compile(Compiler *c, Node n) {
 
         case n_InfixExpression:
             {
+                Object value;
+                if (fold(n, &value)) {
+                    return emit_folded(c, n, value);
+                }
+
                 InfixExpression *ie = n.obj;
 
                 err = _compile(c, ie->left);
@@ -448,13 +2060,20 @@ _compile(Compiler *c, Node n) {
                 if (err) { return err; }
 
                 source_map(c, n);
-                compile_operator(c, ie->op);
+                compile_operator(c, ie->op,
+                                 expression_type(c, NULL, ie->left),
+                                 expression_type(c, NULL, ie->right));
 
                 return 0;
             }
 
         case n_PrefixExpression:
             {
+                Object value;
+                if (fold(n, &value)) {
+                    return emit_folded(c, n, value);
+                }
+
                 PrefixExpression *pe = n.obj;
                 err = _compile(c, pe->right);
                 if (err) { return err; }
@@ -486,11 +2105,47 @@ _compile(Compiler *c, Node n) {
                 // ...
 
                 IfExpression *ie = n.obj;
+
+                // only the branch taken on a constant condition is emitted.
+                Object condition;
+                if (fold(ie->condition, &condition)) {
+                    bool truthy = is_truthy(condition);
+                    free_folded(condition);
+
+                    BlockStatement *taken = ie->consequence;
+                    if (truthy) {
+                        err = _compile(c, NODE(n_BlockStatement, taken));
+                        if (err) { return err; }
+
+                        if (ie->alternative) {
+                            err = compile_unreachable(c,
+                                    NODE(n_BlockStatement, ie->alternative));
+                            if (err) { return err; }
+                        }
+                    } else {
+                        err = compile_unreachable(c,
+                                NODE(n_BlockStatement, ie->consequence));
+                        if (err) { return err; }
+
+                        taken = ie->alternative;
+                        if (taken) {
+                            err = _compile(c, NODE(n_BlockStatement, taken));
+                            if (err) { return err; }
+                        }
+                    }
+
+                    if (taken) {
+                        remove_last_expression_stmt_pop(c, taken->stmts);
+                    } else {
+                        emit(c, OpNothing);
+                    }
+                    return 0;
+                }
+
                 err = _compile(c, ie->condition);
                 if (err) { return err; }
 
-                // Emit an `OpJumpNotTruthy` with a bogus value
-                int jump_not_truthy_pos = emit(c, OpJumpNotTruthy, 9999);
+                int jump_not_truthy_pos = emit_jump_unless(c, ie->condition);
 
                 err = _compile(c, NODE(n_BlockStatement, ie->consequence));
                 if (err) { return err; }
@@ -523,12 +2178,33 @@ _compile(Compiler *c, Node n) {
                 err = _compile(c, ie->left);
                 if (err) { return err; }
 
+                FieldCacheBuffer *caches =
+                    &c->cur_scope->function->field_caches;
+                if (ie->index.typ == n_StringLiteral
+                        && caches->length <= MaxOperand) {
+                    int idx = add_string_constant(c, ie->index.obj);
+                    if (idx == -1) {
+                        return c_error(ie->index, add_constant_err);
+                    }
+
+                    source_map(c, n);
+
+                    FieldCacheBufferPush(caches, (FieldCache){0});
+                    emit(c, OpGetField, idx, caches->length - 1);
+                    return 0;
+                }
+
                 err = _compile(c, ie->index);
                 if (err) { return err; }
 
                 source_map(c, n);
 
-                emit(c, OpIndex);
+                if (expression_type(c, NULL, ie->left) == ty_Array
+                        && expression_type(c, NULL, ie->index) == ty_Integer) {
+                    emit(c, OpArrayIndex);
+                } else {
+                    emit(c, OpIndex);
+                }
                 return 0;
             }
 
@@ -542,12 +2218,28 @@ _compile(Compiler *c, Node n) {
                     if (err) { return err; }
                 }
 
+                CompiledFunction *inlined = inlined_function(c, ce);
+                if (inlined) {
+                    source_map(c, n);
+                    inline_call(c, inlined, n);
+
+                    // for the instructions after the call.
+                    source_map(c, n);
+                    return 0;
+                }
+
                 err = _compile(c, ce->function);
                 if (err) { return err; }
 
+                CallCacheBuffer *caches = &c->cur_scope->function->call_caches;
+                if (caches->length > MaxOperand) {
+                    return c_error(n, "too many function calls in one function");
+                }
+
                 source_map(c, n);
 
-                emit(c, OpCall, args.length);
+                CallCacheBufferPush(caches, (CallCache){0});
+                emit(c, OpCall, args.length, caches->length - 1);
                 return 0;
             }
 
@@ -641,12 +2333,7 @@ _compile(Compiler *c, Node n) {
 
         case n_StringLiteral:
             {
-                StringLiteral *sl = n.obj;
-                Constant str_const = {
-                    .type = c_String,
-                    .data = { .string = &sl->tok }
-                };
-                int idx = add_constant(c, str_const);
+                int idx = add_string_constant(c, n.obj);
                 if (idx == -1) { return c_error(n, add_constant_err); }
 
                 emit(c, OpConstant, idx);
@@ -659,6 +2346,7 @@ _compile(Compiler *c, Node n) {
                 FunctionLiteral *fl = n.obj;
 
                 enter_scope(c);
+                c->cur_scope->block_depth = -1; // see n_BlockStatement
 
                 if (fl->name) {
                     sym_function_name(c->cur_symbol_table, &fl->name->tok,
@@ -670,6 +2358,8 @@ _compile(Compiler *c, Node n) {
                     cur = fl->params.data[i];
                     sym_define(c->cur_symbol_table, &cur->tok, hash(cur));
                 }
+                c->cur_symbol_table->types =
+                    infer_types(c, fl->body->stmts, 0, &fl->params);
 
                 err = _compile(c, NODE(n_BlockStatement, fl->body));
                 if (err) { return err; }
@@ -679,10 +2369,18 @@ _compile(Compiler *c, Node n) {
                 } else {
                     append_return_if_not_present(c);
                 }
+                char *limit = exceeded_limit(c);
+                if (limit) { return c_error(n, limit); }
 
                 CompiledFunction *fn = c->cur_scope->function;
-                fn->num_locals = c->cur_symbol_table->num_definitions;
                 fn->num_parameters = fl->params.length;
+
+                mark_tail_calls(c);
+                optimize(c);
+
+                fn->max_stack = max_stack_depth(c->cur_instructions);
+                fn->words = encode_instructions(c->cur_instructions);
+                fn->num_locals = c->cur_symbol_table->num_definitions;
                 fn->literal = fl;
 
                 SymbolTable *function_symbol_table = c->cur_symbol_table;
@@ -759,7 +2457,13 @@ perform_assignment(Compiler *c, Node node) {
         error err = _compile(c, node);
         if (err) { return err; }
 
-        replace_last_opcode_with(c, OpIndex, OpSetIndex);
+        if (last_instruction_is(c, OpGetField)) {
+            replace_last_opcode_with(c, OpGetField, OpSetField);
+        } else if (last_instruction_is(c, OpArrayIndex)) {
+            replace_last_opcode_with(c, OpArrayIndex, OpSetIndex);
+        } else {
+            replace_last_opcode_with(c, OpIndex, OpSetIndex);
+        }
         return 0;
     }
 
@@ -813,6 +2517,24 @@ error compile(Compiler *c, Program *prog, int from) {
         enter_scope(c);
     }
 
+    if (c->reassigned) { ht_destroy(c->reassigned); }
+    c->reassigned = ht_create();
+    ht *defined = ht_create();
+    if (c->reassigned == NULL || defined == NULL) {
+        die("compile - create hash tables:");
+    }
+    for (int i = from; i < prog->stmts.length; i++) {
+        scan_assignments(prog->stmts.data[i], defined, c->reassigned);
+    }
+    ht_destroy(defined);
+
+    // later statements, in the REPL, can assign to any global variable.
+    if (!c->incremental) {
+        SymbolTable *st = c->cur_symbol_table;
+        if (st->types) { ht_destroy(st->types); }
+        st->types = infer_types(c, prog->stmts, from, NULL);
+    }
+
     error err;
     for (int i = from; i < prog->stmts.length; i++) {
         err = _compile(c, prog->stmts.data[i]);
@@ -823,6 +2545,16 @@ error compile(Compiler *c, Program *prog, int from) {
     if (c->scopes.length > 1) {
         append_return_if_not_present(c);
     }
+
+    char *limit = exceeded_limit(c);
+    if (limit) { return errorf("%s", limit); }
+
+    optimize(c);
+
+    CompiledFunction *main_function = c->cur_scope->function;
+    main_function->max_stack = max_stack_depth(c->cur_instructions);
+    free(main_function->words);
+    main_function->words = encode_instructions(c->cur_instructions);
     return 0;
 }
 
@@ -853,18 +2585,40 @@ c_error(Node n, char* format, ...) {
     return err;
 }
 
+static CharBuffer *
+copy_string_key(CharBuffer *str) {
+    CharBuffer *copy = malloc(sizeof(CharBuffer));
+    if (copy == NULL) { die("add_constant - copy string:"); }
+
+    *copy = (CharBuffer){
+        .data = malloc(str->length + 1),
+        .length = str->length,
+        .capacity = str->length,
+        .hash = str->hash,
+    };
+    if (copy->data == NULL) { die("add_constant - copy string:"); }
+    memcpy(copy->data, str->data, str->length);
+    return copy;
+}
+
 int add_constant(Compiler *c, Constant constant) {
     long position;
-    uint64_t hash;
+    Object key;
+    CharBuffer str;
 
     switch (constant.type) {
         case c_String:
-            hash = hash_string_fnv1a(constant.data.string->start,
-                                     constant.data.string->length);
+            str = (CharBuffer){
+                .data = (char *) constant.data.string->start,
+                .length = constant.data.string->length,
+            };
+            key = OBJ(o_String, .string = &str);
             break;
         case c_Integer:
+            key = OBJ(o_Integer, .integer = constant.data.integer);
+            break;
         case c_Float:
-            hash = constant.data.integer;
+            key = OBJ(o_Float, .floating = constant.data.floating);
             break;
         case c_Function:
             position = c->constants.length;
@@ -874,25 +2628,35 @@ int add_constant(Compiler *c, Constant constant) {
             die("add_constant - constant type not handled %d", constant.type);
     }
 
-    // initialize constants table if not done already
-    if (c->constants_table.buckets == NULL) {
-        compiler_init(c);
-    }
-
-    Object key = { .type = (ObjectType) constant.type };
+    uint64_t hash = object_hash(key);
     Object res = table_get_hash(&c->constants_table, key, hash);
     if (res.type == o_Nothing) {
         position = c->constants.length;
         ConstantBufferPush(&c->constants, constant);
 
-        table_set_hash(&c->constants_table, key, OBJ(o_Integer, position), hash);
-        if (errno == ENOMEM) { die("add_constant - table_set_hash:"); }
+        // the key must outlive [constant.data.string], see compiler_free().
+        if (key.type == o_String) {
+            key.data.string = copy_string_key(&str);
+        }
+
+        res = table_set_hash(&c->constants_table, key,
+                             OBJ(o_Integer, position), hash);
+        if (res.type == o_Nothing) { die("add_constant - table_set_hash:"); }
     } else {
         position = res.data.integer;
     }
 
-    if (position <= INT_MAX) {
+    if (position <= MaxOperand) {
         return position;
     }
     return -1;
 }
+
+static int
+add_string_constant(Compiler *c, StringLiteral *sl) {
+    Constant str_const = {
+        .type = c_String,
+        .data = { .string = &sl->tok }
+    };
+    return add_constant(c, str_const);
+}
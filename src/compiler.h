@@ -28,6 +28,23 @@ typedef struct {
     // Shared amongst all compilations.
     ConstantBuffer constants;
     Table constants_table; // Used to check for duplicate constants
+
+    // Tokens of the String constants created by constant folding, which are
+    // not in the source code.
+    Buffer folded_strings;
+
+    // Functions compiled in unreachable code, whose constants were removed,
+    // see compile_unreachable().
+    Buffer discarded_functions;
+
+    // Hashes of the names assigned to, or defined more than once, in the
+    // Program under compilation, calls to them are not inlined.
+    ht *reassigned;
+
+    // Whether the Program is compiled a few statements at a time, as in the
+    // REPL, where later statements can assign to any variable, so no calls
+    // are inlined.
+    bool incremental;
 } Compiler;
 
 // initialize constants table, is not necessary to be called.
@@ -70,6 +87,10 @@ typedef struct CompilationScope {
 
     EmittedInstruction last_instruction;
     EmittedInstruction previous_instruction;
+
+    // Number of nested Block Statements being compiled, 0 in the body of the
+    // function.
+    int block_depth;
 } CompilationScope;
 
 // Enter new CompilationScope, creating new CompiledFunction and SymbolTable.
@@ -88,3 +109,16 @@ typedef struct {
 
 // Retrieve the result of `compile(..)`.
 Bytecode bytecode(Compiler *c);
+
+// Fill the empty [depths] with the number of Objects on the stack, above the
+// local variables, before each instruction in [ins] and at its end: the same
+// on every path to it, and -1 at positions that are not the start of a
+// reachable instruction.  Return the maximum number while running [ins].
+int stack_depths(Instructions *ins, IntBuffer *depths);
+
+// Fill the empty [targets] and [entries] with whether the instruction at each
+// position in [ins], or its end, is the target of a jump, and an entry: where
+// vm_run() continues in the function after a call, a return or an iteration
+// of a loop.  [depths] are the stack_depths() of [ins].
+void jump_targets(Instructions *ins, IntBuffer *depths, IntBuffer *targets,
+                  IntBuffer *entries);
@@ -0,0 +1,699 @@
+#include "jit.h"
+#include "code.h"
+#include "object.h"
+#include "registers.h"
+#include "utils.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The machine code of a function is called with the System V calling
+// convention as:
+//
+//     void native(VM *vm, Frame *frame, Object *globals, uint8_t *entry);
+//
+// it saves the callee-saved registers it uses and jumps to [entry], the
+// machine code of the instruction to continue at.  While it runs:
+//
+// - rbx: [vm]
+// - r12: [frame]
+// - r13: the local variables, `vm.stack + frame.base_pointer`
+// - r14: the top of the stack, `vm.stack + vm.sp`
+// - r15: [globals]
+//
+// rax, rcx, rdx, xmm0 and xmm1 are scratch registers.
+typedef void (*NativeFunction)(VM *, Frame *, Object *, uint8_t *);
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+enum {
+    XMM0 = 0, XMM1 = 1,
+};
+
+// Condition codes of jcc and setcc.
+enum {
+    CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB,
+    CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+};
+
+_Static_assert(sizeof(Object) == 16, "Objects are addressed with shifts by 4");
+
+#define TYPE(i) ((i) * (int)sizeof(Object) + (int)offsetof(Object, type))
+#define DATA(i) ((i) * (int)sizeof(Object) + (int)offsetof(Object, data))
+
+BUFFER(Byte, uint8_t)
+DEFINE_BUFFER(Byte, uint8_t)
+
+typedef struct {
+    ByteBuffer code;
+
+    // Offset of the machine code of each instruction, -1 if there is no
+    // instruction at that position.
+    IntBuffer entries;
+
+    // Offset of the machine code which exits before each instruction, -1
+    // if not yet emitted.
+    IntBuffer exits;
+
+    // Pairs of offsets of rel32 operands and the position of the instruction
+    // they jump to, or exit at.
+    IntBuffer jumps;
+    IntBuffer exit_jumps;
+
+    // Index of the word of each position, see word_positions().
+    int *positions;
+
+    int epilogue;
+} Assembler;
+
+static void
+emit8(Assembler *a, uint8_t byte) {
+    ByteBufferPush(&a->code, byte);
+}
+
+static void
+emit32(Assembler *a, int32_t n) {
+    uint32_t u = n;
+    for (int i = 0; i < 4; i++) {
+        emit8(a, u >> (8 * i));
+    }
+}
+
+static void
+patch32(Assembler *a, int at, int32_t n) {
+    uint32_t u = n;
+    for (int i = 0; i < 4; i++) {
+        a->code.data[at + i] = u >> (8 * i);
+    }
+}
+
+// Emit [opcode] (1 or 2 bytes) with a register operand [reg] and a memory
+// operand `[base + disp]`.  [prefix] is a mandatory prefix, 0 if none.
+static void
+emit_mem(Assembler *a, uint8_t prefix, bool wide, int opcode, int reg,
+         int base, int32_t disp) {
+    if (prefix) { emit8(a, prefix); }
+
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+    if (rex != 0x40) { emit8(a, rex); }
+
+    if (opcode > 0xff) { emit8(a, opcode >> 8); }
+    emit8(a, opcode);
+
+    // mod 10: disp32, rsp and r12 as base need a SIB byte.
+    emit8(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) { emit8(a, 0x24); }
+    emit32(a, disp);
+}
+
+// Emit 64-bit [opcode] with register operands [reg] and [rm].
+static void
+emit_reg(Assembler *a, uint8_t prefix, int opcode, int reg, int rm) {
+    if (prefix) { emit8(a, prefix); }
+    emit8(a, 0x48 | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0));
+    if (opcode > 0xff) { emit8(a, opcode >> 8); }
+    emit8(a, opcode);
+    emit8(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// mov reg, [base + disp]
+static void
+load(Assembler *a, int reg, int base, int disp) {
+    emit_mem(a, 0, true, 0x8b, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void
+store(Assembler *a, int base, int disp, int reg) {
+    emit_mem(a, 0, true, 0x89, reg, base, disp);
+}
+
+// mov qword [base + disp], imm32
+static void
+store_imm(Assembler *a, int base, int disp, int32_t imm) {
+    emit_mem(a, 0, true, 0xc7, 0, base, disp);
+    emit32(a, imm);
+}
+
+// mov byte [base + disp], imm8
+static void
+store_byte(Assembler *a, int base, int disp, uint8_t imm) {
+    emit_mem(a, 0, false, 0xc6, 0, base, disp);
+    emit8(a, imm);
+}
+
+// cmp byte [base + disp], imm8
+static void
+cmp_byte(Assembler *a, int base, int disp, uint8_t imm) {
+    emit_mem(a, 0, false, 0x80, 7, base, disp);
+    emit8(a, imm);
+}
+
+// lea reg, [reg + disp], which does not change the flags.
+static void
+adjust(Assembler *a, int reg, int disp) {
+    emit_mem(a, 0, true, 0x8d, reg, reg, disp);
+}
+
+// Copy the Object at `[src + src_disp]` to `[dst + dst_disp]`.
+static void
+copy_object(Assembler *a, int dst, int dst_disp, int src, int src_disp) {
+    load(a, RAX, src, src_disp);
+    load(a, RDX, src, src_disp + 8);
+    store(a, dst, dst_disp, RAX);
+    store(a, dst, dst_disp + 8, RDX);
+}
+
+// Emit a jump with a rel32 operand, and return the offset of the operand.
+static int
+jump(Assembler *a, int cc) {
+    if (cc == -1) {
+        emit8(a, 0xe9);
+    } else {
+        emit8(a, 0x0f);
+        emit8(a, 0x80 | cc);
+    }
+    emit32(a, 0);
+    return a->code.length - 4;
+}
+
+// Point the jump with the operand at [at] to the next instruction emitted.
+static void
+land(Assembler *a, int at) {
+    patch32(a, at, a->code.length - (at + 4));
+}
+
+// Jump to the machine code of the instruction at [pos].
+static void
+jump_to(Assembler *a, int cc, int pos) {
+    IntBufferPush(&a->jumps, jump(a, cc));
+    IntBufferPush(&a->jumps, pos);
+}
+
+// Exit the machine code before the instruction at [pos].
+static void
+exit_at(Assembler *a, int cc, int pos) {
+    IntBufferPush(&a->exit_jumps, jump(a, cc));
+    IntBufferPush(&a->exit_jumps, pos);
+}
+
+// setcc al; movzx eax, al
+static void
+set_bool(Assembler *a, int cc) {
+    emit8(a, 0x0f); emit8(a, 0x90 | cc); emit8(a, 0xc0);
+    emit8(a, 0x0f); emit8(a, 0xb6); emit8(a, 0xc0);
+}
+
+// Store the Boolean in eax in place of the two Objects on top of the stack.
+static void
+push_bool_result(Assembler *a) {
+    store_byte(a, R14, TYPE(-2), o_Boolean);
+    store(a, R14, DATA(-2), RAX);
+    adjust(a, R14, -16);
+}
+
+// Exit at [pos] unless both Objects on top of the stack have type [t].
+static void
+check_types(Assembler *a, ObjectType t, int pos) {
+    cmp_byte(a, R14, TYPE(-2), t);
+    exit_at(a, CC_NE, pos);
+    cmp_byte(a, R14, TYPE(-1), t);
+    exit_at(a, CC_NE, pos);
+}
+
+// OpAdd to OpDiv of two Integers on top of the stack, [pos] is the position
+// of the instruction.
+static void
+integer_operation(Assembler *a, Opcode op, int pos) {
+    load(a, RAX, R14, DATA(-2));
+    load(a, RCX, R14, DATA(-1));
+    switch (op) {
+        case OpAdd:
+            emit_reg(a, 0, 0x01, RCX, RAX); // add rax, rcx
+            exit_at(a, CC_O, pos);
+            break;
+        case OpSub:
+            emit_reg(a, 0, 0x29, RCX, RAX); // sub rax, rcx
+            exit_at(a, CC_O, pos);
+            break;
+        case OpMul:
+            emit_reg(a, 0, 0x0faf, RAX, RCX); // imul rax, rcx
+            exit_at(a, CC_O, pos);
+            break;
+        case OpDiv:
+            // division by zero, and `LONG_MIN / -1` which traps.
+            emit_reg(a, 0, 0x85, RCX, RCX); // test rcx, rcx
+            exit_at(a, CC_E, pos);
+            emit_reg(a, 0, 0x83, 7, RCX); // cmp rcx, -1
+            emit8(a, 0xff);
+            exit_at(a, CC_E, pos);
+            emit8(a, 0x48); emit8(a, 0x99); // cqo
+            emit_reg(a, 0, 0xf7, 7, RCX); // idiv rcx
+            break;
+        default:
+            die("integer_operation: %s", lookup(op)->name);
+    }
+    store(a, R14, DATA(-2), RAX);
+    adjust(a, R14, -16);
+}
+
+// OpEqual to OpGreaterThan of two Integers on top of the stack.
+static void
+integer_comparison(Assembler *a, Opcode op) {
+    static const int cc[] = { CC_E, CC_NE, CC_L, CC_G };
+    load(a, RAX, R14, DATA(-2));
+    load(a, RCX, R14, DATA(-1));
+    emit_reg(a, 0, 0x39, RCX, RAX); // cmp rax, rcx
+    set_bool(a, cc[op - OpEqual]);
+    push_bool_result(a);
+}
+
+// OpAdd to OpDiv of two Floats on top of the stack.
+static void
+float_operation(Assembler *a, Opcode op, int pos) {
+    static const int opcodes[] = { 0x0f58, 0x0f5c, 0x0f59, 0x0f5e };
+    if (op == OpDiv) {
+        // see execute_binary_float_operation().
+        load(a, RAX, R14, DATA(-1));
+        emit_reg(a, 0, 0x85, RAX, RAX); // test rax, rax
+        exit_at(a, CC_E, pos);
+    }
+    emit_mem(a, 0xf2, false, 0x0f10, XMM0, R14, DATA(-2)); // movsd
+    emit_mem(a, 0xf2, false, opcodes[op - OpAdd], XMM0, R14, DATA(-1));
+    emit_mem(a, 0xf2, false, 0x0f11, XMM0, R14, DATA(-2)); // movsd
+    adjust(a, R14, -16);
+}
+
+// OpEqual to OpGreaterThan of two Floats on top of the stack, false if
+// either is NaN except for OpNotEqual, like in C.
+static void
+float_comparison(Assembler *a, Opcode op) {
+    emit_mem(a, 0xf2, false, 0x0f10, XMM0, R14, DATA(-2)); // movsd
+    emit_mem(a, 0xf2, false, 0x0f10, XMM1, R14, DATA(-1)); // movsd
+
+    // ucomisd sets PF if either is NaN.
+    switch (op) {
+        case OpEqual:
+        case OpNotEqual:
+            emit8(a, 0x66); emit8(a, 0x0f); emit8(a, 0x2e); emit8(a, 0xc1);
+            emit8(a, 0x0f); emit8(a, 0x90 | (op == OpEqual ? CC_E : CC_NE));
+            emit8(a, 0xc0); // setcc al
+            emit8(a, 0x0f); emit8(a, 0x90 | (op == OpEqual ? CC_NP : CC_P));
+            emit8(a, 0xc1); // setcc cl
+            // and al, cl or or al, cl
+            emit8(a, op == OpEqual ? 0x20 : 0x08); emit8(a, 0xc8);
+            emit8(a, 0x0f); emit8(a, 0xb6); emit8(a, 0xc0); // movzx eax, al
+            break;
+        case OpLessThan:
+            // ucomisd xmm1, xmm0
+            emit8(a, 0x66); emit8(a, 0x0f); emit8(a, 0x2e); emit8(a, 0xc8);
+            set_bool(a, CC_A);
+            break;
+        case OpGreaterThan:
+            // ucomisd xmm0, xmm1
+            emit8(a, 0x66); emit8(a, 0x0f); emit8(a, 0x2e); emit8(a, 0xc1);
+            set_bool(a, CC_A);
+            break;
+        default:
+            die("float_comparison: %s", lookup(op)->name);
+    }
+    push_bool_result(a);
+}
+
+// The Opcode from OpAdd to OpGreaterThan of quickened or typed [op], or 0.
+static Opcode
+generic(Opcode op) {
+    if (op >= OpAdd && op <= OpGreaterThan) {
+        return op;
+    } else if (op >= OpAddInt && op <= OpGreaterThanInt) {
+        return OpAdd + (op - OpAddInt);
+    } else if (op >= OpAddFloat && op <= OpGreaterThanFloat) {
+        return OpAdd + (op - OpAddFloat);
+    } else if (op >= OpIAdd && op <= OpIGreaterThan) {
+        return OpAdd + (op - OpIAdd);
+    } else if (op >= OpFAdd && op <= OpFGreaterThan) {
+        return OpAdd + (op - OpFAdd);
+    }
+    return 0;
+}
+
+// A binary operation [op] on the two Objects on top of the stack.
+static void
+binary_operation(Assembler *a, Opcode op, int pos) {
+    Opcode g = generic(op);
+    bool comparison = g >= OpEqual;
+
+    if (op >= OpIAdd && op <= OpIGreaterThan) {
+        comparison ? integer_comparison(a, g) : integer_operation(a, g, pos);
+        return;
+
+    } else if (op >= OpFAdd && op <= OpFGreaterThan) {
+        comparison ? float_comparison(a, g) : float_operation(a, g, pos);
+        return;
+    }
+
+    // Integers, Floats, or exit.
+    int not_integer[2], done;
+    cmp_byte(a, R14, TYPE(-2), o_Integer);
+    not_integer[0] = jump(a, CC_NE);
+    cmp_byte(a, R14, TYPE(-1), o_Integer);
+    not_integer[1] = jump(a, CC_NE);
+    comparison ? integer_comparison(a, g) : integer_operation(a, g, pos);
+    done = jump(a, -1);
+
+    land(a, not_integer[0]);
+    land(a, not_integer[1]);
+    check_types(a, o_Float, pos);
+    comparison ? float_comparison(a, g) : float_operation(a, g, pos);
+    land(a, done);
+}
+
+// Emit the machine code of the instruction at [pos] of [ins].
+static void
+compile_instruction(Assembler *a, Instructions *ins, int pos) {
+    Opcode op = ins->data[pos];
+    uint8_t *operands = ins->data + pos + 1;
+    int i, k;
+
+    switch (op) {
+        case OpConstant:
+            k = read_big_endian_uint24(operands);
+            load(a, RCX, RBX, offsetof(VM, constants));
+            copy_object(a, R14, 0, RCX, k * sizeof(Object));
+            adjust(a, R14, 16);
+            break;
+
+        case OpPop:
+            adjust(a, R14, -16);
+            break;
+
+        case OpTrue:
+        case OpFalse:
+        case OpNothing:
+            store_byte(a, R14, TYPE(0), op == OpNothing ? o_Nothing : o_Boolean);
+            store_imm(a, R14, DATA(0), op == OpTrue);
+            adjust(a, R14, 16);
+            break;
+
+        case OpGetLocal:
+            i = read_big_endian_uint24(operands);
+            copy_object(a, R14, 0, R13, i * sizeof(Object));
+            adjust(a, R14, 16);
+            break;
+
+        case OpGetLocal2:
+            i = read_big_endian_uint24(operands);
+            k = read_big_endian_uint24(operands + 3);
+            copy_object(a, R14, 0, R13, i * sizeof(Object));
+            copy_object(a, R14, 16, R13, k * sizeof(Object));
+            adjust(a, R14, 32);
+            break;
+
+        case OpSetLocal:
+            i = read_big_endian_uint24(operands);
+            adjust(a, R14, -16);
+            copy_object(a, R13, i * sizeof(Object), R14, 0);
+            break;
+
+        case OpGetGlobal:
+            i = read_big_endian_uint24(operands);
+            copy_object(a, R14, 0, R15, i * sizeof(Object));
+            adjust(a, R14, 16);
+            break;
+
+        case OpSetGlobal:
+            i = read_big_endian_uint24(operands);
+            adjust(a, R14, -16);
+            copy_object(a, R15, i * sizeof(Object), R14, 0);
+            break;
+
+        case OpJump:
+            jump_to(a, -1, read_big_endian_uint24(operands));
+            break;
+
+        case OpJumpNotTruthy:
+            {
+                // Booleans and Nothing, see is_truthy().
+                int not_boolean, truthy;
+                cmp_byte(a, R14, TYPE(-1), o_Boolean);
+                not_boolean = jump(a, CC_NE);
+                adjust(a, R14, -16);
+                cmp_byte(a, R14, DATA(0), 0);
+                jump_to(a, CC_E, read_big_endian_uint24(operands));
+                truthy = jump(a, -1);
+
+                land(a, not_boolean);
+                cmp_byte(a, R14, TYPE(-1), o_Nothing);
+                exit_at(a, CC_NE, pos);
+                adjust(a, R14, -16);
+                jump_to(a, -1, read_big_endian_uint24(operands));
+                land(a, truthy);
+                break;
+            }
+
+        case OpJumpNotEqual:
+        case OpJumpEqual:
+        case OpJumpNotLessThan:
+        case OpJumpNotGreaterThan:
+            {
+                static const int cc[] = { CC_NE, CC_E, CC_GE, CC_LE };
+                check_types(a, o_Integer, pos);
+                load(a, RAX, R14, DATA(-2));
+                load(a, RCX, R14, DATA(-1));
+                adjust(a, R14, -32);
+                emit_reg(a, 0, 0x39, RCX, RAX); // cmp rax, rcx
+                jump_to(a, cc[op - OpJumpNotEqual],
+                        read_big_endian_uint24(operands));
+                break;
+            }
+
+        case OpIncrementLocal:
+            i = read_big_endian_uint24(operands) * sizeof(Object);
+            k = read_big_endian_uint24(operands + 3) * sizeof(Object);
+            load(a, RCX, RBX, offsetof(VM, constants));
+            cmp_byte(a, R13, i, o_Integer);
+            exit_at(a, CC_NE, pos);
+            cmp_byte(a, RCX, k, o_Integer);
+            exit_at(a, CC_NE, pos);
+            load(a, RAX, R13, i + 8);
+            load(a, RCX, RCX, k + 8);
+            emit_reg(a, 0, 0x01, RCX, RAX); // add rax, rcx
+            exit_at(a, CC_O, pos);
+            store(a, R13, i + 8, RAX);
+            break;
+
+        default:
+            if (generic(op)) {
+                binary_operation(a, op, pos);
+                break;
+            }
+            exit_at(a, -1, pos);
+    }
+}
+
+// Emit the exits, and point the jumps at the machine code of instructions.
+static void
+link_jumps(Assembler *a) {
+    // the exits jump to the epilogue, at position -1.
+    int num_exit_jumps = a->exit_jumps.length;
+    for (int i = 0; i < num_exit_jumps; i += 2) {
+        int pos = a->exit_jumps.data[i + 1];
+        if (a->exits.data[pos] == -1) {
+            a->exits.data[pos] = a->code.length;
+            // mov dword [r12 + ip], word - 1
+            emit_mem(a, 0, false, 0xc7, 0, R12, offsetof(Frame, ip));
+            emit32(a, a->positions[pos] - 1);
+            IntBufferPush(&a->exit_jumps, jump(a, -1));
+            IntBufferPush(&a->exit_jumps, -1);
+        }
+    }
+
+    for (int i = 0; i < a->exit_jumps.length; i += 2) {
+        int at = a->exit_jumps.data[i],
+            pos = a->exit_jumps.data[i + 1],
+            target = pos == -1 ? a->epilogue : a->exits.data[pos];
+        patch32(a, at, target - (at + 4));
+    }
+
+    for (int i = 0; i < a->jumps.length; i += 2) {
+        int at = a->jumps.data[i],
+            target = a->entries.data[a->jumps.data[i + 1]];
+        assert(target != -1);
+        patch32(a, at, target - (at + 4));
+    }
+}
+
+static void
+prologue(Assembler *a) {
+    static const uint8_t code[] = {
+        0x53,               // push rbx
+        0x41, 0x54,         // push r12
+        0x41, 0x55,         // push r13
+        0x41, 0x56,         // push r14
+        0x41, 0x57,         // push r15
+        0x48, 0x89, 0xfb,   // mov rbx, rdi
+        0x49, 0x89, 0xf4,   // mov r12, rsi
+        0x49, 0x89, 0xd7,   // mov r15, rdx
+    };
+    for (size_t i = 0; i < sizeof(code); i++) { emit8(a, code[i]); }
+
+    // r13 = vm.stack + frame.base_pointer * 16
+    emit_mem(a, 0, true, 0x63, RAX, R12, offsetof(Frame, base_pointer));
+    emit_reg(a, 0, 0xc1, 4, RAX); emit8(a, 4); // shl rax, 4
+    load(a, R13, RBX, offsetof(VM, stack));
+    emit_reg(a, 0, 0x01, RAX, R13); // add r13, rax
+
+    // r14 = vm.stack + vm.sp * 16
+    emit_mem(a, 0, true, 0x63, RAX, RBX, offsetof(VM, sp));
+    emit_reg(a, 0, 0xc1, 4, RAX); emit8(a, 4);
+    load(a, R14, RBX, offsetof(VM, stack));
+    emit_reg(a, 0, 0x01, RAX, R14); // add r14, rax
+
+    emit8(a, 0xff); emit8(a, 0xe1); // jmp rcx
+}
+
+static void
+epilogue(Assembler *a) {
+    a->epilogue = a->code.length;
+
+    // vm.sp = (r14 - vm.stack) / 16
+    emit_reg(a, 0, 0x89, R14, RAX); // mov rax, r14
+    emit_mem(a, 0, true, 0x2b, RAX, RBX, offsetof(VM, stack)); // sub
+    emit_reg(a, 0, 0xc1, 7, RAX); emit8(a, 4); // sar rax, 4
+    emit_mem(a, 0, false, 0x89, RAX, RBX, offsetof(VM, sp)); // mov eax
+
+    static const uint8_t code[] = {
+        0x41, 0x5f,         // pop r15
+        0x41, 0x5e,         // pop r14
+        0x41, 0x5d,         // pop r13
+        0x41, 0x5c,         // pop r12
+        0x5b,               // pop rbx
+        0xc3,               // ret
+    };
+    for (size_t i = 0; i < sizeof(code); i++) { emit8(a, code[i]); }
+}
+
+JitCode *jit_compile(CompiledFunction *fn) {
+    Instructions *ins = &fn->instructions;
+    Assembler a = { .positions = word_positions(ins) };
+    IntBufferFill(&a.entries, -1, ins->length + 1);
+    IntBufferFill(&a.exits, -1, ins->length + 1);
+
+    prologue(&a);
+    epilogue(&a);
+
+    int pos = 0;
+    for (; pos < ins->length; pos += instruction_width(ins->data[pos])) {
+        a.entries.data[pos] = a.code.length;
+        compile_instruction(&a, ins, pos);
+    }
+    // the OpHalt placed after the main function, see vm_run().
+    a.entries.data[pos] = a.code.length;
+    exit_at(&a, -1, pos);
+
+    link_jumps(&a);
+
+    JitCode *code = NULL;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (a.code.length + page - 1) / page * page;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { goto cleanup; }
+
+    memcpy(memory, a.code.data, a.code.length);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) == -1) {
+        munmap(memory, size);
+        goto cleanup;
+    }
+
+    // the entries are looked up by [Frame.ip], the index of a word.
+    IntBuffer entries;
+    IntBufferInit(&entries);
+    IntBufferFill(&entries, -1, a.positions[ins->length] + 1);
+    for (pos = 0; pos <= ins->length; pos++) {
+        if (a.entries.data[pos] != -1) {
+            entries.data[a.positions[pos]] = a.entries.data[pos];
+        }
+    }
+
+    code = malloc(sizeof(JitCode));
+    if (code == NULL) { die("jit_compile: malloc"); }
+    *code = (JitCode) {
+        .code = memory,
+        .size = size,
+        .entries = entries.data,
+    };
+
+cleanup:
+    free(a.code.data);
+    free(a.entries.data);
+    free(a.exits.data);
+    free(a.jumps.data);
+    free(a.exit_jumps.data);
+    free(a.positions);
+    return code;
+}
+
+void jit_run(VM *vm, JitCode *code, Frame *frame, Object *globals) {
+    if (code->function) {
+        code->function(vm, frame, globals);
+        return;
+    } else if (code->registers) {
+        register_run(vm, code->registers, frame, globals);
+        return;
+    }
+
+    int entry = code->entries[frame->ip + 1];
+    assert(entry != -1);
+
+    // ISO C does not allow converting a pointer to an object to a pointer to
+    // a function.
+    NativeFunction native;
+    memcpy(&native, &code->code, sizeof(native));
+    native(vm, frame, globals, code->code + entry);
+}
+
+void jit_free(JitCode *code) {
+    if (code) {
+        if (code->code) { munmap(code->code, code->size); }
+        register_free(code->registers);
+        free(code->entries);
+        free(code);
+    }
+}
+
+#else
+
+JitCode *jit_compile(CompiledFunction *fn) {
+    (void) fn;
+    return NULL;
+}
+
+void jit_run(VM *vm, JitCode *code, Frame *frame, Object *globals) {
+    if (code->function) {
+        code->function(vm, frame, globals);
+    } else {
+        register_run(vm, code->registers, frame, globals);
+    }
+}
+
+void jit_free(JitCode *code) {
+    if (code) {
+        register_free(code->registers);
+        free(code);
+    }
+}
+
+#endif
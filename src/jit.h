@@ -0,0 +1,61 @@
+#pragma once
+
+// This module contains a baseline JIT compiler, which translates the
+// Instructions of a hot CompiledFunction into x86-64 machine code, with one
+// template of machine code per Opcode, like the baseline compilers of V8 and
+// JavaScriptCore.
+//
+// The machine code keeps the operand stack in [VM.stack] and the Frame of the
+// function in [VM.frames], so the VM can stop running it after any
+// instruction and continue in vm_run().  Opcodes without a template, and the
+// slow paths of the ones with one (e.g. OpAdd of Strings or an integer
+// overflow), exit the machine code before the instruction, which vm_run()
+// then runs.  The machine code never allocates or calls a function, so the
+// garbage collector never runs while it does.
+
+#include "object.h"
+
+#include <stdbool.h>
+
+// When defined, vm_run() compiles a CompiledFunction to machine code once it
+// is called or loops [VM.jit_threshold] times, see vm_set_jit().  Defined by
+// default on x86-64 Linux, define NO_JIT to only use the interpreter.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+struct VM;
+struct Frame;
+struct RegisterCode;
+
+// A CompiledFunction compiled ahead of time to C, see aot.h, which runs like
+// jit_run().
+typedef void (*CFunction)(struct VM *vm, struct Frame *frame, Object *globals);
+
+typedef struct JitCode {
+    // executable memory, see mmap(2).  NULL if compiled to [function] or
+    // [registers].
+    uint8_t *code;
+    size_t size;
+
+    // Offset in [code] of the machine code of each instruction, indexed by the
+    // word it is encoded at, see encode_instructions(), and of the end.
+    int *entries;
+
+    CFunction function;
+
+    // register-based instructions, see registers.h.
+    struct RegisterCode *registers;
+} JitCode;
+
+// Compile [fn] to machine code, NULL if it could not be allocated.
+JitCode *jit_compile(CompiledFunction *fn);
+
+// Run [code] from the instruction after [frame.ip] until an instruction it
+// exits at, [frame.ip] is set right before it and [VM.sp] to the top of the
+// stack.  [globals] are the global variables of the current Module.  Runs
+// [code.function] or [code.registers] if set, also when JIT is not defined.
+void jit_run(struct VM *vm, JitCode *code, struct Frame *frame,
+             Object *globals);
+
+void jit_free(JitCode *code);
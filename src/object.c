@@ -2,6 +2,7 @@
 #include "ast.h"
 #include "builtin.h"
 #include "errors.h"
+#include "jit.h"
 #include "module.h"
 #include "table.h"
 #include "utils.h"
@@ -11,8 +12,21 @@
 #include <stdlib.h>
 #include <string.h>
 
-DEFINE_BUFFER(Object, Object)
-DEFINE_BUFFER(Char, char)
+DEFINE_BUFFER(FieldCache, FieldCache)
+DEFINE_BUFFER(CallCache, CallCache)
+
+void array_push(Array *arr, Object obj) {
+    if (arr->length >= arr->capacity) {
+        int capacity = power_of_2_ceil(arr->length + 1);
+        arr->types = realloc(arr->types, capacity * sizeof(ObjectType));
+        arr->data = realloc(arr->data, capacity * sizeof(ObjectData));
+        if (arr->types == NULL || arr->data == NULL) {
+            die("array_push:");
+        }
+        arr->capacity = capacity;
+    }
+    array_set(arr, arr->length++, obj);
+}
 
 static int _object_fprint(Object o, Buffer *print_stack, FILE* fp);
 
@@ -55,7 +69,7 @@ in_seen(void *cur, Buffer *seen) {
 }
 
 static int
-fprint_array(ObjectBuffer *array, Buffer *seen, FILE* fp) {
+fprint_array(Array *array, Buffer *seen, FILE* fp) {
     if (in_seen(array, seen)) {
         FPRINTF(fp, "[...]");
         return 0;
@@ -66,11 +80,11 @@ fprint_array(ObjectBuffer *array, Buffer *seen, FILE* fp) {
 
     int last = array->length - 1;
     for (int i = 0; i < last; i++) {
-        _object_fprint(array->data[i], seen, fp);
+        _object_fprint(array_get(array, i), seen, fp);
         FPRINTF(fp, ", ");
     }
     if (last >= 0) {
-        _object_fprint(array->data[last], seen, fp);
+        _object_fprint(array_get(array, last), seen, fp);
     }
 
     FPRINTF(fp, "]");
@@ -105,7 +119,10 @@ fprint_table(Table *tbl, Buffer *seen, FILE* fp) {
 }
 
 int fprint_closure(Closure *cl, FILE *fp) {
-    CompiledFunction *fn = cl->func;
+    return fprint_function(cl->func, fp);
+}
+
+int fprint_function(CompiledFunction *fn, FILE *fp) {
     if (fn == NULL || fn->literal == NULL) {
         FPRINTF(fp, "<main function>");
     } else if (fn->literal->name) {
@@ -218,19 +235,27 @@ Object object_eq(Object left, Object right) {
             return OBJ_BOOL(true);
 
         case o_String:
-            return OBJ_BOOL(strcmp(left.data.string->data, right.data.string->data) == 0);
+            {
+                CharBuffer *l = left.data.string, *r = right.data.string;
+                if (l == r) { return OBJ_BOOL(true); }
+                if (l->length != r->length
+                        || (l->hash && r->hash && l->hash != r->hash)) {
+                    return OBJ_BOOL(false);
+                }
+                return OBJ_BOOL(memcmp(l->data, r->data, l->length) == 0);
+            }
 
         case o_Array:
             {
-                ObjectBuffer* l_arr = left.data.array;
-                ObjectBuffer* r_arr = right.data.array;
+                Array* l_arr = left.data.array;
+                Array* r_arr = right.data.array;
                 if (l_arr->length != r_arr->length) {
                     return OBJ_BOOL(false);
                 }
 
                 Object eq;
                 for (int i = 0; i < l_arr->length; i++) {
-                    eq = object_eq(l_arr->data[i], r_arr->data[i]);
+                    eq = object_eq(array_get(l_arr, i), array_get(r_arr, i));
                     if (eq.type == o_Error) {
                         return eq;
 
@@ -251,7 +276,12 @@ Object object_eq(Object left, Object right) {
 void free_function(CompiledFunction *fn) {
     if (fn) {
         free(fn->instructions.data);
+        free(fn->words);
         free(fn->mappings.data);
+        free(fn->inline_frames.data);
+        free(fn->field_caches.data);
+        free(fn->call_caches.data);
+        jit_free(fn->jit);
         free(fn);
     }
 }
@@ -18,8 +18,11 @@
 #include "code.h"
 #include "errors.h"
 
+#include "utils.h"
+
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum __attribute__ ((__packed__)) {
     // Primitive data types:
@@ -39,12 +42,31 @@ typedef enum __attribute__ ((__packed__)) {
               // Only Present in ObjectType to be used in vm `Frame`.
 } ObjectType;
 
-struct Object;
 struct Table;
+struct Array;
 struct Closure;
 struct Builtin;
-BUFFER(Object, struct Object)
-BUFFER(Char, char)
+
+// A String.  The contents are written once when it is created, and never
+// modified after that, see string_hash().
+typedef struct {
+    char *data;
+    int length;
+    int capacity;
+
+    // FNV-1a hash of [data], computed by string_hash() on first use.  0 if not
+    // computed yet.
+    uint64_t hash;
+} CharBuffer;
+
+static inline uint64_t
+string_hash(CharBuffer *str) {
+    if (str->hash == 0) {
+        uint64_t hash = hash_string_fnv1a(str->data, str->length);
+        str->hash = hash ? hash : 1; // 0 is reserved.
+    }
+    return str->hash;
+}
 
 typedef union {
     long integer;
@@ -54,7 +76,7 @@ typedef union {
     error err;
 
     CharBuffer *string;
-    ObjectBuffer *array;
+    struct Array *array;
     struct Table *table;
     struct Closure *closure;
     struct Module *module;
@@ -72,6 +94,30 @@ typedef struct Object {
 #define OBJ_BOOL(b) OBJ(o_Boolean, .boolean = b)
 #define OBJ_NOTHING (Object){0}
 
+// An Array stores the `ObjectType` and `ObjectData` of its elements in
+// separate buffers, like `table_bucket`, to avoid the padding of `Object`.
+// An element takes 9 bytes instead of 16.
+typedef struct Array {
+    ObjectType *types;
+    ObjectData *data;
+    int length;
+    int capacity;
+} Array;
+
+// Get element at [i], [i] must be less than [arr.length].
+static inline Object array_get(Array *arr, int i) {
+    return (Object){ .type = arr->types[i], .data = arr->data[i] };
+}
+
+// Set element at [i], [i] must be less than [arr.length].
+static inline void array_set(Array *arr, int i, Object obj) {
+    arr->types[i] = obj.type;
+    arr->data[i] = obj.data;
+}
+
+// Append [obj] to [arr], growing its buffers if necessary.
+void array_push(Array *arr, Object obj);
+
 bool is_truthy(Object obj);
 Object object_eq(Object left, Object right);
 
@@ -80,17 +126,64 @@ int object_fprint(Object, FILE *);
 
 const char* show_object_type(ObjectType t);
 
-// A Compiled FunctionLiteral.
+struct Shape;
+
+// The inline cache of an OpGetField or OpSetField instruction: the Shape of
+// the last Table it accessed and the index of its key in that Shape.  [shape]
+// is NULL before the first access.
 typedef struct {
+    struct Shape *shape;
+    int index;
+} FieldCache;
+
+BUFFER(FieldCache, FieldCache)
+
+struct CompiledFunction;
+
+// The inline cache of an OpCall or OpTailCall instruction: the function of
+// the last Closure it called, whose number of parameters matched the number
+// of arguments.  [function] is NULL before the first call.
+typedef struct {
+    struct CompiledFunction *function;
+} CallCache;
+
+BUFFER(CallCache, CallCache)
+
+// A Compiled FunctionLiteral.
+typedef struct CompiledFunction {
     Instructions instructions;
+
+    // [instructions] encoded for vm_run() by the compiler, see
+    // encode_instructions().
+    uint32_t *words;
+
     int num_locals;
     int num_parameters;
 
+    // Maximum number of Objects pushed above the local variables while
+    // running [instructions], computed by the compiler.
+    int max_stack;
+
     // Where in the source code the function was defined.
     FunctionLiteral *literal;
 
     // [SourceMapping] for all statements in [literal.body].
     SourceMappingBuffer mappings;
+
+    // The calls inlined into [instructions], see [SourceMapping.inlined].
+    InlineFrameBuffer inline_frames;
+
+    // Indexed by the cache operand of OpGetField and OpSetField.  Shapes
+    // belong to the VM, so a CompiledFunction is only run by one VM.
+    FieldCacheBuffer field_caches;
+
+    // Indexed by the cache operand of OpCall and OpTailCall.
+    CallCacheBuffer call_caches;
+
+    // Number of calls and loop iterations counted by the VM, and the machine
+    // code it was compiled to once hot, see jit.h.
+    int hotness;
+    struct JitCode *jit;
 } CompiledFunction;
 
 void free_function(CompiledFunction *fn);
@@ -103,3 +196,6 @@ typedef struct Closure {
 } Closure;
 
 int fprint_closure(Closure *cl, FILE *fp);
+
+// fprint_closure() of a Closure of [fn].
+int fprint_function(CompiledFunction *fn, FILE *fp);
@@ -0,0 +1,683 @@
+#include "registers.h"
+#include "aot.h"
+#include "code.h"
+#include "compiler.h"
+#include "object.h"
+#include "utils.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+BUFFER(RegisterInstruction, RegisterInstruction)
+DEFINE_BUFFER(RegisterInstruction, RegisterInstruction)
+
+// An Object on the stack while translating.  It is only stored in its own
+// register once it has to be, until then it is in register [index], a local
+// variable, or constant [index].
+typedef struct {
+    bool constant;
+    int index;
+} Operand;
+
+BUFFER(Operand, Operand)
+DEFINE_BUFFER(Operand, Operand)
+
+// The slow path of the instruction at [instruction], which exits before the
+// instruction at [pos] with the [depth] Operands at [operands] in
+// [Translation.saved] on the stack.
+typedef struct {
+    int instruction, pos, depth, operands;
+} SlowPath;
+
+BUFFER(SlowPath, SlowPath)
+DEFINE_BUFFER(SlowPath, SlowPath)
+
+typedef struct {
+    CompiledFunction *fn;
+
+    // see stack_depths() and jump_targets().
+    IntBuffer depths;
+    IntBuffer targets;
+    IntBuffer entries;
+
+    RegisterInstructionBuffer code;
+
+    // Index in [code] of the instruction at each position, -1 if there is
+    // none.
+    IntBuffer labels;
+
+    // Pairs of indexes in [code] of jumps and the positions they jump to.
+    IntBuffer jumps;
+
+    // Index of the word of each position, see word_positions().
+    int *positions;
+
+    SlowPathBuffer slow_paths;
+    OperandBuffer saved;
+
+    // The Objects on the stack before the instruction being translated.
+    Operand *stack;
+    int depth;
+
+    // Whether an operand did not fit in a RegisterInstruction.
+    bool too_large;
+} Translation;
+
+static int
+add(Translation *t, RegisterOpcode op, int a, int b, int c) {
+    if (a > UINT16_MAX || b > UINT16_MAX || c > UINT16_MAX) {
+        t->too_large = true;
+    }
+    RegisterInstructionBufferPush(&t->code, (RegisterInstruction){
+        .op = op, .a = a, .b = b, .c = c,
+    });
+    return t->code.length - 1;
+}
+
+// The register of the Object at [depth] on the stack.
+static int
+slot(Translation *t, int depth) {
+    return t->fn->num_locals + depth;
+}
+
+static void
+push(Translation *t, bool constant, int index) {
+    t->stack[t->depth++] = (Operand){ .constant = constant, .index = index };
+}
+
+// Store the Object at [depth] on the stack in its own register.
+static void
+materialize(Translation *t, int depth) {
+    Operand o = t->stack[depth];
+    int reg = slot(t, depth);
+    if (o.constant) {
+        add(t, r_LoadConstant, reg, o.index, 0);
+    } else if (o.index != reg) {
+        add(t, r_Move, reg, o.index, 0);
+    }
+    t->stack[depth] = (Operand){ .index = reg };
+}
+
+// Store the Objects below [depth] on the stack in their own registers, as
+// vm_run() and the targets of jumps expect them.
+static void
+flush(Translation *t, int depth) {
+    for (int i = 0; i < depth; i++) {
+        materialize(t, i);
+    }
+}
+
+// Store the Objects below [depth] which are local variable [local] before it
+// is assigned to.
+static void
+protect(Translation *t, int local, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (!t->stack[i].constant && t->stack[i].index == local) {
+            materialize(t, i);
+        }
+    }
+}
+
+// The register of the Object at [depth] on the stack.
+static int
+reg(Translation *t, int depth) {
+    if (t->stack[depth].constant) {
+        materialize(t, depth);
+    }
+    return t->stack[depth].index;
+}
+
+// Exit before the instruction at [pos] when [instruction] takes its slow
+// path, with the stack before it.
+static void
+slow_path(Translation *t, int instruction, int pos) {
+    SlowPathBufferPush(&t->slow_paths, (SlowPath){
+        .instruction = instruction,
+        .pos = pos,
+        .depth = t->depth,
+        .operands = t->saved.length,
+    });
+    for (int i = 0; i < t->depth; i++) {
+        OperandBufferPush(&t->saved, t->stack[i]);
+    }
+}
+
+static void
+jump(Translation *t, int instruction, int target) {
+    IntBufferPush(&t->jumps, instruction);
+    IntBufferPush(&t->jumps, target);
+}
+
+// The register to store the result of the instruction at [pos] in, which
+// replaces the Objects from [depth] on the stack: the local variable it is
+// assigned to if the next instruction is an OpSetLocal, which is then
+// skipped, and its own register otherwise.
+static int
+destination(Translation *t, int pos, int depth, int *skip) {
+    Instructions *ins = &t->fn->instructions;
+    int next = pos + instruction_width(ins->data[pos]);
+    if (next < ins->length && ins->data[next] == OpSetLocal
+            && !t->targets.data[next] && !t->entries.data[next]) {
+        int local = read_big_endian_uint24(ins->data + next + 1);
+        protect(t, local, depth);
+        *skip = instruction_width(OpSetLocal);
+        return local;
+    }
+    return slot(t, depth);
+}
+
+// The Opcode from OpAdd to OpGreaterThan of quickened or typed [op], 0 if it
+// is not one.
+static Opcode
+binary_operation(Opcode op) {
+    if (op >= OpAdd && op <= OpGreaterThan) {
+        return op;
+    } else if (op >= OpAddInt && op <= OpGreaterThanInt) {
+        return OpAdd + (op - OpAddInt);
+    } else if (op >= OpAddFloat && op <= OpGreaterThanFloat) {
+        return OpAdd + (op - OpAddFloat);
+    } else if (op >= OpIAdd && op <= OpIGreaterThan) {
+        return OpAdd + (op - OpIAdd);
+    } else if (op >= OpFAdd && op <= OpFGreaterThan) {
+        return OpAdd + (op - OpFAdd);
+    }
+    return 0;
+}
+
+// Translate the instruction at [pos], return the number of bytes of
+// Instructions after it which it replaced.  False in [*falls_through] if the
+// next instruction does not run after it.
+static int
+translate(Translation *t, int pos, bool *falls_through) {
+    Instructions *ins = &t->fn->instructions;
+    Opcode op = ins->data[pos];
+    uint8_t *operands = ins->data + pos + 1;
+    int d = t->depth, skip = 0, dst, i, local;
+    Opcode generic;
+
+    switch (op) {
+        case OpConstant:
+            push(t, true, read_big_endian_uint24(operands));
+            break;
+
+        case OpPop:
+            // see vm_last_popped().
+            if (pos + 1 == ins->length) {
+                materialize(t, d - 1);
+            }
+            t->depth--;
+            break;
+
+        case OpTrue:
+        case OpFalse:
+        case OpNothing:
+            add(t, op == OpTrue ? r_LoadTrue
+                   : op == OpFalse ? r_LoadFalse : r_LoadNothing,
+                slot(t, d), 0, 0);
+            push(t, false, slot(t, d));
+            break;
+
+        case OpGetLocal:
+            push(t, false, read_big_endian_uint24(operands));
+            break;
+        case OpGetLocal2:
+            push(t, false, read_big_endian_uint24(operands));
+            push(t, false, read_big_endian_uint24(operands + 3));
+            break;
+        case OpSetLocal:
+            local = read_big_endian_uint24(operands);
+            protect(t, local, d - 1);
+            if (t->stack[d - 1].constant) {
+                add(t, r_LoadConstant, local, t->stack[d - 1].index, 0);
+            } else if (t->stack[d - 1].index != local) {
+                add(t, r_Move, local, t->stack[d - 1].index, 0);
+            }
+            t->depth--;
+            break;
+
+        case OpIncrementLocal:
+            local = read_big_endian_uint24(operands);
+            protect(t, local, d);
+            i = add(t, r_AddConstant, local, local,
+                    read_big_endian_uint24(operands + 3));
+            slow_path(t, i, pos);
+            break;
+
+        case OpGetGlobal:
+            add(t, r_GetGlobal, slot(t, d), read_big_endian_uint24(operands),
+                0);
+            push(t, false, slot(t, d));
+            break;
+        case OpSetGlobal:
+            add(t, r_SetGlobal, reg(t, d - 1),
+                read_big_endian_uint24(operands), 0);
+            t->depth--;
+            break;
+
+        case OpGetFree:
+            add(t, r_GetFree, slot(t, d), read_big_endian_uint24(operands),
+                0);
+            push(t, false, slot(t, d));
+            break;
+        case OpCurrentClosure:
+            add(t, r_CurrentClosure, slot(t, d), 0, 0);
+            push(t, false, slot(t, d));
+            break;
+
+        case OpMinus:
+            reg(t, d - 1);
+            dst = destination(t, pos, d - 1, &skip);
+            i = add(t, r_Minus, dst, t->stack[d - 1].index, 0);
+            slow_path(t, i, pos);
+            t->depth--;
+            if (!skip) { push(t, false, dst); }
+            break;
+        case OpBang:
+            reg(t, d - 1);
+            dst = destination(t, pos, d - 1, &skip);
+            add(t, r_Bang, dst, t->stack[d - 1].index, 0);
+            t->depth--;
+            if (!skip) { push(t, false, dst); }
+            break;
+
+        case OpArrayIndex:
+            reg(t, d - 2);
+            reg(t, d - 1);
+            dst = destination(t, pos, d - 2, &skip);
+            add(t, r_ArrayIndex, dst, t->stack[d - 2].index,
+                t->stack[d - 1].index);
+            t->depth -= 2;
+            if (!skip) { push(t, false, dst); }
+            break;
+
+        case OpJump:
+            flush(t, t->depth);
+            jump(t, add(t, r_Jump, 0, 0, 0), read_big_endian_uint24(operands));
+            *falls_through = false;
+            break;
+        case OpJumpNotTruthy:
+            reg(t, d - 1);
+            flush(t, d - 1);
+            t->depth--;
+            jump(t, add(t, r_JumpNotTruthy, 0, t->stack[d - 1].index, 0),
+                 read_big_endian_uint24(operands));
+            break;
+
+        case OpJumpNotEqual:
+        case OpJumpEqual:
+        case OpJumpNotLessThan:
+        case OpJumpNotGreaterThan:
+            reg(t, d - 2);
+            flush(t, d - 2);
+            i = add(t, (t->stack[d - 1].constant ? r_JumpNotEqualConstant
+                                                 : r_JumpNotEqual)
+                       + (op - OpJumpNotEqual),
+                    0, t->stack[d - 2].index, t->stack[d - 1].index);
+            jump(t, i, read_big_endian_uint24(operands));
+            slow_path(t, i, pos);
+            t->depth -= 2;
+            break;
+
+        default:
+            generic = binary_operation(op);
+            if (generic) {
+                reg(t, d - 2);
+                dst = destination(t, pos, d - 2, &skip);
+                i = add(t, (t->stack[d - 1].constant ? r_AddConstant : r_Add)
+                           + (generic - OpAdd),
+                        dst, t->stack[d - 2].index, t->stack[d - 1].index);
+                slow_path(t, i, pos);
+                t->depth -= 2;
+                if (!skip) { push(t, false, dst); }
+                break;
+            }
+
+            // calls, returns and anything that allocates.
+            flush(t, t->depth);
+            add(t, r_Exit, t->positions[pos], slot(t, d), 0);
+            *falls_through = false;
+    }
+    return skip;
+}
+
+JitCode *register_compile(CompiledFunction *fn) {
+    Instructions *ins = &fn->instructions;
+    Translation t = { .fn = fn, .positions = word_positions(ins) };
+
+    IntBufferInit(&t.depths);
+    int max = stack_depths(ins, &t.depths);
+    IntBufferInit(&t.targets);
+    IntBufferInit(&t.entries);
+    jump_targets(ins, &t.depths, &t.targets, &t.entries);
+    IntBufferInit(&t.labels);
+    IntBufferFill(&t.labels, -1, ins->length + 1);
+
+    t.stack = malloc((max + 1) * sizeof(Operand));
+    if (t.stack == NULL) { die("register_compile: malloc"); }
+
+    bool falls_through = false;
+    for (int pos = 0, next; pos <= ins->length; pos = next) {
+        next = pos + (pos < ins->length ? instruction_width(ins->data[pos]) : 1);
+        if (t.depths.data[pos] == -1) { continue; }
+
+        if (t.targets.data[pos] || t.entries.data[pos] || !falls_through) {
+            if (falls_through) { flush(&t, t.depth); }
+            t.depth = t.depths.data[pos];
+            for (int i = 0; i < t.depth; i++) {
+                t.stack[i] = (Operand){ .index = slot(&t, i) };
+            }
+        }
+        assert(t.depth == t.depths.data[pos]);
+        t.labels.data[pos] = t.code.length;
+
+        falls_through = true;
+        if (pos == ins->length) {
+            flush(&t, t.depth);
+            add(&t, r_Exit, t.positions[pos], slot(&t, t.depth), 0);
+            break;
+        }
+        next += translate(&t, pos, &falls_through);
+    }
+
+    for (int i = 0; i < t.jumps.length; i += 2) {
+        int label = t.labels.data[t.jumps.data[i + 1]];
+        assert(label != -1);
+        if (label > UINT16_MAX) { t.too_large = true; }
+        t.code.data[t.jumps.data[i]].a = label;
+    }
+
+    int *slow_paths = malloc((t.code.length + 1) * sizeof(int));
+    if (slow_paths == NULL) { die("register_compile: malloc"); }
+    for (int i = 0; i < t.slow_paths.length; i++) {
+        SlowPath *path = t.slow_paths.data + i;
+        slow_paths[path->instruction] = t.code.length;
+
+        t.depth = path->depth;
+        for (int j = 0; j < t.depth; j++) {
+            t.stack[j] = t.saved.data[path->operands + j];
+        }
+        flush(&t, t.depth);
+        add(&t, r_Exit, t.positions[path->pos], slot(&t, t.depth), 0);
+    }
+
+    // the entries are looked up by [Frame.ip], the index of a word.
+    IntBuffer entries;
+    IntBufferInit(&entries);
+    IntBufferFill(&entries, -1, t.positions[ins->length] + 1);
+    for (int pos = 0; pos <= ins->length; pos++) {
+        if (t.entries.data[pos]) {
+            entries.data[t.positions[pos]] = t.labels.data[pos];
+        }
+    }
+
+    free(t.depths.data);
+    free(t.targets.data);
+    free(t.entries.data);
+    free(t.labels.data);
+    free(t.positions);
+    free(t.jumps.data);
+    free(t.slow_paths.data);
+    free(t.saved.data);
+    free(t.stack);
+
+    if (t.too_large) {
+        free(t.code.data);
+        free(entries.data);
+        free(slow_paths);
+        return NULL;
+    }
+
+    RegisterCode *registers = malloc(sizeof(RegisterCode));
+    JitCode *code = calloc(1, sizeof(JitCode));
+    if (registers == NULL || code == NULL) {
+        die("register_compile: malloc");
+    }
+    *registers = (RegisterCode){
+        .instructions = t.code.data,
+        .length = t.code.length,
+        .entries = entries.data,
+        .slow_paths = slow_paths,
+    };
+    code->registers = registers;
+    return code;
+}
+
+// labels as values are a GNU extension.
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+void register_run(VM *vm, RegisterCode *code, Frame *frame, Object *globals) {
+    int entry = code->entries[frame->ip + 1];
+    if (entry == -1) { return; }
+
+    Object *r = vm->stack + frame->base_pointer,
+           *k = vm->constants,
+           obj;
+    RegisterInstruction *ip = code->instructions + entry, *cur;
+
+#ifdef COMPUTED_GOTO
+    // Address of the handler of each RegisterOpcode.
+    static void *dispatch_table[] = {
+        NULL, // RegisterOpcodes start at 1
+        &&op_r_Move,
+        &&op_r_LoadConstant,
+        &&op_r_LoadTrue,
+        &&op_r_LoadFalse,
+        &&op_r_LoadNothing,
+        &&op_r_GetGlobal,
+        &&op_r_SetGlobal,
+        &&op_r_GetFree,
+        &&op_r_CurrentClosure,
+        &&op_r_Add,
+        &&op_r_Sub,
+        &&op_r_Mul,
+        &&op_r_Div,
+        &&op_r_Equal,
+        &&op_r_NotEqual,
+        &&op_r_LessThan,
+        &&op_r_GreaterThan,
+        &&op_r_AddConstant,
+        &&op_r_SubConstant,
+        &&op_r_MulConstant,
+        &&op_r_DivConstant,
+        &&op_r_EqualConstant,
+        &&op_r_NotEqualConstant,
+        &&op_r_LessThanConstant,
+        &&op_r_GreaterThanConstant,
+        &&op_r_Minus,
+        &&op_r_Bang,
+        &&op_r_ArrayIndex,
+        &&op_r_Jump,
+        &&op_r_JumpNotTruthy,
+        &&op_r_JumpNotEqual,
+        &&op_r_JumpEqual,
+        &&op_r_JumpNotLessThan,
+        &&op_r_JumpNotGreaterThan,
+        &&op_r_JumpNotEqualConstant,
+        &&op_r_JumpEqualConstant,
+        &&op_r_JumpNotLessThanConstant,
+        &&op_r_JumpNotGreaterThanConstant,
+        &&op_r_Exit,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) op_##name
+#define DISPATCH()                                                            \
+    do {                                                                      \
+        cur = ip++;                                                           \
+        goto *dispatch_table[cur->op];                                        \
+    } while (0)
+
+#else
+#define INTERPRET_LOOP                                                        \
+    loop:                                                                     \
+        cur = ip++;                                                           \
+        switch ((RegisterOpcode) cur->op)
+#define CASE_CODE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+#define SLOW_PATH()                                                           \
+    do {                                                                      \
+        ip = code->instructions                                               \
+            + code->slow_paths[cur - code->instructions];                     \
+        DISPATCH();                                                           \
+    } while (0)
+
+// R(a) = R(b) [op] [right], see aot_binary_operation().
+#define BINARY(op, right)                                                     \
+    do {                                                                      \
+        obj = r[cur->b];                                                      \
+        if (!aot_binary_operation(op, &obj, &(right))) { SLOW_PATH(); }       \
+        r[cur->a] = obj;                                                      \
+        DISPATCH();                                                           \
+    } while (0)
+
+// Jump to instruction a unless R(b) [op] [right].
+#define JUMP_UNLESS(op, right)                                                \
+    do {                                                                      \
+        obj = r[cur->b];                                                      \
+        if (!aot_binary_operation(op, &obj, &(right))) { SLOW_PATH(); }       \
+        if (!obj.data.boolean) { ip = code->instructions + cur->a; }          \
+        DISPATCH();                                                           \
+    } while (0)
+
+    INTERPRET_LOOP
+    {
+        CASE_CODE(r_Move):
+            r[cur->a] = r[cur->b];
+            DISPATCH();
+        CASE_CODE(r_LoadConstant):
+            r[cur->a] = k[cur->b];
+            DISPATCH();
+        CASE_CODE(r_LoadTrue):
+            r[cur->a] = OBJ_BOOL(true);
+            DISPATCH();
+        CASE_CODE(r_LoadFalse):
+            r[cur->a] = OBJ_BOOL(false);
+            DISPATCH();
+        CASE_CODE(r_LoadNothing):
+            r[cur->a] = OBJ_NOTHING;
+            DISPATCH();
+
+        CASE_CODE(r_GetGlobal):
+            r[cur->a] = globals[cur->b];
+            DISPATCH();
+        CASE_CODE(r_SetGlobal):
+            globals[cur->b] = r[cur->a];
+            DISPATCH();
+
+        CASE_CODE(r_GetFree):
+            r[cur->a] = frame->function.data.closure->free[cur->b];
+            DISPATCH();
+        CASE_CODE(r_CurrentClosure):
+            r[cur->a] = frame->function;
+            DISPATCH();
+
+        CASE_CODE(r_Add):
+            BINARY(OpAdd, r[cur->c]);
+        CASE_CODE(r_Sub):
+            BINARY(OpSub, r[cur->c]);
+        CASE_CODE(r_Mul):
+            BINARY(OpMul, r[cur->c]);
+        CASE_CODE(r_Div):
+            BINARY(OpDiv, r[cur->c]);
+        CASE_CODE(r_Equal):
+            BINARY(OpEqual, r[cur->c]);
+        CASE_CODE(r_NotEqual):
+            BINARY(OpNotEqual, r[cur->c]);
+        CASE_CODE(r_LessThan):
+            BINARY(OpLessThan, r[cur->c]);
+        CASE_CODE(r_GreaterThan):
+            BINARY(OpGreaterThan, r[cur->c]);
+
+        CASE_CODE(r_AddConstant):
+            BINARY(OpAdd, k[cur->c]);
+        CASE_CODE(r_SubConstant):
+            BINARY(OpSub, k[cur->c]);
+        CASE_CODE(r_MulConstant):
+            BINARY(OpMul, k[cur->c]);
+        CASE_CODE(r_DivConstant):
+            BINARY(OpDiv, k[cur->c]);
+        CASE_CODE(r_EqualConstant):
+            BINARY(OpEqual, k[cur->c]);
+        CASE_CODE(r_NotEqualConstant):
+            BINARY(OpNotEqual, k[cur->c]);
+        CASE_CODE(r_LessThanConstant):
+            BINARY(OpLessThan, k[cur->c]);
+        CASE_CODE(r_GreaterThanConstant):
+            BINARY(OpGreaterThan, k[cur->c]);
+
+        CASE_CODE(r_Minus):
+            obj = r[cur->b];
+            if (!aot_minus(&obj)) { SLOW_PATH(); }
+            r[cur->a] = obj;
+            DISPATCH();
+        CASE_CODE(r_Bang):
+            r[cur->a] = aot_bang(r[cur->b]);
+            DISPATCH();
+
+        CASE_CODE(r_ArrayIndex):
+            r[cur->a] = aot_array_index(r[cur->b], r[cur->c]);
+            DISPATCH();
+
+        CASE_CODE(r_Jump):
+            ip = code->instructions + cur->a;
+            DISPATCH();
+        CASE_CODE(r_JumpNotTruthy):
+            if (!aot_truthy(r[cur->b])) {
+                ip = code->instructions + cur->a;
+            }
+            DISPATCH();
+
+        CASE_CODE(r_JumpNotEqual):
+            JUMP_UNLESS(OpEqual, r[cur->c]);
+        CASE_CODE(r_JumpEqual):
+            JUMP_UNLESS(OpNotEqual, r[cur->c]);
+        CASE_CODE(r_JumpNotLessThan):
+            JUMP_UNLESS(OpLessThan, r[cur->c]);
+        CASE_CODE(r_JumpNotGreaterThan):
+            JUMP_UNLESS(OpGreaterThan, r[cur->c]);
+
+        CASE_CODE(r_JumpNotEqualConstant):
+            JUMP_UNLESS(OpEqual, k[cur->c]);
+        CASE_CODE(r_JumpEqualConstant):
+            JUMP_UNLESS(OpNotEqual, k[cur->c]);
+        CASE_CODE(r_JumpNotLessThanConstant):
+            JUMP_UNLESS(OpLessThan, k[cur->c]);
+        CASE_CODE(r_JumpNotGreaterThanConstant):
+            JUMP_UNLESS(OpGreaterThan, k[cur->c]);
+
+        CASE_CODE(r_Exit):
+            aot_exit(vm, frame, cur->a, r + cur->b);
+            return;
+
+#ifndef COMPUTED_GOTO
+        default:
+            die("register_run: unknown opcode %d", cur->op);
+#endif
+    }
+
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+#undef SLOW_PATH
+#undef BINARY
+#undef JUMP_UNLESS
+}
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+void register_free(RegisterCode *code) {
+    if (code) {
+        free(code->instructions);
+        free(code->entries);
+        free(code->slow_paths);
+        free(code);
+    }
+}
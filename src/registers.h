@@ -0,0 +1,135 @@
+#pragma once
+
+// This module contains a register-based virtual machine, which runs hot
+// CompiledFunctions in place of the JIT compiler, see vm_set_registers().
+//
+// The stack VM moves every operand through the top of [VM.stack]:
+// `res = fib(n - 1) + fib(n - 2)` pushes `n`, `1`, both results and the sum
+// before storing it.  The Instructions of a function are translated to
+// three-address instructions on registers, the local variables and Objects
+// on the stack of its Frame, whose positions are known before every
+// instruction, see stack_depths().  Local variables and constants are used
+// as operands where they are instead of being pushed, and results are
+// written straight to the local variable they are assigned to, so `i = i + n`
+// is one instruction instead of three.
+//
+// Like the machine code of the JIT, see jit.h, the registers are the stack of
+// the VM, and the register code exits to vm_run() before the instructions it
+// has no translation for (calls, returns and anything that allocates) and on
+// slow paths, with the stack as vm_run() left it.
+
+#include "jit.h"
+#include "object.h"
+
+#include <stdint.h>
+
+struct VM;
+struct Frame;
+
+// R(i) is register i of the Frame, `vm.stack[frame.base_pointer + i]`, and
+// K(i) the Object of constant i, see [VM.constants].
+typedef enum {
+    // r_Move <a> <b>: R(a) = R(b).
+    r_Move = 1,
+
+    // r_LoadConstant <a> <k>: R(a) = K(k).
+    r_LoadConstant,
+
+    // R(a) = true, false or nothing.
+    r_LoadTrue,
+    r_LoadFalse,
+    r_LoadNothing,
+
+    // r_GetGlobal <a> <i>: R(a) = the global variable i, and r_SetGlobal the
+    // other way around.
+    r_GetGlobal,
+    r_SetGlobal,
+
+    // r_GetFree <a> <i>: R(a) = the free variable i of the current Closure.
+    r_GetFree,
+
+    // r_CurrentClosure <a>: R(a) = the current Closure.
+    r_CurrentClosure,
+
+    // r_Add <a> <b> <c>: R(a) = R(b) + R(c), in the same order as OpAdd to
+    // OpGreaterThan.
+    r_Add,
+    r_Sub,
+    r_Mul,
+    r_Div,
+    r_Equal,
+    r_NotEqual,
+    r_LessThan,
+    r_GreaterThan,
+
+    // r_AddConstant <a> <b> <c>: R(a) = R(b) + K(c), in the same order as
+    // r_Add to r_GreaterThan.
+    r_AddConstant,
+    r_SubConstant,
+    r_MulConstant,
+    r_DivConstant,
+    r_EqualConstant,
+    r_NotEqualConstant,
+    r_LessThanConstant,
+    r_GreaterThanConstant,
+
+    // r_Minus <a> <b>: R(a) = -R(b), and r_Bang R(a) = !R(b).
+    r_Minus,
+    r_Bang,
+
+    // r_ArrayIndex <a> <b> <c>: R(a) = R(b)[R(c)], see OpArrayIndex.
+    r_ArrayIndex,
+
+    // r_Jump <a>: continue at instruction a.
+    r_Jump,
+
+    // r_JumpNotTruthy <a> <b>: jump to instruction a if R(b) is not truthy.
+    r_JumpNotTruthy,
+
+    // r_JumpNotEqual <a> <b> <c>: jump to instruction a unless R(b) == R(c),
+    // in the same order as OpJumpNotEqual to OpJumpNotGreaterThan.
+    r_JumpNotEqual,
+    r_JumpEqual,
+    r_JumpNotLessThan,
+    r_JumpNotGreaterThan,
+
+    // r_JumpNotEqualConstant <a> <b> <c>: r_JumpNotEqual with K(c).
+    r_JumpNotEqualConstant,
+    r_JumpEqualConstant,
+    r_JumpNotLessThanConstant,
+    r_JumpNotGreaterThanConstant,
+
+    // r_Exit <a> <b>: return to vm_run() before the instruction encoded at
+    // word a, see encode_instructions(), with b Objects in the Frame.
+    r_Exit,
+} RegisterOpcode;
+
+typedef struct {
+    uint8_t op;
+    uint16_t a, b, c;
+} RegisterInstruction;
+
+typedef struct RegisterCode {
+    RegisterInstruction *instructions;
+    int length;
+
+    // Index in [instructions] of each word of the encoded function, see
+    // encode_instructions(), and of its end, for those which are an entry,
+    // see jump_targets().  -1 for other words.
+    int *entries;
+
+    // Index in [instructions] of the slow path of each instruction with
+    // one, which stores the stack like vm_run() expects it and exits before
+    // the instruction it was translated from.
+    int *slow_paths;
+} RegisterCode;
+
+// Translate [fn] to register code, NULL if its registers, constants or
+// instructions do not fit in the operands.
+JitCode *register_compile(CompiledFunction *fn);
+
+// Run [code] like jit_run().
+void register_run(struct VM *vm, RegisterCode *code, struct Frame *frame,
+                  Object *globals);
+
+void register_free(RegisterCode *code);
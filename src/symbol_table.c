@@ -31,6 +31,7 @@ void symbol_table_free(SymbolTable *st) {
         free(it.current->value);
     }
     ht_destroy(st->store);
+    if (st->types) { ht_destroy(st->types); }
     free(st->free_symbols.data);
     free(st);
 }
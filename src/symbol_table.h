@@ -31,6 +31,10 @@ typedef struct {
 
     // The index into the local or global variable list.
     int index;
+
+    // The `CompiledFunction *` the variable is bound to if calls to it are
+    // inlined, see inline_call() in compiler.c.
+    void *function;
 } Symbol;
 
 typedef struct SymbolTable {
@@ -40,6 +44,10 @@ typedef struct SymbolTable {
     int num_definitions;
 
     Buffer free_symbols;
+
+    // Types of the variables proven by the Compiler, see infer_types() in
+    // compiler.c, or NULL.
+    ht *types;
 } SymbolTable;
 
 SymbolTable *symbol_table_new();
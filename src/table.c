@@ -5,6 +5,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes, full slots contain the low 7 bits of the (mixed) hash, see
+// [H2].
+#define CTRL_EMPTY   ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+
+// Bytes allocated per slot.
+#define SLOT_SIZE (sizeof(uint64_t) + 2 * sizeof(ObjectData) + sizeof(uint8_t) \
+                   + 2 * sizeof(ObjectType))
+
+#define NOT_FOUND SIZE_MAX
+
 bool hashable(Object key) {
     switch (key.type) {
         case o_String:
@@ -21,8 +36,7 @@ uint64_t object_hash(Object key) {
     switch (key.type) {
         case o_String:
             {
-                CharBuffer *str = key.data.string;
-                return hash_string_fnv1a(str->data, str->length);
+                return string_hash(key.data.string);
             }
 
         case o_Boolean:
@@ -30,7 +44,8 @@ uint64_t object_hash(Object key) {
         case o_Integer:
             return key.data.integer;
         case o_Float:
-            return key.data.floating;
+            // the bits of the float, see [table_key_eq].
+            return key.data.integer;
 
         default:
             die("object_hash: type %s (%d) not implemented",
@@ -38,170 +53,598 @@ uint64_t object_hash(Object key) {
     }
 }
 
-static inline uint64_t
-hash_index(uint64_t hash, size_t num_buckets) {
-    return (hash & (uint64_t)(num_buckets - 1));
+bool table_key_eq(Object a, Object b) {
+    if (a.type != b.type) { return false; }
+
+    switch (a.type) {
+        case o_String:
+            {
+                CharBuffer *l = a.data.string, *r = b.data.string;
+                return l == r
+                    || (l->length == r->length
+                        && string_hash(l) == string_hash(r)
+                        && memcmp(l->data, r->data, l->length) == 0);
+            }
+
+        case o_Boolean:
+            return a.data.boolean == b.data.boolean;
+
+        case o_Integer:
+        case o_Float:
+            return a.data.integer == b.data.integer;
+
+        default:
+            return memcmp(&a.data, &b.data, sizeof(ObjectData)) == 0;
+    }
 }
 
-void *table_init(Table *tbl) {
-    tbl->length = 0;
-    tbl->_buckets_length = N;
-    tbl->buckets = calloc(N, sizeof(table_bucket));
-    if (tbl->buckets == NULL) {
+Shape *shape_new_root(void) {
+    return calloc(1, sizeof(Shape));
+}
+
+void shape_free(Shape *root) {
+    for (int i = 0; i < root->num_transitions; i++) {
+        shape_free(root->transitions[i]);
+    }
+    free(root->transitions);
+    free(root);
+}
+
+int shape_index(Shape *shape, Object key) {
+    if (key.type != o_String) { return -1; }
+
+    for (int i = 0; i < shape->num_keys; i++) {
+        if (table_key_eq(OBJ(o_String, .string = shape->keys[i]), key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The child of [shape] with the additional String [key], which must not be
+// in [shape].
+// Returns NULL if [shape] has too many keys or transitions, or no memory.
+static Shape *
+shape_transition(Shape *shape, CharBuffer *key) {
+    int n = shape->num_keys;
+    for (int i = 0; i < shape->num_transitions; i++) {
+        Shape *child = shape->transitions[i];
+        if (table_key_eq(OBJ(o_String, .string = child->keys[n]),
+                         OBJ(o_String, .string = key))) {
+            return child;
+        }
+    }
+
+    if (n >= MAX_SHAPE_KEYS
+            || shape->num_transitions >= MAX_SHAPE_TRANSITIONS) {
         return NULL;
     }
-    return tbl;
+
+    Shape **transitions = realloc(shape->transitions,
+            (shape->num_transitions + 1) * sizeof(Shape *));
+    if (transitions == NULL) { return NULL; }
+    shape->transitions = transitions;
+
+    Shape *child = calloc(1, sizeof(Shape) + (n + 1) * sizeof(CharBuffer *));
+    if (child == NULL) { return NULL; }
+    memcpy(child->keys, shape->keys, n * sizeof(CharBuffer *));
+    child->keys[n] = key;
+    child->num_keys = n + 1;
+
+    transitions[shape->num_transitions++] = child;
+    return child;
 }
 
-static void
-destroy_overflows(table_bucket *bucket) {
-    if (bucket && bucket->overflow) {
-        destroy_overflows(bucket->overflow);
-        free(bucket->overflow);
+// Integer keys are their own hashes, mix the bits so that consecutive
+// integers are spread over all groups.  From the MurmurHash3 finalizer.
+static inline uint64_t
+mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+#define H1(mixed) ((mixed) >> 7)   // selects the first group to probe.
+#define H2(mixed) ((mixed) & 0x7f) // stored in the control byte.
+
+// Bitmask of the slots in the group at [ctrl] with control byte [byte].
+static inline uint32_t
+group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t) (ctrl[i] == byte) << i;
     }
+    return mask;
+#endif
 }
 
-void table_free(Table *tbl) {
-    for (size_t i = 0; i < tbl->_buckets_length; i++) {
-        destroy_overflows(tbl->buckets + i);
+// Bitmask of the empty or deleted slots in the group at [ctrl].
+static inline uint32_t
+group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (uint32_t) (ctrl[i] >> 7) << i;
     }
-    free(tbl->buckets);
-    tbl->buckets = NULL;
-    tbl->_buckets_length = 0;
+    return mask;
+#endif
 }
 
-static Object
-bucket_get_value(table_bucket *bucket, uint64_t hash, ObjectType type) {
-    while (bucket != NULL) {
-        for (size_t i = 0; i < N; i++) {
-            if (bucket->k_type[i] == o_Nothing) {
-                break;
+// Capacity of the first slots of a Table, doubled until [GROUP_SIZE].  Slots
+// with less capacity are small, and scanned linearly.
+#define SMALL_CAPACITY 4
+
+// Minimum capacity of the array part.
+#define ARRAY_MIN 4
+
+// Tables with fewer slots are resized at once.
+#define INCREMENTAL_CAPACITY 1024
+
+// Number of previous slots moved to the new slots per table operation.  Must
+// move all of them before the new slots fill up, see table_set_hash().
+#define MIGRATE_SLOTS (2 * GROUP_SIZE)
+
+void *table_init(Table *tbl) {
+    memset(tbl, 0, sizeof(Table));
+    return tbl;
+}
+
+void *table_init_shaped(Table *tbl, Shape *root) {
+    memset(tbl, 0, sizeof(Table));
+    tbl->_shape = root;
+    return tbl;
+}
+
+void table_free(Table *tbl) {
+    free(tbl->_slots.hashes);
+    free(tbl->_old.hashes);
+    free(tbl->_a_type);
+    free(tbl->_a_data);
+    free(tbl->_f_type);
+    free(tbl->_f_data);
+    memset(tbl, 0, sizeof(Table));
+}
+
+size_t table_memory(Table *tbl) {
+    return (tbl->_slots.capacity + tbl->_old.capacity) * SLOT_SIZE
+        + (tbl->_array_capacity + tbl->_f_capacity)
+            * (sizeof(ObjectType) + sizeof(ObjectData));
+}
+
+// Number of entries in the hash part.
+static inline size_t
+hash_length(Table *tbl) {
+    return tbl->length - tbl->_array_length;
+}
+
+// Allocate [slots] with [capacity] empty slots.
+// Returns false if no memory.
+static bool
+slots_alloc(table_slots *slots, size_t capacity) {
+    void *block = malloc(capacity * SLOT_SIZE);
+    if (block == NULL) { return false; }
+
+    slots->capacity = capacity;
+    slots->hashes = block;
+    slots->k_data = (ObjectData *) (slots->hashes + capacity);
+    slots->v_data = slots->k_data + capacity;
+    slots->ctrl = (uint8_t *) (slots->v_data + capacity);
+    slots->k_type = (ObjectType *) (slots->ctrl + capacity);
+    slots->v_type = slots->k_type + capacity;
+
+    memset(slots->ctrl, CTRL_EMPTY, capacity);
+    return true;
+}
+
+// Index of slot with [key], or [NOT_FOUND].
+static size_t
+find_slot(table_slots *slots, Object key, uint64_t hash) {
+    if (slots->capacity < GROUP_SIZE) {
+        for (size_t i = 0; i < slots->capacity; i++) {
+            if (slots->ctrl[i] & CTRL_EMPTY) { continue; }
+
+            Object cur = { slots->k_type[i], slots->k_data[i] };
+            if (slots->hashes[i] == hash && table_key_eq(cur, key)) {
+                return i;
             }
+        }
+        return NOT_FOUND;
+    }
 
-            if (bucket->hashes[i] == hash && bucket->k_type[i] == type) {
-                return (Object){ bucket->v_type[i], bucket->v_data[i] };
+    uint64_t mixed = mix(hash);
+    size_t mask = slots->capacity / GROUP_SIZE - 1,
+           group = H1(mixed) & mask;
+
+    // Triangular probing visits every group, the table is never full.
+    for (size_t stride = 1;; stride++) {
+        size_t base = group * GROUP_SIZE;
+        uint8_t *ctrl = slots->ctrl + base;
+
+        uint32_t match = group_match(ctrl, H2(mixed));
+        for (; match; match &= match - 1) {
+            size_t i = base + __builtin_ctz(match);
+            Object cur = { slots->k_type[i], slots->k_data[i] };
+            if (slots->hashes[i] == hash && table_key_eq(cur, key)) {
+                return i;
             }
         }
-        bucket = bucket->overflow;
+
+        if (group_match(ctrl, CTRL_EMPTY)) { return NOT_FOUND; }
+        group = (group + stride) & mask;
     }
-    return OBJ_NOTHING;
 }
 
-Object table_get_hash(Table *tbl, Object key, uint64_t hash) {
-    if (key.type == o_Nothing) return OBJ_NOTHING;
-    size_t index = hash_index(hash, tbl->_buckets_length);
-    return bucket_get_value(tbl->buckets + index, hash, key.type);
+// Index of the first empty or deleted slot in the probe sequence of [hash].
+static size_t
+find_free_slot(table_slots *slots, uint64_t hash) {
+    if (slots->capacity < GROUP_SIZE) {
+        size_t i = 0;
+        while (!(slots->ctrl[i] & CTRL_EMPTY)) { i++; }
+        return i;
+    }
+
+    size_t mask = slots->capacity / GROUP_SIZE - 1,
+           group = H1(mix(hash)) & mask;
+
+    for (size_t stride = 1;; stride++) {
+        size_t base = group * GROUP_SIZE;
+        uint32_t match = group_match_free(slots->ctrl + base);
+        if (match) {
+            return base + __builtin_ctz(match);
+        }
+        group = (group + stride) & mask;
+    }
 }
 
-Object table_get(Table *tbl, Object key) {
-    return table_get_hash(tbl, key, object_hash(key));
+// Insert [key], which is not in [tbl._slots].
+static void
+insert(Table *tbl, uint64_t hash, Object key, Object val) {
+    table_slots *slots = &tbl->_slots;
+    size_t i = find_free_slot(slots, hash);
+
+    if (slots->ctrl[i] == CTRL_DELETED) { tbl->_tombstones--; }
+    slots->ctrl[i] = H2(mix(hash));
+    slots->hashes[i] = hash;
+    slots->k_type[i] = key.type;
+    slots->k_data[i] = key.data;
+    slots->v_type[i] = val.type;
+    slots->v_data[i] = val.data;
 }
 
+// Move up to [num] entries of [tbl._old] to [tbl._slots], and free
+// [tbl._old] once all have been moved.
 static void
-_bucket_set(table_bucket *bucket, int i, Object key, Object val) {
-    bucket->k_type[i] = key.type;
-    bucket->k_data[i] = key.data;
-    bucket->v_type[i] = val.type;
-    bucket->v_data[i] = val.data;
+migrate(Table *tbl, size_t num) {
+    table_slots *old = &tbl->_old;
+    if (old->capacity == 0) { return; }
+
+    size_t end = old->capacity;
+    if (num < end - tbl->_migrated) { end = tbl->_migrated + num; }
+
+    for (size_t i = tbl->_migrated; i < end; i++) {
+        if (old->ctrl[i] & CTRL_EMPTY) { continue; } // empty or deleted
+
+        Object key = { old->k_type[i], old->k_data[i] },
+               val = { old->v_type[i], old->v_data[i] };
+        insert(tbl, old->hashes[i], key, val);
+
+        // so that it is not found in [_old] after it is removed from
+        // [_slots].
+        old->ctrl[i] = CTRL_DELETED;
+    }
+    tbl->_migrated = end;
+
+    if (end == old->capacity) {
+        free(old->hashes);
+        memset(old, 0, sizeof(table_slots));
+        tbl->_migrated = 0;
+    }
+}
+
+// Start moving all entries into new slots, doubling the capacity unless most
+// of the used slots are deleted.
+// Returns false if no memory.
+static bool
+table_resize(Table *tbl) {
+    // finish the previous resize.
+    migrate(tbl, SIZE_MAX);
+
+    size_t capacity = tbl->_slots.capacity;
+    if (capacity == 0) {
+        capacity = SMALL_CAPACITY;
+    } else if (capacity < GROUP_SIZE) {
+        capacity *= 2;
+    } else if (hash_length(tbl) >= capacity / 2 - capacity / 16) {
+        capacity *= 2;
+        if (capacity < tbl->_slots.capacity
+                || capacity > SIZE_MAX / SLOT_SIZE) { return false; }
+    }
+
+    table_slots new_slots;
+    if (!slots_alloc(&new_slots, capacity)) { return false; }
+
+    tbl->_old = tbl->_slots;
+    tbl->_migrated = 0;
+    tbl->_slots = new_slots;
+    tbl->_tombstones = 0;
+
+    if (tbl->_old.capacity < INCREMENTAL_CAPACITY) {
+        migrate(tbl, SIZE_MAX);
+    }
+    return true;
 }
 
 static Object
-bucket_set(Table *tbl, table_bucket *bucket, uint64_t hash, Object key,
-        Object val) {
-    for (size_t i = 0; i < N; i++) {
-        if (bucket->k_type[i] == o_Nothing) {
-            _bucket_set(bucket, i, key, val);
-            bucket->hashes[i] = hash;
-            tbl->length++;
-            return val;
+hash_get(Table *tbl, Object key, uint64_t hash) {
+    migrate(tbl, MIGRATE_SLOTS);
+
+    table_slots *slots = &tbl->_slots;
+    size_t i = find_slot(slots, key, hash);
+    if (i == NOT_FOUND) {
+        slots = &tbl->_old;
+        i = find_slot(slots, key, hash);
+        if (i == NOT_FOUND) { return OBJ_NOTHING; }
+    }
+    return (Object){ slots->v_type[i], slots->v_data[i] };
+}
 
-        } else if (bucket->hashes[i] == hash && bucket->k_type[i] == key.type) {
-            Object old_val = (Object){ bucket->v_type[i], bucket->v_data[i] };
-            bucket->v_type[i] = val.type;
-            bucket->v_data[i] = val.data;
-            return old_val;
+static Object
+hash_set(Table *tbl, Object key, Object value, uint64_t hash) {
+    migrate(tbl, MIGRATE_SLOTS);
+
+    table_slots *slots = &tbl->_slots;
+    size_t i = find_slot(slots, key, hash);
+    if (i == NOT_FOUND) {
+        slots = &tbl->_old;
+        i = find_slot(slots, key, hash);
+    }
+    if (i != NOT_FOUND) {
+        Object old_val = { slots->v_type[i], slots->v_data[i] };
+        slots->v_type[i] = value.type;
+        slots->v_data[i] = value.data;
+        return old_val;
+    }
+
+    // Keep at least 1/8 of the slots empty, so that probing for a missing
+    // key ends early.  [length] includes entries not yet migrated.
+    //
+    // A resize starts with at least 7/16 of the new slots free, and every
+    // call migrates [MIGRATE_SLOTS], so the migration is done long before
+    // the next resize.
+    size_t capacity = tbl->_slots.capacity,
+           used = hash_length(tbl) + tbl->_tombstones + 1;
+    if (capacity < GROUP_SIZE ? used > capacity
+                              : used > capacity - capacity / 8) {
+        if (!table_resize(tbl)) {
+            return OBJ_NOTHING;
         }
     }
 
-    if (bucket->overflow != NULL)
-        return bucket_set(tbl, bucket->overflow, hash, key, val);
-    else {
-        table_bucket *new_bucket = calloc(1, sizeof(table_bucket));
-        if (new_bucket == NULL) return OBJ_NOTHING;
-        _bucket_set(new_bucket, 0, key, val);
-        new_bucket->hashes[0] = hash;
-        tbl->length++;
-        bucket->overflow = new_bucket;
-        return val;
+    insert(tbl, hash, key, value);
+    tbl->length++;
+    return value;
+}
+
+static Object
+hash_remove(Table *tbl, Object key, uint64_t hash) {
+    migrate(tbl, MIGRATE_SLOTS);
+
+    size_t i = find_slot(&tbl->_slots, key, hash);
+    if (i == NOT_FOUND) {
+        // not yet migrated.
+        table_slots *old = &tbl->_old;
+        i = find_slot(old, key, hash);
+        if (i == NOT_FOUND) { return OBJ_NOTHING; }
+
+        old->ctrl[i] = CTRL_DELETED;
+        tbl->length--;
+        return (Object){ old->v_type[i], old->v_data[i] };
+    }
+
+    table_slots *slots = &tbl->_slots;
+    Object val = { slots->v_type[i], slots->v_data[i] };
+
+    // If the group has an empty slot, no probe for another key went past it,
+    // and the slot can be emptied.  Small slots are not probed.
+    uint8_t *group = slots->ctrl + (i & ~(size_t) (GROUP_SIZE - 1));
+    if (slots->capacity < GROUP_SIZE || group_match(group, CTRL_EMPTY)) {
+        slots->ctrl[i] = CTRL_EMPTY;
+    } else {
+        slots->ctrl[i] = CTRL_DELETED;
+        tbl->_tombstones++;
     }
+
+    tbl->length--;
+    return val;
 }
 
-// create new bucket list with double number of current buckets and
-// NOTE: immediately move all elements to new buckets.
-// Returns false if no memory or could not move.
+// Grow the array part to [capacity], and move the keys in the new range out
+// of the hash part.
+// Returns false if no memory.
 static bool
-table_expand(Table *tbl) {
-    size_t new_length = tbl->_buckets_length * 2;
-    if (new_length < tbl->_buckets_length) return false; // overflow
+array_grow(Table *tbl, size_t capacity) {
+    size_t old_capacity = tbl->_array_capacity;
+    if (capacity > SIZE_MAX / sizeof(ObjectData)) { return false; }
+
+    ObjectType *types = realloc(tbl->_a_type, capacity * sizeof(ObjectType));
+    if (types == NULL) { return false; }
+    tbl->_a_type = types;
+
+    ObjectData *data = realloc(tbl->_a_data, capacity * sizeof(ObjectData));
+    if (data == NULL) { return false; }
+    tbl->_a_data = data;
+
+    memset(types + old_capacity, o_Nothing,
+           (capacity - old_capacity) * sizeof(ObjectType));
+    memset(data + old_capacity, 0,
+           (capacity - old_capacity) * sizeof(ObjectData));
+    tbl->_array_capacity = capacity;
+
+    for (size_t i = old_capacity; i < capacity && hash_length(tbl) > 0; i++) {
+        Object key = OBJ(o_Integer, .integer = i),
+               val = hash_remove(tbl, key, object_hash(key));
+        if (val.type != o_Nothing) {
+            types[i] = val.type;
+            data[i] = val.data;
+            tbl->_array_length++;
+            tbl->length++;
+        }
+    }
+    return true;
+}
 
-    table_bucket *old_buckets = tbl->buckets,
-              *new_buckets = calloc(new_length, sizeof(table_bucket));
-    if (new_buckets == NULL) {
-        tbl->buckets = old_buckets;
-        return false;
+// Move all entries of the array part to the hash part.
+// Returns false if no memory.
+static bool
+array_to_hash(Table *tbl) {
+    ObjectType *types = tbl->_a_type;
+    ObjectData *data = tbl->_a_data;
+    size_t capacity = tbl->_array_capacity;
+
+    tbl->_a_type = NULL;
+    tbl->_a_data = NULL;
+    tbl->_array_capacity = 0;
+    tbl->length -= tbl->_array_length;
+    tbl->_array_length = 0;
+
+    bool ok = true;
+    for (size_t i = 0; i < capacity; i++) {
+        if (types[i] == o_Nothing) { continue; }
+
+        Object key = OBJ(o_Integer, .integer = i),
+               val = { types[i], data[i] };
+        ok = ok && hash_set(tbl, key, val, object_hash(key)).type != o_Nothing;
     }
+    free(types);
+    free(data);
+    return ok;
+}
 
-    // [bucket_set] auto increments
-    int num_elements = tbl->length;
+// Move the fields of [tbl] to the hash part and leave shape mode.
+// Returns false if no memory.
+static bool
+shape_to_dictionary(Table *tbl) {
+    Shape *shape = tbl->_shape;
+    ObjectType *types = tbl->_f_type;
+    ObjectData *data = tbl->_f_data;
+
+    tbl->_shape = NULL;
+    tbl->_f_type = NULL;
+    tbl->_f_data = NULL;
+    tbl->_f_capacity = 0;
     tbl->length = 0;
 
-    // TODO: expand not all at once?
-
-    size_t index;
-    uint64_t hash;
-    Object res;
-
-    tbl_it it = tbl_iterator(tbl);
-    while (tbl_next(&it)) {
-        hash = it._bucket->hashes[it._index - 1]; // see [table_next]
-        index = hash_index(hash, new_length);
-        res = bucket_set(tbl, new_buckets + index,
-                hash, it.cur_key, it.cur_val);
-        if (res.type == o_Nothing) {
-            for (size_t i = 0; i < new_length; i++) {
-                destroy_overflows(new_buckets + i);
-            }
-            free(new_buckets);
-            tbl->buckets = old_buckets;
-            tbl->length = num_elements;
-            return false;
-        }
+    bool ok = true;
+    for (int i = 0; i < shape->num_keys; i++) {
+        Object key = OBJ(o_String, .string = shape->keys[i]),
+               val = { types[i], data[i] };
+        ok = ok && hash_set(tbl, key, val, object_hash(key)).type != o_Nothing;
     }
+    free(types);
+    free(data);
+    return ok;
+}
+
+// Set String [key] of [tbl], in shape mode, to [value].
+// Returns false if [tbl] must be switched to dictionary mode instead.
+static bool
+shape_set(Table *tbl, Object key, Object value, Object *old_value) {
+    Shape *shape = tbl->_shape;
+    int i = shape_index(shape, key);
+    if (i >= 0) {
+        *old_value = table_field(tbl, i);
+        table_set_field(tbl, i, value);
+        return true;
+    }
+
+    if (key.type != o_String) { return false; }
+
+    Shape *next = shape_transition(shape, key.data.string);
+    if (next == NULL) { return false; }
 
-    free(old_buckets);
-    tbl->buckets = new_buckets;
-    tbl->_buckets_length = new_length;
+    i = shape->num_keys;
+    if (i >= tbl->_f_capacity) {
+        int capacity = tbl->_f_capacity ? tbl->_f_capacity * 2 : 4;
+        if (capacity > MAX_SHAPE_KEYS) { capacity = MAX_SHAPE_KEYS; }
+
+        ObjectType *types =
+            realloc(tbl->_f_type, capacity * sizeof(ObjectType));
+        if (types == NULL) { return false; }
+        tbl->_f_type = types;
+
+        ObjectData *data =
+            realloc(tbl->_f_data, capacity * sizeof(ObjectData));
+        if (data == NULL) { return false; }
+        tbl->_f_data = data;
+        tbl->_f_capacity = capacity;
+    }
+
+    tbl->_shape = next;
+    table_set_field(tbl, i, value);
+    tbl->length++;
+    *old_value = value;
     return true;
 }
 
+Object table_get_hash(Table *tbl, Object key, uint64_t hash) {
+    if (key.type == o_Nothing) return OBJ_NOTHING;
+
+    if (tbl->_shape) {
+        int i = shape_index(tbl->_shape, key);
+        return i >= 0 ? table_field(tbl, i) : OBJ_NOTHING;
+    }
+
+    if (table_in_array_part(tbl, key)) {
+        return table_array_get(tbl, key.data.integer);
+    }
+    return hash_get(tbl, key, hash);
+}
+
+Object table_get(Table *tbl, Object key) {
+    if (table_in_array_part(tbl, key)) {
+        return table_array_get(tbl, key.data.integer);
+    }
+    if (tbl->_shape) { return table_get_hash(tbl, key, 0); }
+    return table_get_hash(tbl, key, object_hash(key));
+}
+
 Object table_set_hash(Table *tbl, Object key, Object value, uint64_t hash) {
     if (!key.type || !value.type) { return OBJ_NOTHING; }
 
-    // table_expand() is run when the table fills up half of its capacity,
-    // not taking into account bucket overflows.
-    //
-    // Its initial max number of elements is 64 (8 buckets with 8 elements per
-    // bucket, excluding overflows), will expand when tbl.length is 32.
+    if (tbl->_shape) {
+        Object old_value;
+        if (shape_set(tbl, key, value, &old_value)) { return old_value; }
+        if (!shape_to_dictionary(tbl)) { return OBJ_NOTHING; }
+    }
 
-    size_t half_full = tbl->length >= (tbl->_buckets_length * N) / 2;
-    if (half_full) {
-        if (!table_expand(tbl)) {
-            return OBJ_NOTHING;
+    if (key.type == o_Integer && key.data.integer >= 0
+            && !table_in_array_part(tbl, key)) {
+        // Grow the array part if [key] is near its end and at least half of
+        // it is used, like appending to an Array.
+        size_t k = key.data.integer,
+               capacity = tbl->_array_capacity;
+        if (k < 2 * (capacity < ARRAY_MIN ? ARRAY_MIN : capacity)
+                && tbl->_array_length >= capacity / 2) {
+            capacity = capacity < ARRAY_MIN ? ARRAY_MIN : capacity;
+            while (capacity <= k) { capacity *= 2; }
+            if (!array_grow(tbl, capacity)) { return OBJ_NOTHING; }
         }
     }
 
-    size_t index = hash_index(hash, tbl->_buckets_length);
-    return bucket_set(tbl, tbl->buckets + index, hash, key, value);
+    if (table_in_array_part(tbl, key)) {
+        size_t i = key.data.integer;
+        Object old_val = table_array_get(tbl, i);
+        table_array_set(tbl, i, value);
+        return old_val.type == o_Nothing ? value : old_val;
+    }
+    return hash_set(tbl, key, value, hash);
 }
 
 Object
@@ -213,89 +656,78 @@ Object
 table_remove(Table *tbl, Object key) {
     if (key.type == o_Nothing) return OBJ_NOTHING;
 
-    uint64_t hash = object_hash(key);
-    size_t index = hash_index(hash, tbl->_buckets_length);
-    table_bucket *bucket = tbl->buckets + index;
-
-    while (bucket != NULL) {
-        for (int i = 0; i < N; i++) {
-            if (bucket->k_type[i] == o_Nothing) { break; }
-            if (bucket->hashes[i] == hash && bucket->k_type[i] == key.type) {
-                int last = i;
-                for (; last < N - 1; last++) {
-                    if (bucket->k_type[last + 1] == o_Nothing) {
-                        break;
-                    }
-                }
-
-                Object val = (Object){ bucket->v_type[i], bucket->v_data[i] };
-                _bucket_set(bucket, i, key, val);
-
-                // replace `Object` at [i] with [last]
-                bucket->k_type[i] = bucket->k_type[last];
-                bucket->k_data[i] = bucket->k_data[last];
-                bucket->v_type[i] = bucket->v_type[last];
-                bucket->v_data[i] = bucket->v_data[last];
-                bucket->hashes[i] = bucket->hashes[last];
-
-                bucket->k_type[last] = o_Nothing;
-
-                tbl->length--;
-                return val;
-            }
-        }
-        bucket = bucket->overflow;
+    if (tbl->_shape) {
+        if (shape_index(tbl->_shape, key) < 0) { return OBJ_NOTHING; }
+        if (!shape_to_dictionary(tbl)) { return OBJ_NOTHING; }
     }
 
-    return OBJ_NOTHING;
+    if (table_in_array_part(tbl, key)) {
+        size_t i = key.data.integer;
+        Object val = table_array_get(tbl, i);
+        if (val.type == o_Nothing) { return val; }
+
+        tbl->_a_type[i] = o_Nothing;
+        tbl->_a_data[i] = (ObjectData){0};
+        tbl->_array_length--;
+        tbl->length--;
+
+        // Move the remaining entries to the hash part if the array part is
+        // mostly empty.
+        if (tbl->_array_length < tbl->_array_capacity / 8) {
+            array_to_hash(tbl);
+        }
+        return val;
+    }
+    return hash_remove(tbl, key, object_hash(key));
 }
 
 tbl_it tbl_iterator(Table *tbl) {
     tbl_it it;
     it._tbl = tbl;
-    it._bucket = tbl->buckets;
-    it._bucket_idx = 1;
     it._index = 0;
     return it;
 }
 
-static bool
-__next_bucket(tbl_it *it) {
-    it->_index = 0;
-    if (it->_bucket_idx >= it->_tbl->_buckets_length) {
-        return false;
-    } else {
-        it->_bucket = &it->_tbl->buckets[it->_bucket_idx++];
+bool
+tbl_next(tbl_it *it) {
+    Table *tbl = it->_tbl;
+
+    if (tbl->_shape) {
+        if (it->_index >= (size_t) tbl->_shape->num_keys) { return false; }
+
+        size_t i = it->_index++;
+        it->cur_key = OBJ(o_String, .string = tbl->_shape->keys[i]);
+        it->cur_val = table_field(tbl, i);
         return true;
     }
-}
 
-bool
-tbl_next(tbl_it *it) {
-    while (1) {
-        if (it->_index >= N) {
-            if (it->_bucket->overflow) {
-                it->_bucket = it->_bucket->overflow;
-                it->_index = 0;
-
-            } else if (!__next_bucket(it)) {
-                return false;
-            }
-            continue;
-        }
+    for (; it->_index < tbl->_array_capacity; it->_index++) {
+        size_t i = it->_index;
+        if (tbl->_a_type[i] == o_Nothing) { continue; }
+
+        it->cur_key = OBJ(o_Integer, .integer = i);
+        it->cur_val = table_array_get(tbl, i);
+        it->_index++;
+        return true;
+    }
 
-        ObjectType key_typ = it->_bucket->k_type[it->_index];
-        if (key_typ == o_Nothing) {
-            if (!__next_bucket(it))
-                return false;
-            continue;
+    size_t start = tbl->_array_capacity,
+           capacity = tbl->_slots.capacity;
+    for (; it->_index < start + capacity + tbl->_old.capacity; it->_index++) {
+        table_slots *slots = &tbl->_slots;
+        size_t i = it->_index - start;
+        if (i >= capacity) {
+            slots = &tbl->_old;
+            i -= capacity;
         }
+        if (slots->ctrl[i] & CTRL_EMPTY) { continue; } // empty or deleted
 
-        it->cur_key.type = key_typ;
-        it->cur_key.data = it->_bucket->k_data[it->_index];
-        it->cur_val.type = it->_bucket->v_type[it->_index];
-        it->cur_val.data = it->_bucket->v_data[it->_index];
+        it->cur_key.type = slots->k_type[i];
+        it->cur_key.data = slots->k_data[i];
+        it->cur_val.type = slots->v_type[i];
+        it->cur_val.data = slots->v_data[i];
         it->_index++;
         return true;
     }
+    return false;
 }
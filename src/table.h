@@ -3,41 +3,170 @@
 // This module contains a the definition for Table Objects, a specialized
 // hash-table with Object keys and values from
 // https://github.com/tofu345/hash-table.
+//
+// Tables use open addressing in the style of Swiss Tables
+// https://abseil.io/about/design/swisstables.  Every slot has a control byte,
+// which is either [CTRL_EMPTY], [CTRL_DELETED] or the low 7 bits of the hash
+// of the key in the slot.  Slots are probed in groups of [GROUP_SIZE], the
+// control bytes of a group are compared with one SIMD instruction, and only
+// slots with a matching control byte have their keys compared.
+//
+// Small tables have fewer than [GROUP_SIZE] slots, which are scanned linearly
+// instead, so that a table with a few keys does not allocate a whole group.
+//
+// Large tables are resized incrementally: the previous slots are kept until
+// all their entries have been moved to the new slots, a few at a time, by the
+// following table_get(), table_set() and table_remove() calls.
+//
+// Like in Lua, the values of integer keys in [0, n) are stored in an array
+// part, without their keys or hashes, if at least half of them are present.
+//
+// Tables created by the VM start in shape mode, see [Shape], and switch to
+// the hash and array parts (dictionary mode) when a key which is not a String
+// is set, a key is removed, or the Table has more than [MAX_SHAPE_KEYS] keys.
 
 #include <stddef.h>
 #include <stdint.h>
 
 #include "object.h"
 
-// Number of elements in a bucket and initial number of buckets.
-#define N 8
+// Number of slots in a group.
+#define GROUP_SIZE 16
 
 bool hashable(Object key);
 
+uint64_t object_hash(Object key);
+
+// Keys are equal if they have the same type and value.  Strings are compared
+// by their contents, floats by their bits.
+bool table_key_eq(Object a, Object b);
+
+// Maximum number of keys of a Shape.
+#define MAX_SHAPE_KEYS 16
+
+// Maximum number of transitions from a Shape, Tables which would need more
+// switch to dictionary mode.
+#define MAX_SHAPE_TRANSITIONS 32
+
+// A Shape (hidden class) is a sequence of String keys.  Tables in shape mode
+// store the values of their keys in the order of their Shape, and Tables
+// which had the same keys set in the same order share the same Shape, so a
+// Shape and an index into a Tables values can be cached (see OpGetField).
+//
+// Shapes form a tree, rooted at a Shape without keys, whose children add one
+// key each.  The keys are Strings owned by the garbage collector, and are
+// marked by it.
+typedef struct Shape {
+    struct Shape **transitions; // children
+    int num_transitions;
+
+    int num_keys;
+    CharBuffer *keys[]; // in the order they were added.
+} Shape;
+
+// Create a Shape without keys.  Returns NULL if no memory.
+Shape *shape_new_root(void);
+
+// Free [root] and all its descendants.
+void shape_free(Shape *root);
+
+// Index of String [key] in [shape] or -1.
+int shape_index(Shape *shape, Object key);
+
 // Separated `Object` into `ObjectType` and `ObjectData` to avoid excessive
 // padding.
 //
-// `k_type[i]` is [o_Nothing] for empty entries.
-typedef struct table_bucket {
-    uint64_t hashes[N]; // for faster comparisons.
-    ObjectType k_type[N];
-    ObjectData k_data[N];
-    ObjectType v_type[N];
-    ObjectData v_data[N];
-    struct table_bucket *overflow;
-} table_bucket;
+// Allocated in one block, of [capacity] elements each.
+typedef struct {
+    size_t capacity; // a power of 2, a multiple of GROUP_SIZE unless small.
+
+    uint64_t *hashes; // for faster comparisons and rehashing.
+    ObjectData *k_data;
+    ObjectData *v_data;
+    uint8_t *ctrl;
+    ObjectType *k_type;
+    ObjectType *v_type;
+} table_slots;
 
+// A zeroed Table is empty, its slots are allocated on the first table_set().
 typedef struct Table {
     size_t length; // number of filled entries
 
-    table_bucket *buckets;
-    size_t _buckets_length;
+    table_slots _slots;
+    size_t _tombstones; // number of [CTRL_DELETED] [_slots].
+
+    // While resizing, the previous slots.  Entries before index [_migrated]
+    // have been moved to [_slots] and deleted.
+    table_slots _old;
+    size_t _migrated;
+
+    // Array part, the values of integer keys in [0, _array_capacity), with
+    // [o_Nothing] for missing keys.  These keys are never in the hash part.
+    ObjectType *_a_type;
+    ObjectData *_a_data;
+    size_t _array_capacity;
+    size_t _array_length; // number of filled entries in the array part.
+
+    // In shape mode, the Shape of the Table and the values of its keys.  NULL
+    // in dictionary mode.
+    Shape *_shape;
+    ObjectType *_f_type;
+    ObjectData *_f_data;
+    int _f_capacity;
 } Table;
 
+// Shape of [tbl] or NULL, the value of [shape.keys[i]] is table_field(tbl, i).
+static inline Shape *
+table_shape(Table *tbl) {
+    return tbl->_shape;
+}
+
+static inline Object
+table_field(Table *tbl, int i) {
+    return (Object){ tbl->_f_type[i], tbl->_f_data[i] };
+}
+
+// [value] must not be [o_Nothing].
+static inline void
+table_set_field(Table *tbl, int i, Object value) {
+    tbl->_f_type[i] = value.type;
+    tbl->_f_data[i] = value.data;
+}
+
+// Whether the value of [key] is stored in the array part of [tbl], for
+// access with table_array_get() without hashing.
+static inline bool
+table_in_array_part(Table *tbl, Object key) {
+    return key.type == o_Integer
+        && (unsigned long) key.data.integer < tbl->_array_capacity;
+}
+
+static inline Object
+table_array_get(Table *tbl, size_t i) {
+    return (Object){ tbl->_a_type[i], tbl->_a_data[i] };
+}
+
+// [value] must not be [o_Nothing].
+static inline void
+table_array_set(Table *tbl, size_t i, Object value) {
+    if (tbl->_a_type[i] == o_Nothing) {
+        tbl->_array_length++;
+        tbl->length++;
+    }
+    tbl->_a_type[i] = value.type;
+    tbl->_a_data[i] = value.data;
+}
+
 // returns NULL or err.
 void *table_init(Table *tbl);
+
+// table_init() in shape mode, with Shape [root] (see shape_new_root()).
+void *table_init_shaped(Table *tbl, Shape *root);
 void table_free(Table *tbl);
 
+// Number of bytes allocated for the entries of [tbl].
+size_t table_memory(Table *tbl);
+
 // Get item with [key]. Return value, or [o_Nothing Object] if not found.
 Object table_get(Table *tbl, Object key);
 
@@ -46,7 +175,7 @@ Object table_get_hash(Table *tbl, Object key, uint64_t hash);
 
 // Returns [Null Object] if:
 // - [key] or [value] is [Null Object].
-// - allocation of [table_bucket] overflow failed.
+// - allocation of slots failed.
 // Returns previous value of [key] if present.
 // Returns [value] otherwise.
 Object table_set(Table *tbl, Object key, Object value);
@@ -63,9 +192,8 @@ typedef struct {
 
     // Don't use these fields directly.
     Table *_tbl;
-    table_bucket *_bucket; // current bucket under inspection
-    size_t _bucket_idx;    // index of current bucket into `_buckets`
-    int _index;            // index of current entry into `_bucket.entries`
+    size_t _index; // index of next entry to inspect, in the fields or the
+                   // array part, then [_slots] then [_old].
 } tbl_it;
 
 // Initialize new iterator (for use with tbl_next()).
@@ -73,5 +201,6 @@ tbl_it tbl_iterator(Table *tbl);
 
 // Move iterator to next item in table, update iterator's [cur_key] and
 // [cur_val] current item, and return true.  If there are no more items, return
-// false.  Do not mutate the table during iteration.
+// false.  Do not call other table functions on the table during iteration,
+// even table_get() can move entries while resizing.
 bool tbl_next(tbl_it *it);
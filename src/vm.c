@@ -9,6 +9,7 @@
 #include "hash-table/ht.h"
 #include "module.h"
 #include "object.h"
+#include "registers.h"
 #include "table.h"
 #include "utils.h"
 
@@ -37,13 +38,17 @@ void vm_init(VM *vm, Compiler *compiler) {
 
     vm->compiler = compiler;
 
-    vm->stack = calloc(StackSize, sizeof(Object));
+    vm->stack = calloc(InitialStackSize, sizeof(Object));
     if (vm->stack == NULL) { die("vm stack create:"); }
+    vm->stack_capacity = InitialStackSize;
 
-    vm->frames = calloc(MaxFraxes, sizeof(Frame));
+    vm->frames = calloc(InitialFrames, sizeof(Frame));
     if (vm->frames == NULL) { die("vm frames create:"); }
+    vm->frames_capacity = InitialFrames;
+    vm->max_stack_size = DefaultMaxStackSize;
+    vm->jit_threshold = DefaultJitThreshold;
 
-    vm->bytesTillGC = NextGC;
+    gc_configure(vm, DefaultGCConfig);
 
     vm->cur_module = NULL;
     vm->modules = ht_create();
@@ -51,23 +56,32 @@ void vm_init(VM *vm, Compiler *compiler) {
 
     vm->closure = calloc(1, sizeof(Closure));
     if (vm->closure == NULL) { die("vm closure create:"); }
+
+    vm->root_shape = shape_new_root();
+    if (vm->root_shape == NULL) { die("vm root shape create:"); }
 }
 
 void vm_free(VM *vm) {
 #ifdef DEBUG
-    if (vm->last) { puts("\ncleaning up:"); }
+    if (vm->young || vm->old) { puts("\ncleaning up:"); }
 #endif
 
-    Allocation *next, *cur = vm->last;
-    while (cur) {
-        next = cur->next;
-        free_allocation(cur);
-        cur = next;
+    Allocation *lists[] = { vm->young, vm->old };
+    for (int i = 0; i < 2; i++) {
+        Allocation *next, *cur = lists[i];
+        while (cur) {
+            next = cur->next;
+            free_allocation(cur);
+            cur = next;
+        }
     }
+    free(vm->remembered.data);
     free(vm->stack);
     free(vm->frames);
     free(vm->closure);
     free(vm->globals);
+    free(vm->constants);
+    if (vm->root_shape) { shape_free(vm->root_shape); }
 
     hti it = ht_iterator(vm->modules);
     while (ht_next(&it)) {
@@ -78,6 +92,46 @@ void vm_free(VM *vm) {
     memset(vm, 0, sizeof(VM));
 }
 
+void vm_set_max_stack(VM *vm, int max_stack_size) {
+    vm->max_stack_size = max_stack_size;
+}
+
+void vm_set_jit(VM *vm, int threshold) {
+    vm->jit_threshold = threshold;
+}
+
+void vm_set_registers(VM *vm, bool registers) {
+    vm->registers = registers;
+}
+
+// Grow [*buf] of [*capacity] elements of [size] bytes to hold at least [min]
+// elements, doubling up to [vm.max_stack_size].
+// The caller checks [min] against [vm.max_stack_size] first, since the initial
+// capacities may already be larger.  Returns false if no memory.
+static bool
+grow(VM *vm, void **buf, int *capacity, size_t size, int min) {
+    // size_t so doubling past INT_MAX does not overflow.
+    size_t new_capacity = *capacity;
+    while (new_capacity < (size_t) min) { new_capacity *= 2; }
+    if (new_capacity > (size_t) vm->max_stack_size) {
+        new_capacity = vm->max_stack_size;
+    }
+
+    void *new_buf = realloc(*buf, new_capacity * size);
+    if (new_buf == NULL) { return false; }
+
+    *buf = new_buf;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Grow [vm.stack] to hold at least [min] Objects.
+static bool
+grow_stack(VM *vm, int min) {
+    return grow(vm, (void **) &vm->stack, &vm->stack_capacity,
+                sizeof(Object), min);
+}
+
 // return to previous [Frame]
 static Frame *
 pop_frame(VM *vm) {
@@ -85,14 +139,18 @@ pop_frame(VM *vm) {
     return vm->frames + vm->frames_index;
 }
 
-// increment [vm.frames_index] if less than [MaxFraxes]
+// increment [vm.frames_index], growing [vm.frames] if necessary.
+// Pointers to Frames are invalidated.
 static error
 new_frame(VM *vm) {
-    ++vm->frames_index;
-    if (vm->frames_index >= MaxFraxes) {
-        --vm->frames_index;
+    int min = vm->frames_index + 2;
+    if (min > vm->max_stack_size
+            || (min > vm->frames_capacity
+                && !grow(vm, (void **) &vm->frames, &vm->frames_capacity,
+                         sizeof(Frame), min))) {
         return errorf("exceeded maximum function call stack");
     }
+    ++vm->frames_index;
     return 0;
 }
 
@@ -105,28 +163,25 @@ frame_init(VM *vm, Object function, int base_pointer) {
     };
 }
 
-static Instructions
-frame_instructions(Frame *f) {
+static CompiledFunction *
+frame_function(Frame *f) {
     switch (f->function.type) {
         case o_Closure:
-            return f->function.data.closure->func->instructions;
+            return f->function.data.closure->func;
         case o_Module:
-            return f->function.data.module->main_function->instructions;
+            return f->function.data.module->main_function;
         default:
-            die("frame_instructions: Frame should not have function of type %s",
+            die("frame_function: Frame should not have function of type %s",
                 show_object_type(f->function.type));
     }
 }
 
 
-static error
+// The stack has room for all Objects pushed by a function, see
+// [CompiledFunction.max_stack].
+static inline void
 vm_push(VM *vm, Object obj) {
-    if (vm->sp >= StackSize) {
-        return errorf("stack overflow");
-    }
-
     vm->stack[vm->sp++] = obj;
-    return 0;
 }
 
 static Object
@@ -290,9 +345,11 @@ execute_binary_array_operation(VM *vm, Opcode op, Object left, Object right) {
     int l_length = left.data.array->length,
         new_length = l_length * right.data.integer;
 
-    ObjectBuffer *new_arr = create_array(vm, NULL, new_length);
+    Array *old_arr = left.data.array,
+          *new_arr = create_array(vm, NULL, new_length);
     for (int i = 0; i < new_length; i += l_length) {
-        memcpy(new_arr->data + i, left.data.array->data, l_length * sizeof(Object));
+        memcpy(new_arr->types + i, old_arr->types, l_length * sizeof(ObjectType));
+        memcpy(new_arr->data + i, old_arr->data, l_length * sizeof(ObjectData));
     }
 
     Object obj = OBJ(o_Array, .array = new_arr);
@@ -334,11 +391,12 @@ execute_binary_operation(VM *vm, Opcode op) {
     if (result.type == o_Error) {
         return result.data.err;
     }
-    return vm_push(vm, result);
+    vm_push(vm, result);
+    return 0;
 }
 
-static error
-execute_integer_comparison(VM *vm, Opcode op, Object left, Object right) {
+static Object
+execute_integer_comparison(Opcode op, Object left, Object right) {
     Object result;
 
     switch (op) {
@@ -358,11 +416,11 @@ execute_integer_comparison(VM *vm, Opcode op, Object left, Object right) {
             die("unkown integer comparison operator: %s (%d)",
                     lookup(op)->name, op);
     }
-    return vm_push(vm, result);
+    return result;
 }
 
-static error
-execute_float_comparison(VM *vm, Opcode op, Object left, Object right) {
+static Object
+execute_float_comparison(Opcode op, Object left, Object right) {
     Object result;
 
     switch (op) {
@@ -382,7 +440,7 @@ execute_float_comparison(VM *vm, Opcode op, Object left, Object right) {
             die("unkown float comparison operator: %s (%d)",
                     lookup(op)->name, op);
     }
-    return vm_push(vm, result);
+    return result;
 }
 
 static error
@@ -391,37 +449,60 @@ execute_comparison(VM *vm, Opcode op) {
     Object left = vm_pop(vm);
 
     if (left.type == o_Integer && right.type == o_Integer) {
-        return execute_integer_comparison(vm, op, left, right);
+        vm_push(vm, execute_integer_comparison(op, left, right));
+        return 0;
 
     } else if (left.type == o_Float && right.type == o_Float) {
-        return execute_float_comparison(vm, op, left, right);
+        vm_push(vm, execute_float_comparison(op, left, right));
+        return 0;
     }
 
     Object res = object_eq(left, right);
     switch (op) {
         case OpEqual:
-            return vm_push(vm, res);
+            vm_push(vm, res);
+            return 0;
 
         case OpNotEqual:
             res.data.boolean = !res.data.boolean;
-            return vm_push(vm, res);
+            vm_push(vm, res);
+            return 0;
 
         default:
             return error_unknown_operation(op, left, right);
     }
 }
 
+// The quickened variant of [op], from OpAdd to OpGreaterThan, for operands
+// [left] and [right], or [op].
+static inline Opcode
+quicken(Opcode op, Object left, Object right) {
+    if (left.type != right.type) { return op; }
+
+    switch (left.type) {
+        case o_Integer:
+            return OpAddInt + (op - OpAdd);
+        case o_Float:
+            return OpAddFloat + (op - OpAdd);
+        default:
+            return op;
+    }
+}
+
 static error
 execute_bang_operator(VM *vm) {
     Object operand = vm_pop(vm);
     switch (operand.type) {
         case o_Boolean:
             operand.data.boolean = !operand.data.boolean;
-            return vm_push(vm, operand);
+            vm_push(vm, operand);
+            return 0;
         case o_Nothing:
-            return vm_push(vm, OBJ_BOOL(true));
+            vm_push(vm, OBJ_BOOL(true));
+            return 0;
         default:
-            return vm_push(vm, OBJ_BOOL(false));
+            vm_push(vm, OBJ_BOOL(false));
+            return 0;
     }
 }
 
@@ -441,19 +522,22 @@ execute_minus_operator(VM *vm) {
             return errorf("unsupported type for negation: %s",
                     show_object_type(operand.type));
     }
-    return vm_push(vm, operand);
+    vm_push(vm, operand);
+    return 0;
 }
 
 static error
 execute_array_index(VM *vm, Object array, Object index) {
-    ObjectBuffer *arr = array.data.array;
+    Array *arr = array.data.array;
     int i = index.data.integer,
         max = arr->length - 1;
     if (i < 0 || i > max) {
-        return vm_push(vm, OBJ_NOTHING);
+        vm_push(vm, OBJ_NOTHING);
+        return 0;
     }
 
-    return vm_push(vm, arr->data[i]);
+    vm_push(vm, array_get(arr, i));
+    return 0;
 }
 
 static error
@@ -464,7 +548,8 @@ execute_table_index(VM *vm, Object obj, Object index) {
                 show_object_type(index.type));
     }
 
-    return vm_push(vm, table_get(tbl, index));
+    vm_push(vm, table_get(tbl, index));
+    return 0;
 }
 
 static error
@@ -485,22 +570,41 @@ execute_index_expression(VM *vm) {
     }
 }
 
+// OpGetField, on a miss of [cache].
 static error
-execute_set_array_index(Object array, Object index,
+execute_get_field(VM *vm, Object key, FieldCache *cache) {
+    Object obj = vm->stack[vm->sp - 1];
+    if (obj.type == o_Table && table_shape(obj.data.table)) {
+        Table *tbl = obj.data.table;
+        int i = shape_index(table_shape(tbl), key);
+        if (i >= 0) {
+            *cache = (FieldCache){ table_shape(tbl), i };
+            vm->stack[vm->sp - 1] = table_field(tbl, i);
+            return 0;
+        }
+    }
+
+    vm_push(vm, key);
+    return execute_index_expression(vm);
+}
+
+static error
+execute_set_array_index(VM *vm, Object array, Object index,
         Object elem) {
-    ObjectBuffer *arr = array.data.array;
+    Array *arr = array.data.array;
     int i = index.data.integer,
         max = arr->length - 1;
     if (i < 0 || i > max) {
         return errorf("cannot set list index out of range");
     }
 
-    arr->data[i] = elem;
+    array_set(arr, i, elem);
+    write_barrier(vm, array);
     return 0;
 }
 
 static error
-execute_set_table_index(Object obj, Object index, Object val) {
+execute_set_table_index(VM *vm, Object obj, Object index, Object val) {
     Table *tbl = obj.data.table;
     if (!hashable(index)) {
         return errorf("unusable as table key: %s",
@@ -517,6 +621,7 @@ execute_set_table_index(Object obj, Object index, Object val) {
     if (result.type == o_Nothing) {
         return errorf("could not set table index");
     }
+    write_barrier(vm, obj);
     return 0;
 }
 
@@ -527,10 +632,10 @@ execute_set_index(VM *vm) {
     Object right = vm_pop(vm);
 
     if (left.type == o_Array && index.type == o_Integer) {
-        return execute_set_array_index(left, index, right);
+        return execute_set_array_index(vm, left, index, right);
 
     } else if (left.type == o_Table) {
-        return execute_set_table_index(left, index, right);
+        return execute_set_table_index(vm, left, index, right);
 
     } else {
         return errorf("index assignment not supported for %s[%s]",
@@ -538,14 +643,33 @@ execute_set_index(VM *vm) {
     }
 }
 
+// OpSetField, on a miss of [cache].
 static error
-vm_push_constant(VM *vm, Constant c) {
+execute_set_field(VM *vm, Object key, FieldCache *cache) {
+    Object obj = vm->stack[vm->sp - 1];
+    vm_push(vm, key);
+
+    error err = execute_set_index(vm);
+    if (err) { return err; }
+
+    if (obj.type == o_Table && table_shape(obj.data.table)) {
+        Table *tbl = obj.data.table;
+        int i = shape_index(table_shape(tbl), key);
+        if (i >= 0) {
+            *cache = (FieldCache){ table_shape(tbl), i };
+        }
+    }
+    return 0;
+}
+
+static Object
+constant_object(VM *vm, Constant c) {
     switch (c.type) {
         case c_Integer:
-            return vm_push(vm, OBJ(o_Integer, .integer = c.data.integer));
+            return OBJ(o_Integer, .integer = c.data.integer);
 
         case c_Float:
-            return vm_push(vm, OBJ(o_Float, .floating = c.data.floating));
+            return OBJ(o_Float, .floating = c.data.floating);
 
         case c_String:
             {
@@ -558,11 +682,33 @@ vm_push_constant(VM *vm, Constant c) {
     debug_print_create(obj);
 #endif
 
-                return vm_push(vm, obj);
+                return obj;
             }
 
+        // created by OpClosure.
+        case c_Function:
+            return OBJ_NOTHING;
+
         default:
-            die("vm_push_constant: type %d not handled", c.type);
+            die("constant_object: type %d not handled", c.type);
+    }
+}
+
+// Create Objects for the constants added to the Compiler since the last call,
+// see [VM.constants].
+static void
+materialize_constants(VM *vm) {
+    ConstantBuffer *constants = &vm->compiler->constants;
+    if (vm->num_constants == constants->length) { return; }
+
+    vm->constants = realloc(vm->constants, constants->length * sizeof(Object));
+    if (vm->constants == NULL) { die("vm materialize constants:"); }
+
+    // [num_constants] is incremented one at a time, because creating a
+    // String can trigger GC, which marks [vm.constants].
+    while (vm->num_constants < constants->length) {
+        Object obj = constant_object(vm, constants->data[vm->num_constants]);
+        vm->constants[vm->num_constants++] = obj;
     }
 }
 
@@ -621,8 +767,7 @@ build_table(VM *vm, int start_index, int end_index) {
 }
 
 static error
-call_closure(VM *vm, Closure *cl, int num_args) {
-    CompiledFunction *fn = cl->func;
+check_num_args(CompiledFunction *fn, int num_args) {
     if (num_args != fn->num_parameters) {
         Identifier *id = fn->literal->name;
         if (id) {
@@ -630,26 +775,64 @@ call_closure(VM *vm, Closure *cl, int num_args) {
         }
         return error_num_args("<anonymous function>", fn->num_parameters, num_args);
     }
+    return 0;
+}
+
+// Make room for the local variables of [fn], after its arguments at
+// [base_pointer], and all Objects it pushes.  This is the only stack overflow
+// check for [fn].
+static error
+init_locals(VM *vm, CompiledFunction *fn, int base_pointer) {
+    int locals_end = base_pointer + fn->num_locals;
+    int min = locals_end + fn->max_stack;
+    if (min > vm->max_stack_size
+            || (min > vm->stack_capacity && !grow_stack(vm, min))) {
+        return errorf("stack overflow");
+    }
+
+    // set local variables to [o_Nothing] to avoid use after free if GC is
+    // triggered and accesses freed Compound Data Types still on the stack.
+    if (locals_end > vm->sp) {
+        memset(vm->stack + vm->sp, 0, (locals_end - vm->sp) * sizeof(Object));
+    }
+
+    vm->sp = locals_end;
 
+    return 0;
+}
+
+// Call [cl] in a new Frame with the [num_args] arguments on top of the
+// stack, which is the number of parameters of [cl].
+static error
+enter_closure(VM *vm, Closure *cl, int num_args) {
     error err = new_frame(vm);
     if (err) { return err; }
 
     int base_pointer = vm->sp - num_args;
     frame_init(vm, OBJ(o_Closure, .closure = cl), base_pointer);
 
-    if (fn->num_locals > 0) {
-        if (vm->sp + fn->num_locals >= StackSize) {
-            return errorf("stack overflow: insufficient space for local variables");
-        }
+    return init_locals(vm, cl->func, base_pointer);
+}
 
-        // set local variables to [o_Nothing] to avoid use after free if GC is
-        // triggered and accesses freed Compound Data Types still on the stack.
-        memset(vm->stack + vm->sp, 0, fn->num_locals * sizeof(Object));
-    }
+static error
+call_closure(VM *vm, Closure *cl, int num_args) {
+    error err = check_num_args(cl->func, num_args);
+    if (err) { return err; }
 
-    vm->sp = base_pointer + fn->num_locals;
+    return enter_closure(vm, cl, num_args);
+}
 
-    return 0;
+// enter_closure() in the current Frame, replacing its arguments and local
+// variables.
+static error
+reenter_closure(VM *vm, Closure *cl, int num_args) {
+    int base_pointer = vm->frames[vm->frames_index].base_pointer;
+    memmove(vm->stack + base_pointer, vm->stack + vm->sp - num_args,
+            num_args * sizeof(Object));
+    vm->sp = base_pointer + num_args;
+    frame_init(vm, OBJ(o_Closure, .closure = cl), base_pointer);
+
+    return init_locals(vm, cl->func, base_pointer);
 }
 
 static error
@@ -662,7 +845,8 @@ call_builtin(VM *vm, const Builtin *builtin, int num_args) {
     if (result.type == o_Error) {
         return result.data.err;
     } else {
-        return vm_push(vm, result);
+        vm_push(vm, result);
+        return 0;
     }
 }
 
@@ -701,7 +885,8 @@ vm_push_closure(VM *vm, Constant constant, int num_free) {
     // remove free variables from stack
     vm->sp -= num_free;
 
-    return vm_push(vm, obj);
+    vm_push(vm, obj);
+    return 0;
 }
 
 static inline void resize_vm_globals(VM *vm, int num_globals) {
@@ -718,312 +903,797 @@ static inline void resize_vm_globals(VM *vm, int num_globals) {
     vm->num_globals = num_globals;
 }
 
+// labels as values are a GNU extension.
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
 error vm_run(VM *vm, Bytecode code) {
     resize_vm_globals(vm, code.num_globals);
+    materialize_constants(vm);
+
     vm->closure->func = code.main_function;
     frame_init(vm, OBJ(o_Closure, .closure = vm->closure), 0);
 
+    error err = init_locals(vm, code.main_function, vm->sp);
+    if (err) { return err; }
+
     // frequently accessed
     Frame *current_frame = &vm->frames[vm->frames_index];
-    Instructions ins = code.main_function->instructions;
+    CompiledFunction *function = code.main_function;
+    uint32_t *words = function->words, word;
     Constant *constants = vm->compiler->constants.data;
+    Object *constant_objs = vm->constants;
     Object *globals = vm->globals;
 
     int ip, pos, num;
     const Builtin *builtins = get_builtins(&pos);
     Opcode op;
-    Object obj;
-    error err;
-    while (current_frame->ip < ins.length - 1) {
-        ip = ++current_frame->ip;
-        op = ins.data[ip];
-
-        // TODO: use computed gotos
-        // https://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables
-        switch (op) {
-            case OpConstant:
-                // constant index
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
-
-                err = vm_push_constant(vm, constants[pos]);
-                if (err) { return err; };
-                break;
-
-            case OpAdd:
-            case OpSub:
-            case OpMul:
-            case OpDiv:
-                err = execute_binary_operation(vm, op);
-                if (err) { return err; };
-                break;
-
-            case OpPop:
-                vm_pop(vm);
-                break;
+    Object obj, key;
+    FieldCache *cache;
+    CallCache *call_cache;
+    Closure *closure;
+
+#ifdef COMPUTED_GOTO
+    // Address of the handler of each Opcode, in the order of `Opcode`.
+    static void *dispatch_table[] = {
+        &&op_unknown, // Opcodes start at 1
+        &&op_OpConstant,
+        &&op_OpPop,
+        &&op_OpAdd,
+        &&op_OpSub,
+        &&op_OpMul,
+        &&op_OpDiv,
+        &&op_OpEqual,
+        &&op_OpNotEqual,
+        &&op_OpLessThan,
+        &&op_OpGreaterThan,
+        &&op_OpMinus,
+        &&op_OpBang,
+        &&op_OpTrue,
+        &&op_OpFalse,
+        &&op_OpNothing,
+        &&op_OpJumpNotTruthy,
+        &&op_OpJump,
+        &&op_OpGetGlobal,
+        &&op_OpSetGlobal,
+        &&op_OpGetLocal,
+        &&op_OpSetLocal,
+        &&op_OpGetFree,
+        &&op_OpSetFree,
+        &&op_OpArray,
+        &&op_OpTable,
+        &&op_OpIndex,
+        &&op_OpSetIndex,
+        &&op_OpGetField,
+        &&op_OpSetField,
+        &&op_OpCall,
+        &&op_OpTailCall,
+        &&op_OpRequire,
+        &&op_OpReturnValue,
+        &&op_OpReturn,
+        &&op_OpGetBuiltin,
+        &&op_OpClosure,
+        &&op_OpCurrentClosure,
+        &&op_OpHalt,
+        &&op_OpGetLocal2,
+        &&op_OpIncrementLocal,
+        &&op_OpJumpNotEqual,
+        &&op_OpJumpEqual,
+        &&op_OpJumpNotLessThan,
+        &&op_OpJumpNotGreaterThan,
+        &&op_OpCallSelf,
+        &&op_OpTailCallSelf,
+        &&op_OpAddInt,
+        &&op_OpSubInt,
+        &&op_OpMulInt,
+        &&op_OpDivInt,
+        &&op_OpEqualInt,
+        &&op_OpNotEqualInt,
+        &&op_OpLessThanInt,
+        &&op_OpGreaterThanInt,
+        &&op_OpAddFloat,
+        &&op_OpSubFloat,
+        &&op_OpMulFloat,
+        &&op_OpDivFloat,
+        &&op_OpEqualFloat,
+        &&op_OpNotEqualFloat,
+        &&op_OpLessThanFloat,
+        &&op_OpGreaterThanFloat,
+        &&op_OpIAdd,
+        &&op_OpISub,
+        &&op_OpIMul,
+        &&op_OpIDiv,
+        &&op_OpIEqual,
+        &&op_OpINotEqual,
+        &&op_OpILessThan,
+        &&op_OpIGreaterThan,
+        &&op_OpFAdd,
+        &&op_OpFSub,
+        &&op_OpFMul,
+        &&op_OpFDiv,
+        &&op_OpFEqual,
+        &&op_OpFNotEqual,
+        &&op_OpFLessThan,
+        &&op_OpFGreaterThan,
+        &&op_OpArrayIndex,
+    };
+    _Static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0])
+                       == OpCount, "a handler for each Opcode");
+
+    // from wren: each handler ends with an indirect jump to the next
+    // handler, giving the branch predictor one jump per Opcode to learn from.
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) op_##name
+#define DISPATCH()                                                            \
+    do {                                                                      \
+        ip = ++current_frame->ip;                                             \
+        word = words[ip];                                                     \
+        goto *dispatch_table[op = word_opcode(word)];                         \
+    } while (0)
 
-            case OpTrue:
-                err = vm_push(vm, OBJ_BOOL(true));
-                if (err) { return err; };
-                break;
-            case OpFalse:
-                err = vm_push(vm, OBJ_BOOL(false));
-                if (err) { return err; };
-                break;
+#else
+#define INTERPRET_LOOP                                                        \
+    loop:                                                                     \
+        ip = ++current_frame->ip;                                             \
+        word = words[ip];                                                     \
+        switch (op = word_opcode(word))
+#define CASE_CODE(name) case name
+#define DISPATCH() goto loop
+#endif
 
-            case OpEqual:
-            case OpNotEqual:
-            case OpLessThan:
-            case OpGreaterThan:
-                err = execute_comparison(vm, op);
-                if (err) { return err; };
-                break;
+// Continue in [function], the function of [current_frame], with its machine
+// code if it was compiled, by the JIT or ahead of time.
+#define RESUME()                                                              \
+    do {                                                                      \
+        if (function->jit) { goto native; }                                   \
+        DISPATCH();                                                           \
+    } while (0)
+
+// RESUME() after a call or an iteration of a loop in [function], which are
+// counted to compile it once it is hot.
+#define RESUME_HOT()                                                          \
+    do {                                                                      \
+        if (function->hotness < vm->jit_threshold                             \
+                && ++function->hotness == vm->jit_threshold) {                \
+            function->jit = vm->registers ? register_compile(function)        \
+                                          : jit_compile(function);            \
+        }                                                                     \
+        RESUME();                                                             \
+    } while (0)
+
+    // The machine code runs until an instruction it exits at, which is
+    // interpreted.
+    if (function->jit) {
+native:
+        jit_run(vm, function->jit, current_frame, globals);
+    }
 
-            case OpBang:
-                err = execute_bang_operator(vm);
-                if (err) { return err; };
-                break;
-            case OpMinus:
-                err = execute_minus_operator(vm);
-                if (err) { return err; };
-                break;
+    INTERPRET_LOOP
+    {
+        CASE_CODE(OpConstant):
+            // constant index
+            pos = word_operand(word);
+
+            vm_push(vm, constant_objs[pos]);
+            DISPATCH();
+
+        CASE_CODE(OpAdd):
+        CASE_CODE(OpSub):
+        CASE_CODE(OpMul):
+        CASE_CODE(OpDiv):
+            words[ip] = word_with_opcode(
+                word, quicken(op, vm->stack[vm->sp - 2], vm->stack[vm->sp - 1]));
+            err = execute_binary_operation(vm, op);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpPop):
+            vm_pop(vm);
+            DISPATCH();
+
+        CASE_CODE(OpTrue):
+            vm_push(vm, OBJ_BOOL(true));
+            DISPATCH();
+        CASE_CODE(OpFalse):
+            vm_push(vm, OBJ_BOOL(false));
+            DISPATCH();
+
+        CASE_CODE(OpEqual):
+        CASE_CODE(OpNotEqual):
+        CASE_CODE(OpLessThan):
+        CASE_CODE(OpGreaterThan):
+            words[ip] = word_with_opcode(
+                word, quicken(op, vm->stack[vm->sp - 2], vm->stack[vm->sp - 1]));
+            err = execute_comparison(vm, op);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpBang):
+            err = execute_bang_operator(vm);
+            if (err) { return err; };
+            DISPATCH();
+        CASE_CODE(OpMinus):
+            err = execute_minus_operator(vm);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpJump):
+            pos = word_operand(word);
+            current_frame->ip = pos - 1;
+            if (pos < ip) {
+                // an iteration of a loop.
+                RESUME_HOT();
+            }
+            DISPATCH();
+        CASE_CODE(OpJumpNotTruthy):
+            pos = word_operand(word);
 
-            case OpJump:
-                pos = read_big_endian_uint16(ins.data + ip + 1);
+            obj = vm_pop(vm);
+            if (obj.type == o_Boolean ? !obj.data.boolean : !is_truthy(obj)) {
                 current_frame->ip = pos - 1;
-                break;
-            case OpJumpNotTruthy:
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
-
-                obj = vm_pop(vm);
-                if (!is_truthy(obj)) {
-                    current_frame->ip = pos - 1;
-                }
-                break;
+            }
+            DISPATCH();
 
-            case OpNothing:
-                err = vm_push(vm, OBJ_NOTHING);
-                if (err) { return err; };
-                break;
+        CASE_CODE(OpNothing):
+            vm_push(vm, OBJ_NOTHING);
+            DISPATCH();
 
-            case OpSetGlobal:
-                // globals index
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
+        CASE_CODE(OpSetGlobal):
+            // globals index
+            pos = word_operand(word);
 
-                globals[pos] = vm_pop(vm);
-                break;
+            globals[pos] = vm_pop(vm);
+            DISPATCH();
 
-            case OpGetGlobal:
-                // globals index
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
+        CASE_CODE(OpGetGlobal):
+            // globals index
+            pos = word_operand(word);
 
-                err = vm_push(vm, globals[pos]);
-                if (err) { return err; };
-                break;
+            vm_push(vm, globals[pos]);
+            DISPATCH();
 
-            case OpArray:
-                // number of array elements
-                num = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
+        CASE_CODE(OpArray):
+            // number of array elements
+            num = word_operand(word);
 
-                obj = build_array(vm, vm->sp - num, vm->sp);
-                vm->sp -= num;
+            obj = build_array(vm, vm->sp - num, vm->sp);
+            vm->sp -= num;
 
-                err = vm_push(vm, obj);
-                if (err) { return err; };
-                break;
+            vm_push(vm, obj);
+            DISPATCH();
 
-            case OpTable:
-                // number of elements
-                num = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
+        CASE_CODE(OpTable):
+            // number of elements
+            num = word_operand(word);
 
-                obj = build_table(vm, vm->sp - num, vm->sp);
-                if (obj.type == o_Error) { return obj.data.err; };
+            obj = build_table(vm, vm->sp - num, vm->sp);
+            if (obj.type == o_Error) { return obj.data.err; };
 
-                vm->sp -= num;
-                err = vm_push(vm, obj);
-                if (err) { return err; };
-                break;
+            vm->sp -= num;
+            vm_push(vm, obj);
+            DISPATCH();
 
-            case OpIndex:
-                err = execute_index_expression(vm);
-                if (err) { return err; };
-                break;
+        CASE_CODE(OpIndex):
+            // integer keys in the array part of a Table, see table.h.
+            obj = vm->stack[vm->sp - 2];
+            key = vm->stack[vm->sp - 1];
+            if (obj.type == o_Table
+                    && table_in_array_part(obj.data.table, key)) {
+                vm->stack[vm->sp - 2] =
+                    table_array_get(obj.data.table, key.data.integer);
+                vm->sp--;
+                DISPATCH();
+            }
 
-            case OpSetIndex:
-                err = execute_set_index(vm);
-                if (err) { return err; };
-                break;
+            err = execute_index_expression(vm);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpSetIndex):
+            obj = vm->stack[vm->sp - 2];
+            key = vm->stack[vm->sp - 1];
+            if (obj.type == o_Table
+                    && table_in_array_part(obj.data.table, key)
+                    && vm->stack[vm->sp - 3].type != o_Nothing) {
+                table_array_set(obj.data.table, key.data.integer,
+                                vm->stack[vm->sp - 3]);
+                write_barrier(vm, obj);
+                vm->sp -= 3;
+                DISPATCH();
+            }
 
-            case OpCall:
-                // num arguments
-                num = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+            err = execute_set_index(vm);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpGetField):
+            pos = word_operand(word);
+            num = words[ip + 1];
+            current_frame->ip += 1;
+
+            // Tables with the cached Shape have the key at the same index.
+            cache = function->field_caches.data + num;
+            obj = vm->stack[vm->sp - 1];
+            if (obj.type == o_Table && cache->shape
+                    && table_shape(obj.data.table) == cache->shape) {
+                vm->stack[vm->sp - 1] = table_field(obj.data.table,
+                                                    cache->index);
+                DISPATCH();
+            }
+
+            err = execute_get_field(vm, constant_objs[pos], cache);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpSetField):
+            pos = word_operand(word);
+            num = words[ip + 1];
+            current_frame->ip += 1;
+
+            cache = function->field_caches.data + num;
+            obj = vm->stack[vm->sp - 1];
+            if (obj.type == o_Table && cache->shape
+                    && table_shape(obj.data.table) == cache->shape
+                    && vm->stack[vm->sp - 2].type != o_Nothing) {
+                table_set_field(obj.data.table, cache->index,
+                                vm->stack[vm->sp - 2]);
+                write_barrier(vm, obj);
+                vm->sp -= 2;
+                DISPATCH();
+            }
 
-                err = execute_call(vm, num);
+            err = execute_set_field(vm, constant_objs[pos], cache);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpCall):
+            // num arguments and CallCache index
+            num = word_operand(word);
+            pos = words[ip + 1];
+            current_frame->ip += 1;
+
+            // The cached function was called with [num] arguments before.
+            call_cache = function->call_caches.data + pos;
+            obj = vm->stack[vm->sp - 1];
+            if (obj.type == o_Closure
+                    && obj.data.closure->func == call_cache->function) {
+                vm->sp--;
+                err = enter_closure(vm, obj.data.closure, num);
                 if (err) { return err; };
 
                 current_frame = vm->frames + vm->frames_index;
-                ins = frame_instructions(current_frame);
-                break;
+                function = call_cache->function;
+                words = function->words;
+                RESUME_HOT();
+            }
 
-            case OpRequire:
-                // constants index
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                current_frame->ip += 2;
+            err = execute_call(vm, num);
+            if (err) { return err; };
 
-                err = require_module(vm, constants[pos]);
-                if (err) { return err; }
+            // Builtins return to the next instruction.
+            if (obj.type != o_Closure) {
+                RESUME();
+            }
 
-                err = new_frame(vm);
-                if (err) { return err; }
+            call_cache->function = obj.data.closure->func;
+            current_frame = vm->frames + vm->frames_index;
+            function = call_cache->function;
+            words = function->words;
+            RESUME_HOT();
+
+        CASE_CODE(OpTailCall):
+            // num arguments and CallCache index
+            num = word_operand(word);
+            pos = words[ip + 1];
+            current_frame->ip += 1;
+
+            // Builtins return to the next instruction, which returns.
+            call_cache = function->call_caches.data + pos;
+            obj = vm->stack[vm->sp - 1];
+            if (obj.type == o_Closure) {
+                closure = obj.data.closure;
+                if (closure->func != call_cache->function) {
+                    err = check_num_args(closure->func, num);
+                    if (err) { return err; };
+                    call_cache->function = closure->func;
+                }
+                vm->sp--;
+                err = reenter_closure(vm, closure, num);
+                if (err) { return err; };
 
-                frame_init(vm, OBJ(o_Module, .module = vm->cur_module), vm->sp);
+                function = closure->func;
+                words = function->words;
+                RESUME_HOT();
+            }
 
-                constants = vm->compiler->constants.data; // in case of realloc
-                current_frame = vm->frames + vm->frames_index;
-                globals = current_frame->function.data.module->globals;
-                ins = frame_instructions(current_frame);
-                break;
+            err = execute_call(vm, num);
+            if (err) { return err; };
+            RESUME();
 
-            case OpReturnValue:
-                // return value
-                obj = vm_pop(vm);
+        CASE_CODE(OpRequire):
+            // constants index
+            pos = word_operand(word);
 
-                vm->sp = current_frame->base_pointer;
+            err = require_module(vm, constants[pos]);
+            if (err) { return err; }
 
-#ifdef DEBUG
-                debug_print_return(current_frame->function, vm->stack + vm->sp,
-                                   obj);
-#endif
+            err = new_frame(vm);
+            if (err) { return err; }
 
-                if (current_frame->function.type == o_Module) {
-                    vm->cur_module = vm->cur_module->parent;
-                    if (vm->cur_module) {
-                        globals = vm->cur_module->globals;
-                    } else {
-                        globals = vm->globals;
-                    }
-                }
+            frame_init(vm, OBJ(o_Module, .module = vm->cur_module), vm->sp);
+            err = init_locals(vm, vm->cur_module->main_function, vm->sp);
+            if (err) { return err; }
 
-                current_frame = pop_frame(vm);
-                ins = frame_instructions(current_frame);
+            materialize_constants(vm);
+            constants = vm->compiler->constants.data; // in case of realloc
+            constant_objs = vm->constants;
+            current_frame = vm->frames + vm->frames_index;
+            globals = current_frame->function.data.module->globals;
+            function = vm->cur_module->main_function;
+            words = function->words;
+            RESUME_HOT();
 
-                err = vm_push(vm, obj);
-                if (err) { return err; };
-                break;
+        CASE_CODE(OpReturnValue):
+            // return value
+            obj = vm_pop(vm);
 
-            case OpReturn:
-                vm->sp = current_frame->base_pointer;
+            vm->sp = current_frame->base_pointer;
 
 #ifdef DEBUG
-                debug_print_return(current_frame->function, vm->stack + vm->sp,
-                                   OBJ_NOTHING);
+            debug_print_return(current_frame->function, vm->stack + vm->sp,
+                               obj);
 #endif
 
-                if (current_frame->function.type == o_Module) {
-                    vm->cur_module = vm->cur_module->parent;
-                    if (vm->cur_module) {
-                        globals = vm->cur_module->globals;
-                    } else {
-                        globals = vm->globals;
-                    }
+            if (current_frame->function.type == o_Module) {
+                vm->cur_module = vm->cur_module->parent;
+                if (vm->cur_module) {
+                    globals = vm->cur_module->globals;
+                } else {
+                    globals = vm->globals;
                 }
+            }
 
-                current_frame = pop_frame(vm);
-                ins = frame_instructions(current_frame);
+            current_frame = pop_frame(vm);
+            function = frame_function(current_frame);
+            words = function->words;
 
-                err = vm_push(vm, OBJ_NOTHING);
-                if (err) { return err; };
-                break;
+            vm_push(vm, obj);
+            RESUME();
 
-            case OpSetLocal:
-                // locals index
-                pos = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+        CASE_CODE(OpReturn):
+            vm->sp = current_frame->base_pointer;
 
-                vm->stack[current_frame->base_pointer + pos] = vm_pop(vm);
-                break;
+#ifdef DEBUG
+            debug_print_return(current_frame->function, vm->stack + vm->sp,
+                               OBJ_NOTHING);
+#endif
 
-            case OpGetLocal:
-                // locals index
-                pos = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+            if (current_frame->function.type == o_Module) {
+                vm->cur_module = vm->cur_module->parent;
+                if (vm->cur_module) {
+                    globals = vm->cur_module->globals;
+                } else {
+                    globals = vm->globals;
+                }
+            }
 
-                err = vm_push(vm, vm->stack[current_frame->base_pointer + pos]);
-                if (err) { return err; };
-                break;
+            current_frame = pop_frame(vm);
+            function = frame_function(current_frame);
+            words = function->words;
 
-            case OpGetBuiltin:
-                // builtin fn index
-                pos = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+            vm_push(vm, OBJ_NOTHING);
+            RESUME();
 
-                err = vm_push(vm,
-                        OBJ(o_BuiltinFunction, .builtin = builtins + pos));
-                if (err) { return err; };
-                break;
+        CASE_CODE(OpSetLocal):
+            // locals index
+            pos = word_operand(word);
 
-            case OpClosure:
-                // constant index
-                pos = read_big_endian_uint16(ins.data + ip + 1);
-                // num free variables
-                num = read_big_endian_uint8(ins.data + ip + 3);
-                current_frame->ip += 3;
+            vm->stack[current_frame->base_pointer + pos] = vm_pop(vm);
+            DISPATCH();
 
-                if (constants[pos].type != c_Function) {
-                    return errorf("not a function: constant %d", pos);
-                }
+        CASE_CODE(OpGetLocal):
+            // locals index
+            pos = word_operand(word);
 
-                err = vm_push_closure(vm, constants[pos], num);
-                if (err) { return err; };
-                break;
+            vm_push(vm, vm->stack[current_frame->base_pointer + pos]);
+            DISPATCH();
 
-            case OpGetFree:
-                // free variable index
-                pos = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+        CASE_CODE(OpGetBuiltin):
+            // builtin fn index
+            pos = word_operand(word);
 
-                err = vm_push(vm, current_frame->function.data.closure->free[pos]);
-                if (err) { return err; };
-                break;
-            case OpSetFree:
-                // free variable index
-                pos = read_big_endian_uint8(ins.data + ip + 1);
-                current_frame->ip += 1;
+            vm_push(vm, OBJ(o_BuiltinFunction, .builtin = builtins + pos));
+            DISPATCH();
 
-                current_frame->function.data.closure->free[pos] = vm_pop(vm);
-                break;
+        CASE_CODE(OpClosure):
+            // constant index
+            pos = word_operand(word);
+            // num free variables
+            num = words[ip + 1];
+            current_frame->ip += 1;
 
-            case OpCurrentClosure:
-                err = vm_push(vm, OBJ(o_Closure, .closure = current_frame->function.data.closure));
-                if (err) { return err; };
-                break;
+            if (constants[pos].type != c_Function) {
+                return errorf("not a function: constant %d", pos);
+            }
 
-            default:
-                return errorf("unknown opcode %d", op);
-        }
+            err = vm_push_closure(vm, constants[pos], num);
+            if (err) { return err; };
+            DISPATCH();
+
+        CASE_CODE(OpGetFree):
+            // free variable index
+            pos = word_operand(word);
+
+            vm_push(vm, current_frame->function.data.closure->free[pos]);
+            DISPATCH();
+        CASE_CODE(OpSetFree):
+            // free variable index
+            pos = word_operand(word);
+
+            current_frame->function.data.closure->free[pos] = vm_pop(vm);
+            write_barrier(vm, current_frame->function);
+            DISPATCH();
+
+        CASE_CODE(OpCurrentClosure):
+            vm_push(vm, OBJ(o_Closure, .closure = current_frame->function.data.closure));
+            DISPATCH();
+
+        CASE_CODE(OpHalt):
+            return 0;
+
+        CASE_CODE(OpCallSelf):
+            // num arguments
+            num = word_operand(word);
+
+            // the instructions are the same.
+            err = enter_closure(vm, current_frame->function.data.closure, num);
+            if (err) { return err; };
+
+            current_frame = vm->frames + vm->frames_index;
+            RESUME_HOT();
+
+        CASE_CODE(OpTailCallSelf):
+            // num arguments
+            num = word_operand(word);
+
+            err = reenter_closure(vm, current_frame->function.data.closure,
+                                  num);
+            if (err) { return err; };
+            RESUME_HOT();
+
+        CASE_CODE(OpGetLocal2):
+            // locals indexes
+            pos = word_operand(word);
+            num = words[ip + 1];
+            current_frame->ip += 1;
+
+            vm_push(vm, vm->stack[current_frame->base_pointer + pos]);
+            vm_push(vm, vm->stack[current_frame->base_pointer + num]);
+            DISPATCH();
+
+        CASE_CODE(OpIncrementLocal):
+            // locals index
+            pos = current_frame->base_pointer + word_operand(word);
+            // constant index
+            num = words[ip + 1];
+            current_frame->ip += 1;
+
+            obj = vm->stack[pos];
+            key = constant_objs[num];
+            if (obj.type == o_Integer && key.type == o_Integer
+                    && !__builtin_add_overflow(obj.data.integer,
+                                               key.data.integer,
+                                               &obj.data.integer)) {
+                vm->stack[pos] = obj;
+                DISPATCH();
+            }
+
+            vm_push(vm, vm->stack[pos]);
+            vm_push(vm, key);
+            err = execute_binary_operation(vm, OpAdd);
+            if (err) { return err; };
+            vm->stack[pos] = vm_pop(vm);
+            DISPATCH();
+
+// Pop two Objects, compare them with [operator] if they are both Integers or
+// Floats and with [generic] otherwise, and jump if the comparison is false.
+#define JUMP_UNLESS(generic, operator)                                        \
+    do {                                                                      \
+        pos = word_operand(word);                                             \
+                                                                              \
+        obj = vm->stack[vm->sp - 2];                                          \
+        key = vm->stack[vm->sp - 1];                                          \
+        if (obj.type == o_Integer && key.type == o_Integer) {                 \
+            vm->sp -= 2;                                                      \
+            num = obj.data.integer operator key.data.integer;                 \
+        } else if (obj.type == o_Float && key.type == o_Float) {              \
+            vm->sp -= 2;                                                      \
+            num = obj.data.floating operator key.data.floating;               \
+        } else {                                                              \
+            err = execute_comparison(vm, generic);                            \
+            if (err) { return err; }                                          \
+            num = vm_pop(vm).data.boolean;                                    \
+        }                                                                     \
+                                                                              \
+        if (!num) {                                                           \
+            current_frame->ip = pos - 1;                                      \
+        }                                                                     \
+        DISPATCH();                                                           \
+    } while (0)
+
+        CASE_CODE(OpJumpNotEqual):
+            JUMP_UNLESS(OpEqual, ==);
+        CASE_CODE(OpJumpEqual):
+            JUMP_UNLESS(OpNotEqual, !=);
+        CASE_CODE(OpJumpNotLessThan):
+            JUMP_UNLESS(OpLessThan, <);
+        CASE_CODE(OpJumpNotGreaterThan):
+            JUMP_UNLESS(OpGreaterThan, >);
+#undef JUMP_UNLESS
+
+// Run quickened Opcode [generic] with [execute] if both operands have type
+// [t], otherwise rewrite the instruction back to [generic] and run it again.
+#define QUICKENED(t, generic, execute)                                     \
+    do {                                                                      \
+        obj = vm->stack[vm->sp - 2];                                          \
+        key = vm->stack[vm->sp - 1];                                          \
+        if (obj.type != t || key.type != t) {                                 \
+            words[ip] = word_with_opcode(word, generic);                      \
+            current_frame->ip--;                                              \
+            DISPATCH();                                                       \
+        }                                                                     \
+                                                                              \
+        obj = execute(generic, obj, key);                                     \
+        if (obj.type == o_Error) { return obj.data.err; }                     \
+        vm->stack[vm->sp - 2] = obj;                                          \
+        vm->sp--;                                                             \
+        DISPATCH();                                                           \
+    } while (0)
+
+        CASE_CODE(OpAddInt):
+            QUICKENED(o_Integer, OpAdd, execute_binary_integer_operation);
+        CASE_CODE(OpSubInt):
+            QUICKENED(o_Integer, OpSub, execute_binary_integer_operation);
+        CASE_CODE(OpMulInt):
+            QUICKENED(o_Integer, OpMul, execute_binary_integer_operation);
+        CASE_CODE(OpDivInt):
+            QUICKENED(o_Integer, OpDiv, execute_binary_integer_operation);
+        CASE_CODE(OpEqualInt):
+            QUICKENED(o_Integer, OpEqual, execute_integer_comparison);
+        CASE_CODE(OpNotEqualInt):
+            QUICKENED(o_Integer, OpNotEqual, execute_integer_comparison);
+        CASE_CODE(OpLessThanInt):
+            QUICKENED(o_Integer, OpLessThan, execute_integer_comparison);
+        CASE_CODE(OpGreaterThanInt):
+            QUICKENED(o_Integer, OpGreaterThan, execute_integer_comparison);
+
+        CASE_CODE(OpAddFloat):
+            QUICKENED(o_Float, OpAdd, execute_binary_float_operation);
+        CASE_CODE(OpSubFloat):
+            QUICKENED(o_Float, OpSub, execute_binary_float_operation);
+        CASE_CODE(OpMulFloat):
+            QUICKENED(o_Float, OpMul, execute_binary_float_operation);
+        CASE_CODE(OpDivFloat):
+            QUICKENED(o_Float, OpDiv, execute_binary_float_operation);
+        CASE_CODE(OpEqualFloat):
+            QUICKENED(o_Float, OpEqual, execute_float_comparison);
+        CASE_CODE(OpNotEqualFloat):
+            QUICKENED(o_Float, OpNotEqual, execute_float_comparison);
+        CASE_CODE(OpLessThanFloat):
+            QUICKENED(o_Float, OpLessThan, execute_float_comparison);
+        CASE_CODE(OpGreaterThanFloat):
+            QUICKENED(o_Float, OpGreaterThan, execute_float_comparison);
+#undef QUICKENED
+
+// Run typed Opcode [generic] with [execute], the types of its operands are
+// proven by the Compiler.
+#define TYPED(generic, execute)                                               \
+    do {                                                                      \
+        obj = execute(generic, vm->stack[vm->sp - 2], vm->stack[vm->sp - 1]); \
+        if (obj.type == o_Error) { return obj.data.err; }                     \
+        vm->stack[vm->sp - 2] = obj;                                          \
+        vm->sp--;                                                             \
+        DISPATCH();                                                           \
+    } while (0)
+
+        CASE_CODE(OpIAdd):
+            TYPED(OpAdd, execute_binary_integer_operation);
+        CASE_CODE(OpISub):
+            TYPED(OpSub, execute_binary_integer_operation);
+        CASE_CODE(OpIMul):
+            TYPED(OpMul, execute_binary_integer_operation);
+        CASE_CODE(OpIDiv):
+            TYPED(OpDiv, execute_binary_integer_operation);
+        CASE_CODE(OpIEqual):
+            TYPED(OpEqual, execute_integer_comparison);
+        CASE_CODE(OpINotEqual):
+            TYPED(OpNotEqual, execute_integer_comparison);
+        CASE_CODE(OpILessThan):
+            TYPED(OpLessThan, execute_integer_comparison);
+        CASE_CODE(OpIGreaterThan):
+            TYPED(OpGreaterThan, execute_integer_comparison);
+
+        CASE_CODE(OpFAdd):
+            TYPED(OpAdd, execute_binary_float_operation);
+        CASE_CODE(OpFSub):
+            TYPED(OpSub, execute_binary_float_operation);
+        CASE_CODE(OpFMul):
+            TYPED(OpMul, execute_binary_float_operation);
+        CASE_CODE(OpFDiv):
+            TYPED(OpDiv, execute_binary_float_operation);
+        CASE_CODE(OpFEqual):
+            TYPED(OpEqual, execute_float_comparison);
+        CASE_CODE(OpFNotEqual):
+            TYPED(OpNotEqual, execute_float_comparison);
+        CASE_CODE(OpFLessThan):
+            TYPED(OpLessThan, execute_float_comparison);
+        CASE_CODE(OpFGreaterThan):
+            TYPED(OpGreaterThan, execute_float_comparison);
+#undef TYPED
+
+        CASE_CODE(OpArrayIndex):
+            obj = vm->stack[vm->sp - 2];
+            key = vm->stack[vm->sp - 1];
+            vm->sp -= 2;
+            execute_array_index(vm, obj, key);
+            DISPATCH();
+
+#ifdef COMPUTED_GOTO
+        op_unknown:
+#else
+        default:
+#endif
+            return errorf("unknown opcode %d", op);
     }
-    return 0;
+
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+#undef RESUME
+#undef RESUME_HOT
 }
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
 
 Object vm_last_popped(VM *vm) {
     return vm->stack[vm->sp];
 }
 
 static void
-_print_repeats(int first_idx, int cur_idx) {
+_print_repeats(int first_idx, int cur_idx, FILE *s) {
     int repeats = cur_idx - first_idx - 1;
     if (repeats > 1) {
-        printf("[Previous line repeated %d more times]\n", repeats);
+        fprintf(s, "[Previous line repeated %d more times]\n", repeats);
     }
 }
 
+// Print the line of [node] after the function of a Frame.
+static void
+print_position(Node node, FILE *s) {
+    Token *tok = node_token(node);
+    fprintf(s, ", line %d\n", tok->line);
+    highlight_token(tok, /* leftpad */ 2, s);
+}
+
+// Print the Frames of the calls inlined into [fn], from the outermost to
+// InlineFrame number [frame], which stopped at [node].
+static void
+print_inline_frames(CompiledFunction *fn, int frame, Node node, FILE *s) {
+    InlineFrame *inlined = &fn->inline_frames.data[frame - 1];
+    if (inlined->caller) {
+        print_inline_frames(fn, inlined->caller, inlined->call, s);
+    } else {
+        print_position(inlined->call, s);
+    }
+
+    fprint_function(inlined->function, s);
+    print_position(node, s);
+}
+
 void print_vm_stack_trace(VM *vm, FILE *s) {
+    CompiledFunction *fn = NULL;
     Closure *prev = NULL;
     int prev_ip = -1,
         prev_idx = 0,
@@ -1038,39 +1708,43 @@ void print_vm_stack_trace(VM *vm, FILE *s) {
             continue;
 
         } else {
-            _print_repeats(prev_idx, idx);
+            _print_repeats(prev_idx, idx, s);
 
             // previous Frame if present, stopped at the same position as
             // current.
             Object func = frame.function;
             switch (func.type) {
                 case o_Closure:
-                    mapping = find_mapping(&func.data.closure->func->mappings, frame.ip);
+                    fn = func.data.closure->func;
 
                     prev = func.data.closure;
                     prev_idx = idx;
                     prev_ip = frame.ip;
                     break;
                 case o_Module:
-                    mapping = find_mapping(&func.data.module->main_function->mappings, frame.ip);
+                    fn = func.data.module->main_function;
                     break;
                 default:
                     die("print_vm_stack_trace: Frame should not have function of type %s",
                         show_object_type(func.type));
             }
 
+            // [frame.ip] is the index of a word, see encode_instructions().
+            mapping = find_mapping(&fn->mappings, instruction_position(
+                                       &fn->instructions, frame.ip));
+
         }
 
-        object_fprint(frame.function, stdout);
+        object_fprint(frame.function, s);
 
-        if (mapping) {
-            Token *tok = node_token(mapping->node);
-            fprintf(s, ", line %d\n", tok->line);
-            highlight_token(tok, /* leftpad */ 2, s);
+        if (mapping && mapping->inlined) {
+            print_inline_frames(fn, mapping->inlined, mapping->node, s);
+        } else if (mapping) {
+            print_position(mapping->node, s);
         } else {
             putc('\n', s);
         }
     }
 
-    _print_repeats(prev_idx, idx);
+    _print_repeats(prev_idx, idx, s);
 }
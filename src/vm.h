@@ -3,9 +3,11 @@
 // This module contains the Stack Virtual Machine.
 
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "utils.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // When defined:
@@ -13,24 +15,60 @@
 // - perform checks on stack pointer in vm_pop()
 // #define DEBUG
 
-static const int StackSize = 2048;
-static const int MaxFraxes = 1024;
-
-// from wren: Number of bytes allocated before triggering GC.
-static const int NextGC = 1024;
+// When defined, vm_run() dispatches instructions with computed gotos (labels as
+// values) instead of a switch statement.  Defined by default on compilers that
+// support it, define NO_COMPUTED_GOTO to use the switch statement.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Initial number of Objects in the stack and of Frames.  Both are grown on
+// demand, up to the maximum stack size of the VM, see vm_set_max_stack().
+static const int InitialStackSize = 256;
+static const int InitialFrames = 32;
+static const int DefaultMaxStackSize = 1 << 20;
+
+// Number of calls or loop iterations of a function before it is compiled to
+// machine code, see vm_set_jit().
+static const int DefaultJitThreshold = 1000;
+
+// Garbage collector settings, see allocation.h.  Based on wren's
+// WrenConfiguration.
+typedef struct {
+    // Number of bytes allocated before a minor collection, which only frees
+    // young objects.
+    size_t nursery_size;
+
+    // After a full collection, the next one is run once the old objects have
+    // grown this percent larger than the objects which survived it.
+    int heap_growth_percent;
+
+    // Bounds of the size of old objects which triggers a full collection.  A
+    // [max_heap_size] of 0 means no maximum.  When more than [max_heap_size]
+    // bytes are live, every collection is a full one.
+    size_t min_heap_size;
+    size_t max_heap_size;
+} GCConfig;
+
+static const GCConfig DefaultGCConfig = {
+    .nursery_size = 256 * 1024,
+    .heap_growth_percent = 50,
+    .min_heap_size = 1024 * 1024,
+    .max_heap_size = 0,
+};
 
 // A Function call.
-typedef struct {
+typedef struct Frame {
     Object function;
 
-    int ip; // instruction pointer to bytecode
+    int ip; // instruction pointer to [CompiledFunction.words]
 
     // Points to bottom of stack for current function.
     //
     // When returning to the previous Frame, the stack pointer is set to the
     // this value, removing all arguments, local variables and intermediate
     // objects from scope.
-    short base_pointer;
+    int base_pointer;
 } Frame;
 
 typedef struct VM {
@@ -38,19 +76,49 @@ typedef struct VM {
     Object *stack;
     int sp; // Stack pointer, points to right after the top of stack.
             // The top of stack is `stack[sp-1]`.
+    int stack_capacity;
 
     // The Function call stack.
     Frame *frames;
     int frames_index; // 0-based index of current Frame
+    int frames_capacity;
+
+    // Maximum number of Objects in [stack], and of [frames].
+    int max_stack_size;
+
+    // see vm_set_jit() and vm_set_registers().
+    int jit_threshold;
+    bool registers;
+
+    GCConfig gc;
 
     // The current number of bytes to allocate till before GC is run.
-    int bytesTillGC;
-    struct Allocation *last; // Linked list of all allocated objects.
+    long bytesTillGC;
+
+    // Linked lists of allocated objects, see allocation.h.
+    struct Allocation *young; // allocated since the last collection.
+    struct Allocation *old;   // survived a collection.
+
+    // Old Allocations which may reference young objects.
+    Buffer remembered;
+
+    size_t old_bytes;   // estimated size of old objects.
+    size_t next_full_gc;
 
     // Globals, contains global variables used in `Bytecode`.
     Object *globals;
     int num_globals;
 
+    // Objects of the numbers and strings in the Compilers constants, pushed
+    // by OpConstant.  Each String constant is created once and shared by all
+    // OpConstants that refer to it, Strings are never mutated in place, so
+    // this is never observable.
+    Object *constants;
+    int num_constants;
+
+    // Root of the Shapes of all Tables, see table.h.
+    struct Shape *root_shape;
+
     // Current Module.
     struct Module *cur_module;
     ht *modules;
@@ -62,6 +130,17 @@ typedef struct VM {
 void vm_init(VM *, Compiler *);
 void vm_free(VM *);
 
+// Limit the stack to [max_stack_size] Objects and as many Frames.
+void vm_set_max_stack(VM *, int max_stack_size);
+
+// Compile functions to machine code once they are called, or run an
+// iteration of a loop, [threshold] times, see jit.h.  0 disables the JIT.
+void vm_set_jit(VM *, int threshold);
+
+// Translate hot functions to register-based instructions instead of machine
+// code, see registers.h.
+void vm_set_registers(VM *, bool registers);
+
 error vm_run(VM *vm, Bytecode);
 
 // Last object popped of the stack.
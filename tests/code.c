@@ -14,12 +14,12 @@ void tearDown(void) {}
 void test_make(void) {
     struct Test {
         Instructions actual;
-        uint8_t expected[5]; // NULL-terminated
+        uint8_t expected[8]; // NULL-terminated
     } tests[] = {
-        {make(OpConstant, 65534), {OpConstant, 255, 254}},
+        {make(OpConstant, 131070), {OpConstant, 1, 255, 254}},
         {make(OpAdd), {OpAdd}},
-        {make(OpGetLocal, 255), {OpGetLocal, 255}},
-        {make(OpClosure, 65534, 255), {OpClosure, 255, 254, 255}},
+        {make(OpGetLocal, 16777214), {OpGetLocal, 255, 255, 254}},
+        {make(OpClosure, 131070, 65793), {OpClosure, 1, 255, 254, 1, 1, 1}},
     };
     int tests_len = sizeof(tests) / sizeof(tests[0]);
 
@@ -47,15 +47,15 @@ void test_instructions_string(void) {
     make_into(&test, OpAdd);
     make_into(&test, OpGetLocal, 1);
     make_into(&test, OpConstant, 2);
-    make_into(&test, OpConstant, 65535);
+    make_into(&test, OpConstant, 16777215);
     make_into(&test, OpClosure, 65535, 255);
 
     char *expected_body = "\
 0000 OpAdd\n\
 0001 OpGetLocal 1\n\
-0003 OpConstant 2\n\
-0006 OpConstant 65535\n\
-0009 OpClosure 65535 255\n";
+0005 OpConstant 2\n\
+0009 OpConstant 16777215\n\
+0013 OpClosure 65535 255\n";
 
     char *buf = NULL;
     size_t len;
@@ -86,8 +86,8 @@ void test_read_operands(void) {
         int bytecode[5]; // NULL-terminated
         Instructions actual;
     } tests[] = {
-        _TEST(2, OpConstant, 65535),
-        _TEST(3, OpClosure, 65535, 255),
+        _TEST(3, OpConstant, 16777215),
+        _TEST(6, OpClosure, 65535, 255),
     };
     int length = sizeof(tests) / sizeof(tests[0]);
 
@@ -119,10 +119,54 @@ void test_read_operands(void) {
     if (fail) { TEST_FAIL(); }
 }
 
+void test_encode_instructions(void) {
+    Instructions ins = {0};
+    make_into(&ins, OpGetLocal, 1);
+    make_into(&ins, OpJumpNotTruthy, 15);
+    make_into(&ins, OpClosure, 16777215, 255);
+    make_into(&ins, OpJump, 0);
+    make_into(&ins, OpPop);
+
+    uint32_t *words = encode_instructions(&ins);
+    struct Test {
+        int pos;
+        Opcode op;
+        int operand;
+    } tests[] = {
+        {0, OpGetLocal, 1},
+        {1, OpJumpNotTruthy, 4},
+        {2, OpClosure, 16777215},
+        {4, OpJump, 0},
+        {5, OpPop, 0},
+        {6, OpHalt, 0},
+    };
+    int tests_len = sizeof(tests) / sizeof(tests[0]);
+
+    for (int i = 0; i < tests_len; i++) {
+        struct Test tt = tests[i];
+        TEST_ASSERT_EQUAL_INT(tt.op, word_opcode(words[tt.pos]));
+        TEST_ASSERT_EQUAL_INT(tt.operand, word_operand(words[tt.pos]));
+    }
+    TEST_ASSERT_EQUAL_INT(255, words[3]);
+
+    int *positions = word_positions(&ins);
+    TEST_ASSERT_EQUAL_INT(2, positions[8]);
+    TEST_ASSERT_EQUAL_INT(4, positions[15]);
+    TEST_ASSERT_EQUAL_INT(6, positions[ins.length]);
+    TEST_ASSERT_EQUAL_INT(8, instruction_position(&ins, 2));
+    TEST_ASSERT_EQUAL_INT(8, instruction_position(&ins, 3));
+    TEST_ASSERT_EQUAL_INT(15, instruction_position(&ins, 4));
+
+    free(positions);
+    free(words);
+    free(ins.data);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_make);
     RUN_TEST(test_instructions_string);
     RUN_TEST(test_read_operands);
+    RUN_TEST(test_encode_instructions);
     return UNITY_END();
 }
@@ -11,6 +11,7 @@ error err;
 
 // initialize Program and Compiler.
 static void init(void);
+static void cleanup(void);
 
 static void c_test(char *input, Tests expectedConstants,
                    Instructions expectedInstructions);
@@ -23,12 +24,18 @@ static void c_test_error(const char *input, const char *expected_error);
 
 void test_integer_arithmetic(void) {
     c_test(
-        "1 + 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a + 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpAdd),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpAdd),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
@@ -53,41 +60,64 @@ void test_integer_arithmetic(void) {
         )
     );
     c_test(
-        "1 - 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a - 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpSub),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpSub),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "1 * 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a * 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpMul),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpMul),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "2 / 1",
-        _C( INT(2), INT(1) ),
+        "fn(a) { a / 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpDiv),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpDiv),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "-1",
-        _C( INT(1) ),
+        "fn(a) { -a }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpMinus),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpMinus),
+            make(OpClosure, 0, 0),
             make(OpPop)
         )
     );
@@ -105,71 +135,110 @@ void test_boolean_expressions(void) {
         _I( make(OpFalse), make(OpPop) )
     );
     c_test(
-        "1 > 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a > 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpGreaterThan),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpGreaterThan),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "1 < 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a < 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpLessThan),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpLessThan),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "1 == 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a == 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpEqual),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpEqual),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "1 != 2",
-        _C( INT(1), INT(2) ),
+        "fn(a) { a != 2 }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpNotEqual),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpNotEqual),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
-        "true == false",
-        NO_CONSTANTS,
+        "fn(a) { a == false }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpFalse),
+                make(OpEqual),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpTrue),
-            make(OpFalse),
-            make(OpEqual),
+            make(OpClosure, 0, 0),
             make(OpPop)
         )
     );
     c_test(
-        "true != false",
-        NO_CONSTANTS,
+        "fn(a) { a != false }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpFalse),
+                make(OpNotEqual),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpTrue),
-            make(OpFalse),
-            make(OpNotEqual),
+            make(OpClosure, 0, 0),
             make(OpPop)
         )
     );
     c_test(
-        "!true",
-        NO_CONSTANTS,
+        "fn(a) { !a }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpBang),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            make(OpTrue),
-            make(OpBang),
+            make(OpClosure, 0, 0),
             make(OpPop)
         )
     );
@@ -177,50 +246,84 @@ void test_boolean_expressions(void) {
 
 void test_conditionals(void) {
     c_test(
-        "if (true) { 10 }; 3333;",
-        _C( INT(10), INT(3333) ),
+        "fn(a) { if (a) { 10 }; 3333 }",
+        _C(
+            INT(10), INT(3333),
+            INS(
+                // condition
+                make(OpGetLocal, 0),
+                make(OpJumpNotTruthy, 16),
+
+                // consequence
+                make(OpConstant, 0),
+                // skip alternative
+                make(OpJump, 17),
+
+                // alternative
+                make(OpNothing),
+
+                // end
+                make(OpPop),
+
+                // 3333
+                make(OpConstant, 1),
+                make(OpReturnValue)
+            )
+        ),
         _I(
-            // condition
-            make(OpTrue),
-            make(OpJumpNotTruthy, 10),
+            make(OpClosure, 2, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "fn(a) { if (a) { 10 } else { 20 }; 3333 }",
+        _C(
+            INT(10), INT(20), INT(3333),
+            INS(
+                // condition
+                make(OpGetLocal, 0),
+                make(OpJumpNotTruthy, 16),
 
-            // consequence
-            make(OpConstant, 0),
-            // skip alternative
-            make(OpJump, 11),
+                // consequence
+                make(OpConstant, 0),
+                // skip alternative
+                make(OpJump, 20),
 
-            // alternative
-            make(OpNothing),
+                // alternative
+                make(OpConstant, 1),
 
-            // end
-            make(OpPop),
+                // end
+                make(OpPop),
 
-            // 3333;
-            make(OpConstant, 1),
+                // 3333
+                make(OpConstant, 2),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 3, 0),
             make(OpPop)
         )
     );
+    // a comparison is fused with the jump of a condition, not of a value.
     c_test(
-        "if (true) { 10 } else { 20 }; 3333;",
-        _C( INT(10), INT(20), INT(3333) ),
+        "let a = 1; if (a < 2) { 10 }; a < 2;",
+        _C( INT(1), INT(2), INT(10) ),
         _I(
-            // condition
-            make(OpTrue),
-            make(OpJumpNotTruthy, 10),
-
-            // consequence
             make(OpConstant, 0),
-            // skip alternative
-            make(OpJump, 13),
+            make(OpSetGlobal, 0),
 
-            // alternative
+            make(OpGetGlobal, 0),
             make(OpConstant, 1),
-
-            // end
+            make(OpJumpNotLessThan, 28),
+            make(OpConstant, 2),
+            make(OpJump, 29),
+            make(OpNothing),
             make(OpPop),
 
-            // 3333;
-            make(OpConstant, 2),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 1),
+            make(OpILessThan),
             make(OpPop)
         )
     );
@@ -300,21 +403,17 @@ void test_string_expressions(void) {
     );
     c_test(
         "\"mon\" + \"key\"",
-        _C( STR("mon"), STR("key") ),
+        _C( STR("monkey") ),
         _I(
             make(OpConstant, 0),
-            make(OpConstant, 1),
-            make(OpAdd),
             make(OpPop)
         )
     );
     c_test(
         "\"monkey\" + \"monkey\"",
-        _C( STR("monkey") ),
+        _C( STR("monkeymonkey") ),
         _I(
             make(OpConstant, 0),
-            make(OpConstant, 0),
-            make(OpAdd),
             make(OpPop)
         )
     );
@@ -342,17 +441,11 @@ void test_array_literals(void) {
     );
     c_test(
         "[1 + 2, 3 - 4, 5 * 6]",
-        _C( INT(1), INT(2), INT(3), INT(4), INT(5), INT(6) ),
+        _C( INT(3), INT(-1), INT(30) ),
         _I(
             make(OpConstant, 0),
             make(OpConstant, 1),
-            make(OpAdd),
             make(OpConstant, 2),
-            make(OpConstant, 3),
-            make(OpSub),
-            make(OpConstant, 4),
-            make(OpConstant, 5),
-            make(OpMul),
             make(OpArray, 3),
             make(OpPop)
         )
@@ -384,16 +477,12 @@ void test_table_literals(void) {
     );
     c_test(
         "{1: 2 + 3, 4: 5 * 6}",
-        _C( INT(1), INT(2), INT(3), INT(4), INT(5), INT(6) ),
+        _C( INT(1), INT(5), INT(4), INT(30) ),
         _I(
             make(OpConstant, 0),
             make(OpConstant, 1),
             make(OpConstant, 2),
-            make(OpAdd),
             make(OpConstant, 3),
-            make(OpConstant, 4),
-            make(OpConstant, 5),
-            make(OpMul),
             make(OpTable, 4),
             make(OpPop)
         )
@@ -436,10 +525,8 @@ void test_index_expressions(void) {
             make(OpConstant, 1),
             make(OpConstant, 2),
             make(OpArray, 3),
-            make(OpConstant, 0),
-            make(OpConstant, 0),
-            make(OpAdd),
-            make(OpIndex),
+            make(OpConstant, 1),
+            make(OpArrayIndex),
             make(OpPop)
         )
     );
@@ -450,45 +537,54 @@ void test_index_expressions(void) {
             make(OpConstant, 0),
             make(OpConstant, 1),
             make(OpTable, 2),
-            make(OpConstant, 1),
             make(OpConstant, 0),
-            make(OpSub),
             make(OpIndex),
             make(OpPop)
         )
     );
+    c_test(
+        "let t = {\"a\": 1}; t[\"a\"] = t[\"a\"];",
+        _C( STR("a"), INT(1) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpConstant, 1),
+            make(OpTable, 2),
+            make(OpSetGlobal, 0),
+
+            make(OpGetGlobal, 0),
+            make(OpGetField, 0, 0),
+            make(OpGetGlobal, 0),
+            make(OpSetField, 0, 1)
+        )
+    );
 }
 
 void test_functions(void) {
     c_test(
         "fn() { return 5 + 10 }",
         _C(
-            INT(5), INT(10),
+            INT(15),
             INS(
                 make(OpConstant, 0),
-                make(OpConstant, 1),
-                make(OpAdd),
                 make(OpReturnValue)
             )
         ),
         _I(
-            make(OpClosure, 2, 0),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
     c_test(
         "fn() { 5 + 10 }",
         _C(
-            INT(5), INT(10),
+            INT(15),
             INS(
                 make(OpConstant, 0),
-                make(OpConstant, 1),
-                make(OpAdd),
                 make(OpReturnValue)
             )
         ),
         _I(
-            make(OpClosure, 2, 0),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
@@ -613,7 +709,7 @@ void test_function_calls(void) {
         ),
         _I(
             make(OpClosure, 1, 0),
-            make(OpCall, 0),
+            make(OpCall, 0, 0),
             make(OpPop)
         )
     );
@@ -631,8 +727,8 @@ void test_function_calls(void) {
         _I(
             make(OpClosure, 1, 0),
             make(OpSetGlobal, 0),
-            make(OpGetGlobal, 0),
-            make(OpCall, 0),
+            // inlined
+            make(OpConstant, 0),
             make(OpPop)
         )
     );
@@ -651,8 +747,10 @@ void test_function_calls(void) {
             make(OpClosure, 0, 0),
             make(OpSetGlobal, 0),
             make(OpConstant, 1),
-            make(OpGetGlobal, 0),
-            make(OpCall, 1),
+            make(OpSetGlobal, 1),
+            make(OpGetGlobal, 1),
+            make(OpNothing),
+            make(OpSetGlobal, 1),
             make(OpPop)
         )
     );
@@ -679,23 +777,53 @@ void test_function_calls(void) {
             make(OpConstant, 1),
             make(OpConstant, 2),
             make(OpConstant, 3),
-            make(OpGetGlobal, 0),
-            make(OpCall, 3),
+            make(OpSetGlobal, 3),
+            make(OpSetGlobal, 2),
+            make(OpSetGlobal, 1),
+            make(OpGetGlobal, 1),
+            make(OpPop),
+            make(OpGetGlobal, 2),
+            make(OpPop),
+            make(OpGetGlobal, 3),
+            make(OpNothing),
+            make(OpSetGlobal, 1),
+            make(OpNothing),
+            make(OpSetGlobal, 2),
+            make(OpNothing),
+            make(OpSetGlobal, 3),
             make(OpPop)
         )
     );
-}
-
-void test_let_statements_scopes(void) {
     c_test(
-        "\
-            let num = 55;\
-            fn() { num }\
-        ",
+        "fn(f) { f(24, 25) }",
         _C(
-            INT(55),
+            INT(24),
+            INT(25),
             INS(
-                make(OpGetGlobal, 0),
+                make(OpConstant, 0),
+                make(OpConstant, 1),
+                make(OpGetLocal, 0),
+                make(OpTailCall, 2, 0),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 2, 0),
+            make(OpPop)
+        )
+    );
+}
+
+void test_let_statements_scopes(void) {
+    c_test(
+        "\
+            let num = 55;\
+            fn() { num }\
+        ",
+        _C(
+            INT(55),
+            INS(
+                make(OpGetGlobal, 0),
                 make(OpReturnValue)
             )
         ),
@@ -742,9 +870,8 @@ void test_let_statements_scopes(void) {
                 make(OpSetLocal, 0),
                 make(OpConstant, 1),
                 make(OpSetLocal, 1),
-                make(OpGetLocal, 0),
-                make(OpGetLocal, 1),
-                make(OpAdd),
+                make(OpGetLocal2, 0, 1),
+                make(OpIAdd),
                 make(OpReturnValue)
             )
         ),
@@ -765,12 +892,12 @@ void test_builtins(void) {
         _I(
             make(OpArray, 0),
             make(OpGetBuiltin, 0),
-            make(OpCall, 1),
+            make(OpCall, 1, 0),
             make(OpPop),
             make(OpArray, 0),
             make(OpConstant, 0),
             make(OpGetBuiltin, 5),
-            make(OpCall, 2),
+            make(OpCall, 2, 1),
             make(OpPop)
         )
     );
@@ -780,7 +907,7 @@ void test_builtins(void) {
             INS(
                 make(OpArray, 0),
                 make(OpGetBuiltin, 0),
-                make(OpCall, 1),
+                make(OpTailCall, 1, 0),
                 make(OpReturnValue)
             )
         ),
@@ -880,7 +1007,7 @@ void test_closures(void) {
                 make(OpSetLocal, 0),
                 make(OpGetGlobal, 0),
                 make(OpGetFree, 1),
-                make(OpAdd),
+                make(OpIAdd),
                 make(OpGetFree, 0),
                 make(OpAdd),
                 make(OpGetLocal, 0),
@@ -924,8 +1051,7 @@ void test_recursive_functions(void) {
                 make(OpGetLocal, 0),
                 make(OpConstant, 0),
                 make(OpSub),
-                make(OpCurrentClosure),
-                make(OpCall, 1),
+                make(OpTailCallSelf, 1),
                 make(OpReturnValue)
             )
         ),
@@ -934,7 +1060,7 @@ void test_recursive_functions(void) {
             make(OpSetGlobal, 0),
             make(OpConstant, 0),
             make(OpGetGlobal, 0),
-            make(OpCall, 1),
+            make(OpCall, 1, 0),
             make(OpPop)
         )
     );
@@ -952,8 +1078,7 @@ void test_recursive_functions(void) {
                 make(OpGetLocal, 0),
                 make(OpConstant, 0),
                 make(OpSub),
-                make(OpCurrentClosure),
-                make(OpCall, 1),
+                make(OpTailCallSelf, 1),
                 make(OpReturnValue)
             ),
             INS(
@@ -961,15 +1086,21 @@ void test_recursive_functions(void) {
                 make(OpSetLocal, 0),
                 make(OpConstant, 0),
                 make(OpGetLocal, 0),
-                make(OpCall, 1),
+                make(OpTailCall, 1, 0),
                 make(OpReturnValue)
             )
         ),
         _I(
             make(OpClosure, 2, 0),
             make(OpSetGlobal, 0),
-            make(OpGetGlobal, 0),
-            make(OpCall, 0),
+            // inlined
+            make(OpClosure, 1, 0),
+            make(OpSetGlobal, 1),
+            make(OpConstant, 0),
+            make(OpGetGlobal, 1),
+            make(OpCall, 1, 0),
+            make(OpNothing),
+            make(OpSetGlobal, 1),
             make(OpPop)
         )
     );
@@ -1042,7 +1173,7 @@ void test_assignments(void) {
                 make(OpSetLocal, 0),
                 make(OpGetLocal, 0),
                 make(OpConstant, 1),
-                make(OpMul),
+                make(OpIMul),
                 make(OpSetLocal, 0),
                 make(OpGetLocal, 0),
                 make(OpReturnValue)
@@ -1078,7 +1209,7 @@ void test_operator_assignments(void) {
 
             make(OpGetGlobal, 0),
             make(OpConstant, 1),
-            make(OpAdd),
+            make(OpIAdd),
             make(OpSetGlobal, 0)
         )
     );
@@ -1095,7 +1226,7 @@ void test_operator_assignments(void) {
 
             make(OpGetGlobal, 0),
             make(OpConstant, 1),
-            make(OpIndex),
+            make(OpArrayIndex),
             make(OpConstant, 2),
             make(OpAdd),
             make(OpGetGlobal, 0),
@@ -1131,22 +1262,17 @@ void test_return_statements(void) {
     c_test(
         "fn() { if (true) { return; } else { 20 }; 3333; }",
         _C(
-            INT(20),
             INT(3333),
             INS(
-                make(OpTrue),
-                make(OpJumpNotTruthy, 9),
                 make(OpReturn),
                 make(OpNothing),
-                make(OpJump, 12),
-                make(OpConstant, 0),
                 make(OpPop),
-                make(OpConstant, 1),
+                make(OpConstant, 0),
                 make(OpReturnValue)
             )
         ),
         _I(
-            make(OpClosure, 2, 0),
+            make(OpClosure, 1, 0),
             make(OpPop)
         )
     );
@@ -1170,24 +1296,23 @@ void test_loops(void) {
             // condition
             make(OpGetGlobal, 0),   // i < 5;
             make(OpConstant, 1),
-            make(OpLessThan),
 
-            make(OpJumpNotTruthy, 40), // to after loop
+            make(OpJumpNotLessThan, 57), // to after loop
 
             // body
             make(OpConstant, 2),    // puts(...)
             make(OpGetGlobal, 0),
             make(OpGetBuiltin, 1),
-            make(OpCall, 2),
+            make(OpCall, 2, 0),
             make(OpPop),
 
             // update
             make(OpGetGlobal, 0),   // i += 1;
             make(OpConstant, 3),
-            make(OpAdd),
+            make(OpIAdd),
             make(OpSetGlobal, 0),
 
-            make(OpJump, 6) // to condition
+            make(OpJump, 8) // to condition
         )
     );
     c_test(
@@ -1201,14 +1326,11 @@ void test_loops(void) {
             // start
 
             // condition
-            make(OpTrue),
-
-            make(OpJumpNotTruthy, 15), // to after loop
 
             // body
             make(OpConstant, 0),
             make(OpGetBuiltin, 1),
-            make(OpCall, 1),
+            make(OpCall, 1, 0),
             make(OpPop),
 
             // update
@@ -1225,14 +1347,11 @@ void test_loops(void) {
         _C( STR("i") ),
         _I(
             // condition
-            make(OpTrue),
-
-            make(OpJumpNotTruthy, 15), // to after loop
 
             // body
             make(OpConstant, 0),
             make(OpGetBuiltin, 1),
-            make(OpCall, 1),
+            make(OpCall, 1, 0),
             make(OpPop),
 
             make(OpJump, 0) // to condition
@@ -1256,34 +1375,30 @@ void test_loops(void) {
             make(OpSetGlobal, 0),
 
             // condition
-            make(OpTrue),
-
-            make(OpJumpNotTruthy, 45), // to after loop
 
             // body
             // if statement
             make(OpGetGlobal, 0), // i > 5
             make(OpConstant, 1),
-            make(OpGreaterThan),
-            make(OpJumpNotTruthy, 27),
+            make(OpJumpNotGreaterThan, 29),
 
             // if statement consequence
-            make(OpJump, 45), // break
+            make(OpJump, 52), // break
             make(OpNothing),
-            make(OpJump, 31),
+            make(OpJump, 34),
 
             // if statement alternative
-            make(OpJump, 32), // continue
+            make(OpJump, 35), // continue
             make(OpNothing),
             make(OpPop),
 
             // update
             make(OpGetGlobal, 0), // i += 1;
             make(OpConstant, 2),
-            make(OpAdd),
+            make(OpIAdd),
             make(OpSetGlobal, 0),
 
-            make(OpJump, 6) // to condition
+            make(OpJump, 8) // to condition
         )
     );
     c_test(
@@ -1304,31 +1419,26 @@ void test_loops(void) {
             make(OpSetGlobal, 0),
 
             // outer loop condition
-            make(OpTrue),
-            make(OpJumpNotTruthy, 52), // to after outer loop
 
             // outer loop body
             // if statement
             make(OpGetGlobal, 0), // i > 5
             make(OpConstant, 1),
-            make(OpGreaterThan),
-            make(OpJumpNotTruthy, 37),
+            make(OpJumpNotGreaterThan, 37),
 
             // if statement consequence
             // inner loop start
 
             // inner loop condition
-            make(OpTrue),
-            make(OpJumpNotTruthy, 30), // to after inner loop
 
             // inner loop body
-            make(OpJump, 30), // break inner loop
+            make(OpJump, 28), // break inner loop
             make(OpJump, 20), // to inner loop condition
 
             // inner loop update
             // inner loop end
 
-            make(OpJump, 52), // break outer loop
+            make(OpJump, 56), // break outer loop
             make(OpNothing),
             make(OpJump, 38), // if statement alternative
             make(OpNothing),
@@ -1337,10 +1447,10 @@ void test_loops(void) {
             // outer loop update
             make(OpGetGlobal, 0), // i += 1;
             make(OpConstant, 2),
-            make(OpAdd),
+            make(OpIAdd),
             make(OpSetGlobal, 0),
 
-            make(OpJump, 6) // to outer loop condition
+            make(OpJump, 8) // to outer loop condition
             // outer loop end
         )
     );
@@ -1364,6 +1474,549 @@ void test_loops(void) {
     );
 }
 
+void test_constant_folding(void) {
+    c_test(
+        "1 + 2; 1 - 2; 1 * 2; 2 / 1; -1",
+        _C( INT(3), INT(-1), INT(2) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpPop),
+            make(OpConstant, 1),
+            make(OpPop),
+            make(OpConstant, 2),
+            make(OpPop),
+            make(OpConstant, 2),
+            make(OpPop),
+            make(OpConstant, 1),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "1 > 2; 1 < 2; 1 == 2; 1 != 2; true == false; true != false; !true",
+        NO_CONSTANTS,
+        _I(
+            make(OpFalse),
+            make(OpPop),
+            make(OpTrue),
+            make(OpPop),
+            make(OpFalse),
+            make(OpPop),
+            make(OpTrue),
+            make(OpPop),
+            make(OpFalse),
+            make(OpPop),
+            make(OpTrue),
+            make(OpPop),
+            make(OpFalse),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "(10 / 2) * 5 + 30 > 54 == !nothing",
+        NO_CONSTANTS,
+        _I( make(OpTrue), make(OpPop) )
+    );
+    c_test(
+        "\"a\" + \"b\" + \"c\"",
+        _C( STR("abc") ),
+        _I( make(OpConstant, 0), make(OpPop) )
+    );
+    c_test(
+        "let a = 1; a - 2 * 3",
+        _C( INT(1), INT(6) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 1),
+            make(OpISub),
+            make(OpPop)
+        )
+    );
+
+    // errors are left to the VM.
+    c_test(
+        "9223372036854775807 + 1",
+        _C( INT(9223372036854775807), INT(1) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpConstant, 1),
+            make(OpIAdd),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "1 / (2 - 2)",
+        _C( INT(1), INT(0) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpConstant, 1),
+            make(OpIDiv),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "1 < \"a\"",
+        _C( INT(1), STR("a") ),
+        _I(
+            make(OpConstant, 0),
+            make(OpConstant, 1),
+            make(OpLessThan),
+            make(OpPop)
+        )
+    );
+}
+
+void test_dead_code_elimination(void) {
+    // the constants of dead code are removed.
+    c_test(
+        "if (true) { 10 }; 3333;",
+        _C( INT(10), INT(3333) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpPop),
+            make(OpConstant, 1),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "if (true) { 10 } else { 20 }; 3333;",
+        _C( INT(10), INT(3333) ),
+        _I(
+            make(OpConstant, 0),
+            make(OpPop),
+            make(OpConstant, 1),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "if (1 > 2) { 10 } else { 20 }",
+        _C( INT(20) ),
+        _I( make(OpConstant, 0), make(OpPop) )
+    );
+    c_test(
+        "while (false) { puts(1) }; 2",
+        _C( INT(2) ),
+        _I( make(OpConstant, 0), make(OpPop) )
+    );
+    c_test(
+        "fn() { return 1; 2 }",
+        _C(
+            INT(1),
+            INS(
+                make(OpConstant, 0),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 1, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "if (false) { fn() { 1 } }; 2",
+        _C( INT(2) ),
+        _I(
+            make(OpNothing),
+            make(OpPop),
+            make(OpConstant, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "for (;;) { break; puts(1) }",
+        NO_CONSTANTS,
+        _I(
+            make(OpJump, 8), // break
+            make(OpJump, 0)  // to condition
+        )
+    );
+
+    // dead code is still compiled, its variables are defined.
+    c_test(
+        "if (false) { let x = 1 }; x",
+        NO_CONSTANTS,
+        _I(
+            make(OpNothing),
+            make(OpPop),
+            make(OpGetGlobal, 0),
+            make(OpPop)
+        )
+    );
+    c_test_error("if (false) { x }", "undefined variable 'x'");
+}
+
+void test_inlining(void) {
+    c_test(
+        "fn() { let double = fn(x) { x * 2 }; double(3) }",
+        _C(
+            INT(2),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpConstant, 0),
+                make(OpMul),
+                make(OpReturnValue)
+            ),
+            INT(3),
+            INS(
+                make(OpClosure, 1, 0),
+                make(OpSetLocal, 0),
+                make(OpConstant, 2),
+                make(OpSetLocal, 1), // x of double
+                make(OpGetLocal, 1),
+                make(OpConstant, 0),
+                make(OpMul),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 3, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "let max = fn(a, b) { if (a > b) { a } else { b } }; max(1, 2)",
+        _C(
+            INS(
+                make(OpGetLocal2, 0, 1),
+                make(OpJumpNotGreaterThan, 19),
+                make(OpGetLocal, 0),
+                make(OpJump, 23),
+                make(OpGetLocal, 1),
+                make(OpReturnValue)
+            ),
+            INT(1),
+            INT(2)
+        ),
+        _I(
+            make(OpClosure, 0, 0),
+            make(OpSetGlobal, 0),
+            make(OpConstant, 1),
+            make(OpConstant, 2),
+            make(OpSetGlobal, 2),
+            make(OpSetGlobal, 1),
+            make(OpGetGlobal, 1),
+            make(OpGetGlobal, 2),
+            make(OpJumpNotGreaterThan, 47),
+            make(OpGetGlobal, 1),
+            make(OpJump, 51),
+            make(OpGetGlobal, 2),
+            make(OpNothing),
+            make(OpSetGlobal, 1),
+            make(OpNothing),
+            make(OpSetGlobal, 2),
+            make(OpPop)
+        )
+    );
+
+    // not inlined: reassigned, wrong number of arguments, free variables.
+    c_test(
+        "let f = fn() { 1 }; f = f; f()",
+        _C(
+            INT(1),
+            INS(
+                make(OpConstant, 0),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 1, 0),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpCall, 0, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "let f = fn(x) { x }; f()",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 0, 0),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpCall, 0, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "fn(a) { let f = fn() { a }; f() }",
+        _C(
+            INS(
+                make(OpGetFree, 0),
+                make(OpReturnValue)
+            ),
+            INS(
+                make(OpGetLocal, 0),
+                make(OpClosure, 0, 1),
+                make(OpSetLocal, 1),
+                make(OpGetLocal, 1),
+                make(OpTailCall, 0, 0),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 1, 0),
+            make(OpPop)
+        )
+    );
+}
+
+void test_call_caches(void) {
+    c_test(
+        "fn(f) { f(1); f(2) }",
+        _C(
+            INT(1),
+            INT(2),
+            INS(
+                make(OpConstant, 0),
+                make(OpGetLocal, 0),
+                make(OpCall, 1, 0),
+                make(OpPop),
+                make(OpConstant, 1),
+                make(OpGetLocal, 0),
+                make(OpTailCall, 1, 1),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 2, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "let f = fn(n) { f(n) + f() }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpCallSelf, 1),
+                // wrong number of arguments
+                make(OpCurrentClosure),
+                make(OpCall, 0, 1),
+                make(OpAdd),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 0, 0),
+            make(OpSetGlobal, 0)
+        )
+    );
+}
+
+void test_type_inference(void) {
+    c_test(
+        "let n = len([]); n * 2; n * 2.5",
+        _C( INT(2), FLOAT(2.5) ),
+        _I(
+            make(OpArray, 0),
+            make(OpGetBuiltin, 0),
+            make(OpCall, 1, 0),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 0),
+            make(OpIMul),
+            make(OpPop),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 1),
+            make(OpMul),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "fn(a) {"
+        "   let s = 0.5;"
+        "   for (let i = 0; i < len(a); i += 1) { s = s * 2. }"
+        "}",
+        _C(
+            FLOAT(0.5),
+            INT(0),
+            FLOAT(2.0),
+            INT(1),
+            INS(
+                make(OpConstant, 0),
+                make(OpSetLocal, 1),
+                make(OpConstant, 1),
+                make(OpSetLocal, 2),
+                make(OpGetLocal2, 2, 0),
+                make(OpGetBuiltin, 0),
+                make(OpCall, 1, 0),
+                make(OpJumpNotLessThan, 62),
+                make(OpGetLocal, 1),
+                make(OpConstant, 2),
+                make(OpFMul),
+                make(OpSetLocal, 1),
+                make(OpIncrementLocal, 2, 3),
+                make(OpJump, 16),
+                make(OpReturn)
+            )
+        ),
+        _I(
+            make(OpClosure, 4, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "fn() { let a = [1]; let i = 0; a[i] = a[i] - i; }",
+        _C(
+            INT(1),
+            INT(0),
+            INS(
+                make(OpConstant, 0),
+                make(OpArray, 1),
+                make(OpSetLocal, 0),
+                make(OpConstant, 1),
+                make(OpSetLocal, 1),
+                make(OpGetLocal2, 0, 1),
+                make(OpArrayIndex),
+                make(OpGetLocal, 1),
+                make(OpSub),
+                make(OpGetLocal2, 0, 1),
+                make(OpSetIndex),
+                make(OpReturn)
+            )
+        ),
+        _I(
+            make(OpClosure, 2, 0),
+            make(OpPop)
+        )
+    );
+
+    // unknown: assigned a value of another type, defined in a block, assigned
+    // in a nested function.
+    c_test(
+        "let a = 1; a = \"a\"; a + a",
+        _C( INT(1), STR("a") ),
+        _I(
+            make(OpConstant, 0),
+            make(OpSetGlobal, 0),
+            make(OpConstant, 1),
+            make(OpSetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpGetGlobal, 0),
+            make(OpAdd),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "if (len([])) { let a = 1 }; a + 1",
+        _C( INT(1) ),
+        _I(
+            make(OpArray, 0),
+            make(OpGetBuiltin, 0),
+            make(OpCall, 1, 0),
+            make(OpJumpNotTruthy, 32),
+            make(OpConstant, 0),
+            make(OpSetGlobal, 0),
+            make(OpNothing),
+            make(OpJump, 33),
+            make(OpNothing),
+            make(OpPop),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 0),
+            make(OpAdd),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "let a = 1; let f = fn() { a = 2 }; a + 1",
+        _C(
+            INT(1),
+            INT(2),
+            INS(
+                make(OpConstant, 1),
+                make(OpSetGlobal, 0),
+                make(OpReturn)
+            )
+        ),
+        _I(
+            make(OpConstant, 0),
+            make(OpSetGlobal, 0),
+            make(OpClosure, 2, 0),
+            make(OpSetGlobal, 1),
+            make(OpGetGlobal, 0),
+            make(OpConstant, 0),
+            make(OpAdd),
+            make(OpPop)
+        )
+    );
+}
+
+void test_superinstructions(void) {
+    c_test(
+        "fn(n) { let i = 0; while (i < n) { i += 1 }; i }",
+        _C(
+            INT(0), INT(1),
+            INS(
+                make(OpConstant, 0),        // let i = 0;
+                make(OpSetLocal, 1),
+
+                make(OpGetLocal2, 1, 0),    // i < n
+                make(OpJumpNotLessThan, 30),
+
+                make(OpIncrementLocal, 1, 1), // i += 1
+                make(OpJump, 8),
+
+                make(OpGetLocal, 1),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 2, 0),
+            make(OpPop)
+        )
+    );
+    // the second OpGetLocal b is a jump target.
+    c_test(
+        "fn(a, b) { (if (a) { a } else { b }) + b }",
+        _C(
+            INS(
+                make(OpGetLocal, 0),
+                make(OpJumpNotTruthy, 16),
+                make(OpGetLocal, 0),
+                make(OpJump, 20),
+                make(OpGetLocal, 1),
+                make(OpGetLocal, 1),
+                make(OpAdd),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 0, 0),
+            make(OpPop)
+        )
+    );
+    c_test(
+        "fn(a, b) { a = b + 1; if (a != b) { 1 } }",
+        _C(
+            INT(1),
+            INS(
+                make(OpGetLocal, 1),        // a = b + 1;
+                make(OpConstant, 0),
+                make(OpAdd),
+                make(OpSetLocal, 0),
+
+                make(OpGetLocal2, 0, 1),    // a != b
+                make(OpJumpEqual, 32),
+                make(OpConstant, 0),
+                make(OpJump, 33),
+                make(OpNothing),
+                make(OpReturnValue)
+            )
+        ),
+        _I(
+            make(OpClosure, 1, 0),
+            make(OpPop)
+        )
+    );
+}
+
 void test_source_mappings(void) {
     char *input = "\
     let a = 0;\n\
@@ -1371,49 +2024,59 @@ void test_source_mappings(void) {
     1 + 2 * a;\n\
     let func = fn(a) { a + 24 };\n\
     puts(type(func), \"func(10):\", func(10));\n\
-    a = !true == !(false == true);\n\
+    a = !a == !(false == a);\n\
     for (let i = 0; i < 5; i += 1) {}\n\
     ";
 
-    SourceMapping exp_mappings[] = {
+    struct {
+        int position;
+        Node node;
+    } exp_mappings[] = {
         { 0, NODE(n_Identifier, NULL) },            // let a = 0;
-        { 12, NODE(n_OperatorAssignment, NULL) },   // a += 2;
-        { 13, NODE(n_OperatorAssignment, NULL) },
+        { 16, NODE(n_OperatorAssignment, NULL) },   // a += 2;
+        { 17, NODE(n_OperatorAssignment, NULL) },
 
-        { 16, NODE(n_ExpressionStatement, NULL) },  // 1 + 2 * a;
-        { 25, NODE(n_InfixExpression, NULL) },      // 1 + 2 * a;
+        { 21, NODE(n_ExpressionStatement, NULL) },  // 1 + 2 * a;
+        { 33, NODE(n_InfixExpression, NULL) },      // 1 + 2 * a;
         //                                                   ^
-        { 26, NODE(n_InfixExpression, NULL) },      // 1 + 2 * a;
+        { 34, NODE(n_InfixExpression, NULL) },      // 1 + 2 * a;
         //                                               ^
 
-        { 28, NODE(n_Identifier, NULL) },           // let func = fn(a) { a + 24 };
-        { 35, NODE(n_ExpressionStatement, NULL) },  // puts(type(func), "func(10):", func(10));
-        { 40, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
-        //                                                  ^^^^
-        { 51, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
-        //                                                                           ^^^^
+        { 36, NODE(n_Identifier, NULL) },           // let func = fn(a) { a + 24 };
+        { 47, NODE(n_ExpressionStatement, NULL) },  // puts(type(func), "func(10):", func(10));
         { 55, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
+        //                                                  ^^^^
+        { 70, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
+        //                                                                           ^^^^^^^^
+        // inlined instructions of func
+        { 74, NODE(n_ExpressionStatement, NULL) },  // let func = fn(a) { a + 24 };
+        //                                                                   ^
+        { 82, NODE(n_InfixExpression, NULL) },      // let func = fn(a) { a + 24 };
+        //                                                                   ^
+        { 88, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
+        //                                                                           ^^^^^^^^
+        { 92, NODE(n_CallExpression, NULL) },       // puts(type(func), "func(10):", func(10));
         //                                             ^^^^
 
-        { 59, NODE(n_PrefixExpression, NULL) },     // a = !true == !(false == true);
+        { 104, NODE(n_PrefixExpression, NULL) },    // a = !a == !(false == a);
         //                                                 ^
-        { 62, NODE(n_InfixExpression, NULL) },      // a = !true == !(false == true);
-        //                                                                  ^^
-        { 63, NODE(n_PrefixExpression, NULL) },     // a = !true == !(false == true);
-        //                                                          ^
-        { 64, NODE(n_InfixExpression, NULL) },      // a = !true == !(false == true);
-        //                                                       ^^
-        { 65, NODE(n_Assignment, NULL) },           // a = !true == !(false == true);
+        { 110, NODE(n_InfixExpression, NULL) },     // a = !a == !(false == a);
+        //                                                               ^^
+        { 111, NODE(n_PrefixExpression, NULL) },    // a = !a == !(false == a);
+        //                                                       ^
+        { 112, NODE(n_InfixExpression, NULL) },     // a = !a == !(false == a);
+        //                                                    ^^
+        { 113, NODE(n_Assignment, NULL) },          // a = !a == !(false == a);
         //                                               ^
 
-        { 68, NODE(n_LoopStatement, NULL) },        // for (let i = 0; i < 5; i += 1) {}
-        { 68, NODE(n_Identifier, NULL) },           // for (let i = 0; i < 5; i += 1) {}
+        { 117, NODE(n_LoopStatement, NULL) },       // for (let i = 0; i < 5; i += 1) {}
+        { 117, NODE(n_Identifier, NULL) },          // for (let i = 0; i < 5; i += 1) {}
         //                                                  ^^^
-        { 80, NODE(n_InfixExpression, NULL) },      // for (let i = 0; i < 5; i += 1) {}
+        { 133, NODE(n_InfixExpression, NULL) },     // for (let i = 0; i < 5; i += 1) {}
         //                                                               ^
-        { 90, NODE(n_OperatorAssignment, NULL) },   // for (let i = 0; i < 5; i += 1) {}
+        { 145, NODE(n_OperatorAssignment, NULL) },  // for (let i = 0; i < 5; i += 1) {}
         //                                                                      ^^
-        { 91, NODE(n_OperatorAssignment, NULL) },
+        { 146, NODE(n_OperatorAssignment, NULL) },
     };
     int len = sizeof(exp_mappings) / sizeof(exp_mappings[0]);
 
@@ -1453,6 +2116,39 @@ void test_source_mappings(void) {
                     exp_mappings[i].node.typ, mappings[i].node.typ);
             TEST_FAIL();
         }
+
+        // the mappings of func are in the InlineFrame of its call.
+        int inlined = mappings[i].position == 74 || mappings[i].position == 82;
+        TEST_ASSERT_EQUAL_INT(inlined, mappings[i].inlined);
+    }
+    TEST_ASSERT_EQUAL_INT(1, main_fn->inline_frames.length);
+    TEST_ASSERT_EQUAL_INT(0, main_fn->inline_frames.data[0].caller);
+}
+
+void test_max_stack(void) {
+    struct { char *input; int main_max, function_max; } tests[] = {
+        { "1; 2; 3", 1, -1 },
+        { "[1, 2, [3, 4]]", 4, -1 },
+        { "let a = {\"x\": 1}; a[\"x\"]", 2, -1 },
+        { "fn(a, b) { let c = a + b; if (c) { [a, b, c] } else { 1 } }", 1, 3 },
+        { "fn() { for (let i = 0; i < 10; i += 1) { puts(i, i * 2); }; }", 1, 3 },
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        init();
+        prog = parse_(tests[i].input);
+        err = compile(&c, &prog, 0);
+        TEST_ASSERT_NULL_MESSAGE(err, tests[i].input);
+
+        TEST_ASSERT_EQUAL_INT_MESSAGE(tests[i].main_max,
+                bytecode(&c).main_function->max_stack, tests[i].input);
+        for (int j = 0; j < c.constants.length; j++) {
+            if (c.constants.data[j].type == c_Function) {
+                TEST_ASSERT_EQUAL_INT_MESSAGE(tests[i].function_max,
+                        c.constants.data[j].data.function->max_stack,
+                        tests[i].input);
+            }
+        }
+        cleanup();
     }
 }
 
@@ -1713,7 +2409,14 @@ int main(void) {
     RUN_TEST(test_operator_assignments);
     RUN_TEST(test_return_statements);
     RUN_TEST(test_loops);
+    RUN_TEST(test_constant_folding);
+    RUN_TEST(test_dead_code_elimination);
+    RUN_TEST(test_inlining);
+    RUN_TEST(test_call_caches);
+    RUN_TEST(test_type_inference);
+    RUN_TEST(test_superinstructions);
     RUN_TEST(test_source_mappings);
+    RUN_TEST(test_max_stack);
     RUN_TEST(test_modules);
     return UNITY_END();
 }
@@ -25,7 +25,7 @@ void tearDown(void) {
 
 static void
 test_table_set_get(void) {
-    CharBuffer *string = &(CharBuffer){ .data = "test"};
+    CharBuffer *string = &(CharBuffer){ .data = "test", .length = 4 };
     Object objs[] = {
         // These have the same ObjectData
         OBJ(o_Integer, 1), OBJ(o_Boolean, true),
@@ -57,7 +57,7 @@ test_table_set_get(void) {
 static void
 test_table_iterator_and_expand(void) {
     int i,
-        num = 129; // This should call table_expand() three times.
+        num = 129; // This should call table_rehash() four times.
 
     for (i = 0; i < num; i++) {
         expect_set(OBJ(o_Integer, i), OBJ(o_Integer, i));
@@ -140,6 +140,252 @@ test_table_remove(void) {
     }
 }
 
+// Keys are compared by value, not only by hash.
+static void
+test_table_key_equality(void) {
+    CharBuffer *a = &(CharBuffer){ .data = "key", .length = 3 },
+               *b = &(CharBuffer){ .data = strdup("key"), .length = 3 },
+               *c = &(CharBuffer){ .data = "kez", .length = 3 };
+
+    expect_set(OBJ(o_String, .string = a), OBJ(o_Integer, 1));
+    expect_get(OBJ(o_String, .string = b), OBJ(o_Integer, 1));
+    expect_get(OBJ(o_String, .string = c), OBJ_NOTHING);
+    free(b->data);
+
+    expect_set(OBJ(o_Float, .floating = 0.0), OBJ(o_Integer, 2));
+    expect_get(OBJ(o_Float, .floating = -0.0), OBJ_NOTHING);
+    expect_get(OBJ(o_Integer, 0), OBJ_NOTHING);
+
+    // different keys with the same hash.
+    for (int i = 0; i < 40; i++) {
+        Object res = table_set_hash(&tbl, OBJ(o_Integer, 1000 + i),
+                OBJ(o_Integer, i), 42);
+        TEST_ASSERT(res.type == o_Integer);
+    }
+    for (int i = 0; i < 40; i++) {
+        Object res = table_get_hash(&tbl, OBJ(o_Integer, 1000 + i), 42);
+        TEST_ASSERT(res.type == o_Integer && res.data.integer == i);
+    }
+    TEST_ASSERT(table_get_hash(&tbl, OBJ(o_Integer, 2000), 42).type == o_Nothing);
+}
+
+// Removed slots are reused, and do not hide other keys.
+static void
+test_table_remove_and_reinsert(void) {
+    int i, num = 1000;
+    for (int round = 0; round < 5; round++) {
+        for (i = 0; i < num; i++) {
+            expect_set(OBJ(o_Integer, i), OBJ(o_Integer, i + round));
+        }
+        for (i = 0; i < num; i += 2) {
+            expect_remove(OBJ(o_Integer, i));
+        }
+        for (i = 1; i < num; i += 2) {
+            expect_get(OBJ(o_Integer, i), OBJ(o_Integer, i + round));
+        }
+        for (i = 0; i < num; i += 2) {
+            expect_get(OBJ(o_Integer, i), OBJ_NOTHING);
+        }
+    }
+    TEST_ASSERT(tbl.length == (size_t) num / 2);
+}
+
+// Negative integer keys, which are not stored in the array part.
+#define KEY(i) OBJ(o_Integer, -1 - (i))
+
+// check that the iterator returns every KEY(i) with i in [0, num) once, other
+// than the removed even keys below [removed].
+static bool
+iterates_all(int num, int removed) {
+    int count[num];
+    memset(count, 0, sizeof(count));
+
+    tbl_it it = tbl_iterator(&tbl);
+    while (tbl_next(&it)) {
+        count[-1 - it.cur_key.data.integer]++;
+    }
+
+    for (int i = 0; i < num; i++) {
+        int expected = i < removed && i % 2 == 0 ? 0 : 1;
+        if (count[i] != expected) {
+            printf("iterator found object %d %d times, expected %d\n",
+                    i, count[i], expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+test_table_incremental_resize(void) {
+    int i, num = 20000, removed = 0;
+    bool resized_incrementally = false;
+
+    for (i = 0; i < num; i++) {
+        expect_set(KEY(i), OBJ(o_Integer, i));
+
+        if (tbl._old.capacity > 0) {
+            resized_incrementally = true;
+
+            // remove keys from both the new and previous slots.
+            for (; removed < i / 2; removed += 2) {
+                expect_remove(KEY(removed));
+            }
+            if (i % 97 == 0) {
+                TEST_ASSERT(iterates_all(i + 1, removed));
+            }
+        }
+    }
+    TEST_ASSERT(resized_incrementally);
+    TEST_ASSERT(iterates_all(num, removed));
+
+    for (i = 0; i < num; i++) {
+        Object expected = i < removed && i % 2 == 0
+            ? OBJ_NOTHING : OBJ(o_Integer, i);
+        expect_get(KEY(i), expected);
+    }
+}
+
+static void
+test_table_array_part(void) {
+    int i, num = 200;
+    CharBuffer string = { .data = "a", .length = 1 };
+
+    // moved from the hash part when the array part grows.
+    expect_set(OBJ(o_Integer, 100), OBJ(o_Integer, -100));
+    expect_set(OBJ(o_String, .string = &string), OBJ(o_Integer, 1));
+    TEST_ASSERT(tbl._array_capacity == 0);
+
+    for (i = 0; i < num; i++) {
+        if (i != 100) { expect_set(OBJ(o_Integer, i), OBJ(o_Integer, -i)); }
+    }
+    TEST_ASSERT(tbl._array_capacity >= (size_t) num);
+    TEST_ASSERT(tbl.length == (size_t) num + 1);
+
+    // sparse keys stay in the hash part.
+    expect_set(OBJ(o_Integer, 1 << 20), OBJ(o_Integer, 1));
+    TEST_ASSERT(tbl._array_capacity < 1 << 20);
+
+    int found = 0;
+    tbl_it it = tbl_iterator(&tbl);
+    while (tbl_next(&it)) {
+        if (it.cur_key.type == o_Integer && it.cur_key.data.integer < num) {
+            TEST_ASSERT(it.cur_val.data.integer == -it.cur_key.data.integer);
+            found++;
+        }
+    }
+    TEST_ASSERT(found == num);
+
+    // back to the hash part when mostly empty.
+    for (i = 0; i < num - 5; i++) {
+        expect_remove(OBJ(o_Integer, i));
+    }
+    TEST_ASSERT(tbl._array_capacity == 0);
+    for (i = 0; i < num; i++) {
+        expect_get(OBJ(o_Integer, i),
+                i < num - 5 ? OBJ_NOTHING : OBJ(o_Integer, -i));
+    }
+    expect_get(OBJ(o_Integer, 1 << 20), OBJ(o_Integer, 1));
+}
+
+static void
+test_table_small(void) {
+    int i, num = GROUP_SIZE * 2;
+
+    // negative keys, which are never in the array part.
+    for (i = 0; i < 3; i++) {
+        expect_set(OBJ(o_Integer, -1 - i), OBJ(o_Integer, i));
+    }
+    TEST_ASSERT(tbl._slots.capacity < GROUP_SIZE);
+    TEST_ASSERT(table_memory(&tbl) < GROUP_SIZE * sizeof(Object));
+
+    expect_remove(OBJ(o_Integer, -2));
+    expect_set(OBJ(o_Integer, -100), OBJ(o_Integer, 100));
+    expect_get(OBJ(o_Integer, -1), OBJ(o_Integer, 0));
+    expect_get(OBJ(o_Integer, -2), OBJ_NOTHING);
+    expect_get(OBJ(o_Integer, -3), OBJ(o_Integer, 2));
+    expect_get(OBJ(o_Integer, -100), OBJ(o_Integer, 100));
+    expect_remove(OBJ(o_Integer, -100));
+
+    // grows into groups.
+    for (i = 3; i < num; i++) {
+        expect_set(OBJ(o_Integer, -1 - i), OBJ(o_Integer, i));
+    }
+    TEST_ASSERT(tbl._slots.capacity >= GROUP_SIZE);
+    for (i = 0; i < num; i++) {
+        expect_get(OBJ(o_Integer, -1 - i),
+                   i == 1 ? OBJ_NOTHING : OBJ(o_Integer, i));
+    }
+}
+
+static void
+test_table_shapes(void) {
+    Shape *root = shape_new_root();
+    TEST_ASSERT_NOT_NULL_MESSAGE(root, "shape_new_root");
+    table_free(&tbl);
+    table_init_shaped(&tbl, root);
+
+    CharBuffer x = { .data = "x", .length = 1 },
+               x2 = { .data = "x", .length = 1 },
+               y = { .data = "y", .length = 1 };
+    Object key_x = OBJ(o_String, .string = &x),
+           key_y = OBJ(o_String, .string = &y);
+
+    expect_set(key_x, OBJ(o_Integer, 1));
+    expect_set(key_y, OBJ(o_Integer, 2));
+    expect_set(key_x, OBJ(o_Integer, 3));
+    Shape *shape = table_shape(&tbl);
+    TEST_ASSERT(shape != NULL && shape->num_keys == 2);
+    TEST_ASSERT(shape_index(shape, OBJ(o_String, .string = &x2)) == 0);
+    expect_get(OBJ(o_String, .string = &x2), OBJ(o_Integer, 3));
+    expect_get(key_y, OBJ(o_Integer, 2));
+
+    // Tables with the same keys in the same order share a Shape.
+    Table other;
+    table_init_shaped(&other, root);
+    table_set(&other, key_x, OBJ(o_Integer, 4));
+    table_set(&other, key_y, OBJ(o_Integer, 5));
+    TEST_ASSERT(table_shape(&other) == shape);
+    table_free(&other);
+
+    // keys which are not Strings switch to dictionary mode.
+    expect_set(OBJ(o_Integer, 0), OBJ(o_Integer, 6));
+    TEST_ASSERT(table_shape(&tbl) == NULL);
+    TEST_ASSERT(tbl.length == 3);
+    expect_get(key_x, OBJ(o_Integer, 3));
+    expect_get(key_y, OBJ(o_Integer, 2));
+    expect_get(OBJ(o_Integer, 0), OBJ(o_Integer, 6));
+
+    // and so do removed keys.
+    table_init_shaped(&other, root);
+    table_set(&other, key_x, OBJ(o_Integer, 1));
+    table_set(&other, key_y, OBJ(o_Integer, 2));
+    TEST_ASSERT(table_remove(&other, key_x).data.integer == 1);
+    TEST_ASSERT(table_shape(&other) == NULL && other.length == 1);
+    TEST_ASSERT(table_get(&other, key_y).data.integer == 2);
+    table_free(&other);
+
+    // too many keys.
+    char names[MAX_SHAPE_KEYS + 1][12];
+    CharBuffer strings[MAX_SHAPE_KEYS + 1];
+    table_init_shaped(&other, root);
+    for (int i = 0; i <= MAX_SHAPE_KEYS; i++) {
+        snprintf(names[i], sizeof(names[i]), "k%d", i);
+        strings[i] = (CharBuffer){ .data = names[i], .length = strlen(names[i]) };
+        table_set(&other, OBJ(o_String, .string = &strings[i]),
+                  OBJ(o_Integer, i));
+        TEST_ASSERT((table_shape(&other) == NULL) == (i == MAX_SHAPE_KEYS));
+    }
+    TEST_ASSERT(other.length == MAX_SHAPE_KEYS + 1);
+    for (int i = 0; i <= MAX_SHAPE_KEYS; i++) {
+        Object val = table_get(&other, OBJ(o_String, .string = &strings[i]));
+        TEST_ASSERT(val.type == o_Integer && val.data.integer == i);
+    }
+    table_free(&other);
+
+    shape_free(root);
+}
+
 static void
 expect_set(Object key, Object val) {
     Object res = table_set(&tbl, key, val);
@@ -201,5 +447,11 @@ int main(void) {
     RUN_TEST(test_table_set_get);
     RUN_TEST(test_table_iterator_and_expand);
     RUN_TEST(test_table_remove);
+    RUN_TEST(test_table_key_equality);
+    RUN_TEST(test_table_remove_and_reinsert);
+    RUN_TEST(test_table_incremental_resize);
+    RUN_TEST(test_table_array_part);
+    RUN_TEST(test_table_small);
+    RUN_TEST(test_table_shapes);
     return UNITY_END();
 }
@@ -1,6 +1,7 @@
 #include "unity/unity.h"
 #include "helpers.h"
 
+#include "../src/allocation.h"
 #include "../src/vm.h"
 #include "../src/table.h"
 
@@ -9,8 +10,25 @@
 void setUp(void) {}
 void tearDown(void) {}
 
+// Collect garbage often, to find objects which are freed while in use.
+static const GCConfig StressGC = {
+    .nursery_size = 1024,
+    .heap_growth_percent = 50,
+    .min_heap_size = 4096,
+    .max_heap_size = 0,
+};
+
+// see vm_set_max_stack().
+static int max_stack_size = DefaultMaxStackSize;
+
+// see vm_set_jit() and vm_set_registers(), main() runs the tests without
+// and with the JIT, and with register-based instructions.
+static int jit_threshold = 0;
+static bool registers = false;
+
 static void vm_test(char *input, Test *expected);
 static void vm_test_error(char *input, char *expected_error);
+static void vm_test_stack_trace(char *input, char *expected_trace);
 
 static void
 test_integer_arithmetic(void) {
@@ -37,6 +55,199 @@ test_integer_arithmetic(void) {
     vm_test_error("0 / 0", "division by zero");
 }
 
+// the instructions of [add] and [lt] are quickened for the types of the
+// first call, and rewritten when called with other types.  They are assigned
+// so that the calls are not inlined.
+#define QUICKENING_PRELUDE \
+    "let add = 0; let lt = 0;" \
+    "add = fn(a, b) { a + b }; lt = fn(a, b) { a < b };"
+
+static void
+test_quickening(void) {
+    vm_test(QUICKENING_PRELUDE "add(1, 2); add(3, 4)", TEST(int, 7));
+    vm_test(QUICKENING_PRELUDE "add(1, 2); add(1.5, 2.5)", TEST(float, 4.0));
+    vm_test(QUICKENING_PRELUDE "add(1.5, 2.5); add(1, 2)", TEST(int, 3));
+    vm_test(QUICKENING_PRELUDE "add(1, 2); add(\"a\", \"b\")", TEST(str, "ab"));
+    vm_test(QUICKENING_PRELUDE "add(\"a\", \"b\"); add(1, 2)", TEST(int, 3));
+    vm_test(QUICKENING_PRELUDE "lt(1, 2); lt(2.5, 1.5)", TEST(bool, false));
+    vm_test(QUICKENING_PRELUDE "lt(2.5, 1.5); lt(1, 2)", TEST(bool, true));
+    vm_test_error(QUICKENING_PRELUDE "add(1, 2); add(9223372036854775807, 1)",
+                  "integer overflow");
+    vm_test_error(QUICKENING_PRELUDE "add(1, 2); add(1, 2.5)",
+                  "unkown operation: integer + float");
+    vm_test_error("let div = 0; div = fn(a, b) { a / b };"
+                  "div(1.5, 2.); div(1., 0.)",
+                  "division by zero");
+}
+
+// the generic operation runs if the operands of a superinstruction are not
+// Integers.  The functions are assigned so that the calls are not inlined.
+#define SUPERINSTRUCTIONS_PRELUDE \
+    "let inc = 0; let eq = 0; let lt = 0;" \
+    "inc = fn(a) { a += 1; a }; eq = fn(a, b) { if (a == b) { 1 } };" \
+    "lt = fn(a, b) { if (a < b) { 1 } else { 2 } };"
+
+static void
+test_superinstructions(void) {
+    vm_test("let count = fn(n) { let i = 0; while (i < n) { i += 1 }; i };"
+            "count(10)", TEST(int, 10));
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "inc(1)", TEST(int, 2));
+    vm_test("fn() { let s = \"a\"; s += \"b\"; s }()", TEST(str, "ab"));
+    vm_test("fn() { let f = 0.5; f += 1.5; f }()", TEST(float, 2.0));
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "eq(1, 1)", TEST(int, 1));
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "eq(1, 2)", NOTHING);
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "eq(\"a\", \"a\")", TEST(int, 1));
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "eq(1, \"a\")", NOTHING);
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "lt(1, 2)", TEST(int, 1));
+    vm_test(SUPERINSTRUCTIONS_PRELUDE "lt(2.5, 1.5)", TEST(int, 2));
+    vm_test_error(SUPERINSTRUCTIONS_PRELUDE "inc(9223372036854775807)",
+                  "integer overflow");
+    vm_test_error(SUPERINSTRUCTIONS_PRELUDE "inc(0.5)",
+                  "unkown operation: float + integer");
+    vm_test_error(SUPERINSTRUCTIONS_PRELUDE "inc(\"a\")",
+                  "unkown operation: string + integer");
+    vm_test_error(SUPERINSTRUCTIONS_PRELUDE "lt(\"a\", 1)",
+                  "unkown operation: string < integer");
+}
+
+static void
+test_inlining(void) {
+    vm_test("let double = fn(x) { x * 2 }; fn() { double(3) + double(4) }()",
+            TEST(int, 14));
+    vm_test("let double = fn(x) { x * 2 }; double(double(5))", TEST(int, 20));
+    vm_test("fn() {"
+            "   let max = fn(a, b) { if (a > b) { a } else { b } };"
+            "   max(1, 2) + max(4, 3)"
+            "}()", TEST(int, 6));
+    vm_test("let x = fn(t) { t[\"x\"] };"
+            "x({\"x\": 1}) + x({\"y\": 0, \"x\": 2})", TEST(int, 3));
+    vm_test("let f = fn() { let a = 1; }; f()", NOTHING);
+    vm_test("let inc = fn(x) { x + 1 }; let s = 0;"
+            "for (let i = 0; i < 10; i += 1) { s = inc(s) }; s", TEST(int, 10));
+    vm_test("let f = fn(a) { a }; f(1); f = fn(a) { 2 }; f(1)", TEST(int, 2));
+    vm_test_error("let double = fn(x) { x * 2 }; double(\"a\")",
+                  "unkown operation: string * integer");
+
+    // inlined calls are shown in stack traces.
+    vm_test_stack_trace(
+        "let g = fn(c) {\n"
+        "  return c + 1;\n"
+        "};\n"
+        "g(1);\n"
+        "g(\"s\");",
+        "<main function>, line 5\n"
+        "  g(\"s\");\n"
+        "  ^^^^^^\n"
+        "<function: g>, line 2\n"
+        "  return c + 1;\n"
+        "           ^\n");
+    vm_test_stack_trace(
+        "let h = fn(x) { x * 2 };\n"
+        "let g = fn(y) { h(y) };\n"
+        "let f = fn() {\n"
+        "  g(\"s\")\n"
+        "};\n"
+        "f();",
+        "<main function>, line 6\n"
+        "  f();\n"
+        "  ^^^\n"
+        "<function: f>, line 4\n"
+        "  g(\"s\")\n"
+        "  ^^^^^^\n"
+        "<function: g>, line 2\n"
+        "  let g = fn(y) { h(y) };\n"
+        "                  ^^^^\n"
+        "<function: h>, line 1\n"
+        "  let h = fn(x) { x * 2 };\n"
+        "                    ^\n");
+
+    // not always bound.
+    vm_test_error("let c = false; if (c) { let g = fn() { 1 } }; g()",
+                  "calling non-function and non-builtin");
+}
+
+static void
+test_call_caches(void) {
+    vm_test("let fs = [fn() { 1 }, fn() { 2 }, fn() { 3 }]; let s = 0;"
+            "for (let i = 0; i < 6; i += 1) { let f = fs[i / 2]; s = s + f() };"
+            "s", TEST(int, 12));
+    vm_test("let f = 0; f = fn(g) { g(2) };"
+            "f(fn(a) { a }) + f(fn(a) { a * 3 }) + f(fn(a) { a })", TEST(int, 10));
+    vm_test("let f = 0; f = fn(g) { g(\"ab\") }; f(len) + f(fn(a) { 1 }) + f(len)",
+            TEST(int, 5));
+    vm_test_error("let f = 0; f = fn(g) { g(1) + 1 };"
+                  "f(fn(a) { a }); f(fn(a, b) { a })",
+                  "<anonymous function> takes 2 arguments got 1");
+
+    // recursive calls
+    vm_test("let sum = fn(n) { if (n == 0) { 0 } else { n + sum(n - 1) } };"
+            "sum(100)", TEST(int, 5050));
+    vm_test("let count = fn(n, acc) {"
+            "   if (n == 0) { acc } else { count(n - 1, acc + 1) }"
+            "}; count(100000, 0)", TEST(int, 100000));
+    vm_test_error("let f = fn(a) { f() }; f(1)", "f takes 1 argument got 0");
+}
+
+// Slow paths of machine code, which exit to the interpreter.
+static void
+test_jit(void) {
+    vm_test("let a = 1; let b = 2; let n = 0;"
+            "for (let i = 0; i < 6; i += 1) {"
+            "   if (i == 3) { a = 1.5; b = 2.5 }; n = a + b"
+            "}; n", TEST(float, 4.0));
+    vm_test("let s = \"\"; let i = 0; while (i < 3) { s = s + \"a\"; i += 1 };"
+            "len(s) + i", TEST(int, 6));
+    vm_test("let f = fn(a, b) {"
+            "   let lt = a < b; let eq = a == b;"
+            "   if (lt) { 1 } else { if (eq) { 10 } else { 100 } }"
+            "};"
+            "f(1, 2) + f(2, 2) + f(3, 2) + f(1.5, 2.5) + f(2.5, 2.5) + f(3.5, 2.5)",
+            TEST(int, 222));
+    vm_test("let t = [true, 1, false, [], 0]; let n = 0;"
+            "for (let i = 0; i < len(t); i += 1) { if (t[i]) { n += 1 } }; n",
+            TEST(int, 2));
+    vm_test_error("let a = 1; for (let i = 0; i < 100; i += 1) { a = a * 1000 }",
+                  "integer overflow: multiplication");
+    vm_test_error("let f = 0; f = fn(n) { 10 / n }; f(2); f(1); f(0)",
+                  "division by zero");
+    vm_test_error("for (let i = 0; i < 10; i += 1) { i < \"a\" }",
+                  "unkown operation: integer < string");
+}
+
+// Register-based instructions, which keep local variables and constants on
+// the stack where they are until they have to be stored.
+static void
+test_registers(void) {
+    vm_test("let f = fn(a, b) { let m = if (a < b) { a } else { b }; m * 2 };"
+            "f(3, 2) + f(1, 5)", TEST(int, 6));
+    vm_test("let f = fn(a) { let b = a; a = a + 1; b * 10 + a }; f(1)",
+            TEST(int, 12));
+    vm_test("let f = fn(a, c) { a + if (c) { a = 5; 1 } else { 2 } + a };"
+            "f(1, true)", TEST(int, 7));
+    vm_test("let f = fn(n) {"
+            "   let x = 0; for (let i = 0; i < n; i += 1) { x = -x + i }; x"
+            "}; f(5)", TEST(int, 2));
+    vm_test("let f = fn(a, b) { [a, a + b] };"
+            "f(1, 2)[1] + len(f(\"x\", \"y\")[1])", TEST(int, 5));
+}
+
+static void
+test_constant_folding(void) {
+    vm_test("(10 / 2) * 5 + 30", TEST(int, 55));
+    vm_test("\"con\" + \"fig\" == \"config\"", TEST(bool, true));
+    vm_test("-2.5 * 2. < -4.9", TEST(bool, true));
+    vm_test("1 == \"1\"", TEST(bool, false));
+    vm_test("!0", TEST(bool, false));
+    vm_test("if (1 > 2) { 1 } else { 2 }", TEST(int, 2));
+    vm_test("let a = 0; while (false) { a = 1; break }; a", TEST(int, 0));
+    vm_test("let a = 0; for (;;) { a += 1; if (a > 3) { break; a = 10 } }; a",
+            TEST(int, 4));
+    vm_test("fn() { if (true) { return 1; 2 } else { return 3 }; 4 }()",
+            TEST(int, 1));
+    vm_test_error("1 + (9223372036854775807 + 1)", "integer overflow");
+    vm_test_error("2 / (1 - 1)", "division by zero");
+}
+
 static void
 test_boolean_expressions(void) {
     vm_test("true", TEST(bool, true));
@@ -84,6 +295,17 @@ test_conditionals(void) {
     vm_test("if (false) { 10 }", NOTHING);
     vm_test("!(if (false) { 5; })", TEST(bool, true));
     vm_test("if ((if (false) { 10 })) { 10 } else { 20 }", TEST(int, 20));
+
+    // comparisons of conditions jump without pushing their result.
+    vm_test("let f = fn(a, b) { if (a < b) { 1 } else { 2 } };"
+            "f(1, 2) * 10 + f(2, 1) + f(0.5, 0.5) * 100",
+            TEST(int, 212));
+    vm_test("let f = fn(a, b) { if (a > b) { 1 } else { 2 } }; f(1.5, 0.5)",
+            TEST(int, 1));
+    vm_test("let f = fn(a, b) { if (a == b) { 1 } else { 2 } }; f(0.5, 0.5)",
+            TEST(int, 1));
+    vm_test("let f = fn(a, b) { if (a != b) { 1 } else { 2 } }; f(\"a\", \"a\")",
+            TEST(int, 2));
 }
 
 // Truthy:
@@ -122,12 +344,45 @@ test_string_expressions(void) {
     vm_test("\"monkey\"", TEST(str, "monkey"));
     vm_test("\"mon\" + \"key\"", TEST(str, "monkey"));
     vm_test("\"mon\" + \"key\" + \"banana\"", TEST(str, "monkeybanana"));
+    vm_test("\"mon\" + \"key\" == \"monkey\"", TEST(bool, true));
+    vm_test("\"mon\" + \"key\" == \"monkez\"", TEST(bool, false));
+    vm_test("\"mon\" == \"monkey\"", TEST(bool, false));
+    vm_test(
+        "\
+        let tbl = {\"monkey\": 1};\
+        tbl[\"mon\" + \"key\"] + tbl[\"monk\" + \"ey\"]\
+        ",
+        TEST(int, 2)
+    );
 }
 
 // 0-terminated array of integers.
 static IntArray make_int_array(int n, ...);
 #define INT_ARR(...) TEST(arr, make_int_array(__VA_ARGS__, 0))
 
+static void
+test_type_inference(void) {
+    vm_test("let a = 7; let b = 2; [a + b, a - b, a * b, a / b]",
+            INT_ARR(9, 5, 14, 3));
+    vm_test("let a = 1.5; let b = 0.5; a * b - a / b + a", TEST(float, -0.75));
+    vm_test("let a = 1; let b = 2; a < b == (b > a) == (a != b)",
+            TEST(bool, true));
+    vm_test("let a = 1.; let b = 2.; a < b == (b > a) == (a == b)",
+            TEST(bool, false));
+    vm_test("fn() {"
+            "   let a = [1, 2, 3]; let s = 0;"
+            "   for (let i = 0; i < len(a); i += 1) {"
+            "       a[i] = a[i] * i + s + 1; s += i"
+            "   };"
+            "   a"
+            "}()", INT_ARR(1, 3, 8));
+    vm_test("let a = [1]; let i = -1; a[i]", NOTHING);
+    vm_test("let a = 1; let f = fn() { a = \"a\" }; f(); a + a",
+            TEST(str, "aa"));
+    vm_test_error("let a = 9223372036854775807; a + 1", "integer overflow");
+    vm_test_error("let a = 0; 1 / a", "division by zero");
+}
+
 static void
 test_array_literals(void) {
     vm_test("[]", INT_ARR(0));
@@ -164,6 +419,53 @@ test_index_expressions(void) {
     vm_test("{}[0]", NOTHING);
 }
 
+static void
+test_table_fields(void) {
+    vm_test("{\"x\": 1, \"y\": 2}[\"y\"]", TEST(int, 2));
+    vm_test("{\"x\": 1}[\"y\"]", NOTHING);
+    vm_test_error("[1][\"x\"]", "cannot index array with string");
+    vm_test("let t = {\"x\": 1}; t[\"x\"] = 2; t[\"x\"]", TEST(int, 2));
+    vm_test("let t = {\"x\": 1}; t[\"y\"] = \"a\"; t[\"y\"]",
+            TEST(str, "a"));
+    vm_test("let t = {\"x\": 1}; t[\"x\"] = nothing; len(t)", TEST(int, 0));
+
+    // the same instructions with Tables of different Shapes.
+    vm_test(
+        "\
+        let get = fn(t) { t[\"y\"] };\
+        let set = fn(t, v) { t[\"y\"] = v; };\
+        let a = {\"x\": 1, \"y\": 2};\
+        let b = {\"y\": 3};\
+        let c = {\"y\": 4, 1: 1};\
+        let sum = 0;\
+        for (let i = 0; i < 3; i += 1) {\
+            sum += get(a) + get(b) + get(c);\
+            set(a, get(a) + 1); set(b, get(b) + 1); set(c, get(c) + 1);\
+        };\
+        sum + get({\"y\": 100, \"x\": 0})\
+        ",
+        TEST(int, 136)
+    );
+
+    // keys added after the Table is created, and past [MAX_SHAPE_KEYS].
+    vm_test(
+        "\
+        let t = {};\
+        let keys = [];\
+        let k = \"\";\
+        for (let i = 0; i < 20; i += 1) {\
+            k = k + \"k\";\
+            push(keys, k);\
+            t[k] = i;\
+        };\
+        let sum = 0;\
+        for (let i = 0; i < 20; i += 1) { sum += t[keys[i]]; };\
+        t[\"kkk\"] + sum\
+        ",
+        TEST(int, 192)
+    );
+}
+
 static void
 test_calling_functions_without_arguments(void) {
     vm_test(
@@ -226,7 +528,7 @@ test_functions_without_return_value(void) {
     );
 
     vm_test_error(
-        "let infRec = fn() { infRec(); }; infRec()",
+        "let infRec = fn() { 1 + infRec(); }; infRec()",
         "exceeded maximum function call stack"
     );
 }
@@ -407,6 +709,7 @@ test_builtin_functions(void) {
         ",
         INT_ARR(1, 2)
     );
+    vm_test("copy(\"monkey\")", TEST(str, "monkey"));
     vm_test("type([])", TEST(str, "array"));
     vm_test("type({})", TEST(str, "table"));
     vm_test("type(1) != type(1.0)", TEST(bool, true));
@@ -542,6 +845,34 @@ test_recursive_functions(void) {
         ",
         TEST(int, 0)
     );
+
+    // tail calls do not use up Frames.
+    vm_test(
+        "\
+        let map = fn(arr, f) {\
+            let iter = fn(arr, accumulated) {\
+                if (len(arr) == 0) {\
+                    accumulated\
+                } else {\
+                    iter(rest(arr), push(accumulated, f(first(arr))));\
+                }\
+            };\
+            iter(arr, []);\
+        };\
+        let arr = [];\
+        for (let i = 0; i < 3000; i += 1) { arr = push(arr, i); };\
+        let doubled = map(arr, fn(x) { x * 2 });\
+        doubled[2999]\
+        ",
+        TEST(int, 5998)
+    );
+    vm_test(
+        "\
+        let sum = fn(n, acc) { if (n == 0) { return acc; }; sum(n - 1, acc + 2) };\
+        sum(100000, 0)\
+        ",
+        TEST(int, 200000)
+    );
 }
 
 static void
@@ -781,6 +1112,139 @@ test_loop(void) {
     );
 }
 
+static void
+test_garbage_collection(void) {
+    // young objects stored in old ones must survive minor collections.
+    vm_test(
+        "\
+        let keep = [[0]];\
+        let tbl = {\"k\": [0]};\
+        let sum = 0;\
+        for (let i = 1; i < 301; i += 1) {\
+            sum = sum + keep[0][0] + tbl[\"k\"][0];\
+            keep[0] = [i];\
+            tbl[\"k\"] = [i, \"str\" + \"ing\"];\
+            push(keep, [i]);\
+            let garbage = [i, i, i];\
+        };\
+        for (let i = 1; i < 301; i += 1) {\
+            sum = sum - keep[i][0];\
+        };\
+        sum\
+        ",
+        TEST(int, 299 * 300 - 300 * 301 / 2)
+    );
+    vm_test(
+        "\
+        let counter = fn() {\
+            let count = [0];\
+            fn() { count = [count[0] + 1]; count[0] }\
+        }();\
+        for (let i = 0; i < 300; i += 1) {\
+            counter();\
+            let garbage = [i, i, i];\
+        };\
+        counter()\
+        ",
+        TEST(int, 301)
+    );
+    vm_test(
+        "\
+        let cycle = [];\
+        push(cycle, cycle);\
+        for (let i = 0; i < 300; i += 1) { let garbage = [i, i, i]; };\
+        len(cycle[0])\
+        ",
+        TEST(int, 1)
+    );
+}
+
+static void
+test_gc_config(void) {
+    GCConfig config = DefaultGCConfig;
+    error err = parse_gc_config(&config, "nursery=2k,growth=100,min=3M,max=1g");
+    if (err) {
+        printf("parse_gc_config error: %s\n", err->message);
+        free_error(err);
+        TEST_FAIL();
+    }
+    TEST_ASSERT(config.nursery_size == 2048);
+    TEST_ASSERT(config.heap_growth_percent == 100);
+    TEST_ASSERT(config.min_heap_size == 3 * 1024 * 1024);
+    TEST_ASSERT(config.max_heap_size == 1024 * 1024 * 1024);
+
+    char *invalid[][2] = {
+        {"nursery", "gc option 'nursery' expects a value"},
+        {"min=1x", "invalid value for gc option 'min=1x'"},
+        {"max=", "invalid value for gc option 'max='"},
+        {"size=1", "unknown gc option 'size'"},
+        {"nursery=-1", "invalid value for gc option 'nursery=-1'"},
+        {"nursery=99999999999g",
+         "invalid value for gc option 'nursery=99999999999g'"},
+        {"nursery=0", "gc option 'nursery=0' must be positive"},
+        {"growth=4294967297", "gc option 'growth=4294967297' is too large"},
+        {"min=2g,max=1k", "gc option 'min' is greater than 'max'"},
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        config = DefaultGCConfig;
+        err = parse_gc_config(&config, invalid[i][0]);
+        TEST_ASSERT_NOT_NULL_MESSAGE(err, invalid[i][0]);
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(invalid[i][1], err->message,
+                invalid[i][0]);
+        free_error(err);
+    }
+}
+
+static void
+test_stack_growth(void) {
+    // deeper than the initial stack and Frames.
+    char *input = "\
+        let count = fn(n) { if (n == 0) { 0 } else { 1 + count(n - 1) } };\
+        count(5000)\
+    ";
+    vm_test(input, TEST(int, 5000));
+
+    max_stack_size = 1000;
+    vm_test_error(input, "stack overflow");
+    vm_test_error("let f = fn() { f() + 1 }; f()",
+                  "exceeded maximum function call stack");
+
+    // less than the initial stack and Frames.
+    max_stack_size = 10;
+    vm_test("\
+        let count = fn(n) { if (n == 0) { 0 } else { 1 + count(n - 1) } };\
+        count(1)\
+    ", TEST(int, 1));
+    vm_test_error("\
+        let count = fn(n) { if (n == 0) { 0 } else { 1 + count(n - 1) } };\
+        count(20)\
+    ", "stack overflow");
+    max_stack_size = DefaultMaxStackSize;
+}
+
+// more local variables, and a longer jump, than fit in one and two bytes.
+static void
+test_large_functions(void) {
+    char *input = NULL;
+    size_t length;
+    FILE *s = open_memstream(&input, &length);
+    TEST_ASSERT_NOT_NULL_MESSAGE(s, "open_memstream fail");
+
+    fprintf(s, "let f = fn() {");
+    for (int i = 0; i < 300; i++) {
+        fprintf(s, " let v%d = %d;", i, i);
+    }
+    fprintf(s, " let n = 0; if (v299 > 0) {");
+    for (int i = 0; i < 10000; i++) {
+        fprintf(s, " n += 1;");
+    }
+    fprintf(s, " }; n + v299 }; f()");
+    fclose(s);
+
+    vm_test(input, TEST(int, 10299));
+    free(input);
+}
+
 static void
 test_modules(void) {
     vm_test("require(\"tests/modules/hello.monke\")", TEST(str, "Hello, World!"));
@@ -907,7 +1371,7 @@ test_expected_object(Test expected, Object actual) {
                     return -1;
                 }
 
-                ObjectBuffer *arr = actual.data.ptr;
+                Array *arr = actual.data.array;
                 IntArray exp_arr = expected.val._arr;
 
                 if (exp_arr.length != arr->length) {
@@ -918,7 +1382,7 @@ test_expected_object(Test expected, Object actual) {
 
                 int err;
                 for (int i = 0; i < exp_arr.length; i++) {
-                    err = test_integer_object(exp_arr.data[i], arr->data[i]);
+                    err = test_integer_object(exp_arr.data[i], array_get(arr, i));
                     if (err != 0) {
                         printf("test array element %d: test_integer_object failed", i);
                         return -1;
@@ -984,6 +1448,10 @@ vm_test(char *input, Test *expected) {
     compiler_init(&c);
 
     vm_init(&vm, &c);
+    gc_configure(&vm, StressGC);
+    vm_set_max_stack(&vm, max_stack_size);
+    vm_set_jit(&vm, jit_threshold);
+    vm_set_registers(&vm, registers);
 
     Program prog = parse_(input);
 
@@ -1060,14 +1528,20 @@ cleanup:
     }
 }
 
+// vm_test_error(), and compare the output of print_vm_stack_trace() with
+// [expected_trace] if not NULL.
 static void
-vm_test_error(char *input, char *expected_error) {
+_vm_test_error(char *input, char *expected_error, char *expected_trace) {
     bool fail = false;
 
     Compiler c;
     compiler_init(&c);
 
     vm_init(&vm, &c);
+    gc_configure(&vm, StressGC);
+    vm_set_max_stack(&vm, max_stack_size);
+    vm_set_jit(&vm, jit_threshold);
+    vm_set_registers(&vm, registers);
 
     Program prog = parse_(input);
 
@@ -1083,10 +1557,26 @@ vm_test_error(char *input, char *expected_error) {
         printf("expected VM error for test: %s\n", input);
         fail = true;
 
-    } else if (strcmp(err->message, expected_error) != 0) {
+    } else if (expected_error
+            && strcmp(err->message, expected_error) != 0) {
         printf("wrong VM error\nwant= %s\ngot = %s\n",
                 expected_error, err->message);
         fail = true;
+
+    } else if (expected_trace) {
+        char *trace = NULL;
+        size_t len;
+        FILE *fp = open_memstream(&trace, &len);
+        TEST_ASSERT_NOT_NULL_MESSAGE(fp, "open_memstream fail");
+        print_vm_stack_trace(&vm, fp);
+        fclose(fp);
+
+        if (strcmp(trace, expected_trace) != 0) {
+            printf("wrong stack trace\nwant=\n%s\ngot=\n%s\n",
+                    expected_trace, trace);
+            fail = true;
+        }
+        free(trace);
     }
 
     vm_free(&vm);
@@ -1102,10 +1592,26 @@ cleanup:
     }
 }
 
-int main(void) {
-    UNITY_BEGIN();
+static void
+vm_test_error(char *input, char *expected_error) {
+    _vm_test_error(input, expected_error, NULL);
+}
+
+static void
+vm_test_stack_trace(char *input, char *expected_trace) {
+    _vm_test_error(input, NULL, expected_trace);
+}
+
+static void
+run_tests(void) {
     RUN_TEST(test_integer_arithmetic);
+    RUN_TEST(test_constant_folding);
+    RUN_TEST(test_inlining);
+    RUN_TEST(test_call_caches);
+    RUN_TEST(test_type_inference);
     RUN_TEST(test_boolean_expressions);
+    RUN_TEST(test_quickening);
+    RUN_TEST(test_superinstructions);
     RUN_TEST(test_conditionals);
     RUN_TEST(test_truthy);
     RUN_TEST(test_global_let_statements);
@@ -1113,6 +1619,7 @@ int main(void) {
     RUN_TEST(test_array_literals);
     RUN_TEST(test_table_literals);
     RUN_TEST(test_index_expressions);
+    RUN_TEST(test_table_fields);
     RUN_TEST(test_calling_functions_without_arguments);
     RUN_TEST(test_functions_without_return_value);
     RUN_TEST(test_first_class_functions);
@@ -1126,6 +1633,25 @@ int main(void) {
     RUN_TEST(test_assignments);
     RUN_TEST(test_free_variable_list);
     RUN_TEST(test_loop);
+    RUN_TEST(test_garbage_collection);
+    RUN_TEST(test_gc_config);
+    RUN_TEST(test_stack_growth);
+    RUN_TEST(test_large_functions);
     RUN_TEST(test_modules);
+    RUN_TEST(test_jit);
+    RUN_TEST(test_registers);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    run_tests();
+#ifdef JIT
+    // compile every function and loop to machine code right away.
+    jit_threshold = 1;
+    run_tests();
+#endif
+    jit_threshold = 1;
+    registers = true;
+    run_tests();
     return UNITY_END();
 }